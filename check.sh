@@ -0,0 +1,73 @@
+#!/bin/sh
+# Regression checks. The programs are assembled with nasm (or $NASM), and
+#   - the listing of every listing_*.asm program, plain and with --follow,
+#     must assemble back to the same bytes;
+#   - the listing_*.asm programs and a generated --bench stream must come back
+#     from --columns and --read-columns exactly as they are listed directly;
+#   - every regression_NAME.asm must run under --exec, --interpret and
+#     --check-flags to the final registers in regression_NAME.txt.
+#
+#   ./check.sh [path to sim86]
+set -u
+sim=${1:-./sim86}
+nasm=${NASM:-nasm}
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# Listings reassemble, and column files round trip.
+"$sim" --bench --generate "$tmp/bench_stream" --bench-bytes 1048576 --bench-repetitions 1 > /dev/null ||
+    fail "could not generate a benchmark stream"
+for source in listing_*.asm "$tmp/bench_stream"; do
+    case $source in
+        *.asm)
+            binary="$tmp/${source%.asm}"
+            if ! "$nasm" -o "$binary" "$source"; then
+                fail "$source does not assemble"
+                continue
+            fi
+            for listing in "" --follow; do
+                "$sim" $listing "$binary" > "$tmp/$source" &&
+                    "$nasm" -o "$tmp/reassembled" "$tmp/$source" &&
+                    cmp -s "$binary" "$tmp/reassembled" ||
+                    fail "$source${listing:+ $listing}: the listing does not assemble back to the same bytes"
+            done
+            ;;
+        *)
+            binary=$source
+            ;;
+    esac
+
+    "$sim" "$binary" > "$tmp/listing.txt"
+    "$sim" --columns "$tmp/columns" "$binary" &&
+        "$sim" --read-columns "$tmp/columns" > "$tmp/columns.txt" ||
+        fail "${source##*/}: --columns or --read-columns failed"
+    cmp -s "$tmp/listing.txt" "$tmp/columns.txt" || fail "${source##*/}: listing from the column file differs"
+done
+
+for source in regression_*.asm; do
+    name=${source%.asm}
+    if ! "$nasm" -o "$tmp/$name" "$source"; then
+        fail "$source does not assemble"
+        continue
+    fi
+
+    for mode in --exec --interpret --check-flags; do
+        "$sim" $mode "$tmp/$name" > "$tmp/$name.out"
+        status=$?
+        if [ $status -gt 1 ]; then
+            fail "$name $mode: exit status $status"
+            continue
+        fi
+        sed -n '/^; Final registers:/,$p' "$tmp/$name.out" | grep -v '^; \(Predecode\|Translated\|Flags check\)' > "$tmp/$name.txt"
+        cmp -s "$tmp/$name.txt" "$name.txt" || fail "$name $mode: final registers differ from $name.txt"
+    done
+done
+
+[ $failed -eq 0 ] && echo "All checks passed"
+exit $failed
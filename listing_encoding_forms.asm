@@ -0,0 +1,30 @@
+; ========================================================================
+; LISTING: ENCODING FORMS
+; ========================================================================
+; Instructions with more than one encoding. The listing has to name the
+; one that was decoded, or nasm picks a shorter one when reassembling.
+
+bits 16
+
+; Sign-extended byte immediates
+add ax, byte -1
+sub word [bx], byte -128
+cmp si, byte 5
+
+; Word immediates that would fit a byte
+add ax, strict word 5
+and word [bp + 2], strict word -2
+adc dx, strict word 127
+or cx, 1000
+
+; Near call and jumps to a close target
+call near next
+jmp near next
+jmp short next
+next:
+
+; Coprocessor escapes
+fadd st0, st1
+fld dword [bx]
+fstp qword [bp + 6]
+fild word [es:1000]
@@ -1,581 +1,6283 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
 
-int16_t abs(int16_t value) {
-    return value < 0 ? -value : value;
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "sim86.h"
+
+using namespace sim86;
+
+#define FRAGMENT(literal) text_fragment{ literal, sizeof(literal) - 1 }
+
+// Input bytes for the decoder. Regular files are mapped straight into memory,
+// anything else (pipes, stdin as "-") is read in large blocks into a heap buffer.
+struct input_buffer {
+    const uint8_t *data;
+    size_t size;
+    void *mapping;
+    uint8_t *owned;
+};
+
+bool read_stream(int fd, input_buffer *input) {
+    size_t capacity = 1 << 16;
+    size_t size = 0;
+    uint8_t *buffer = (uint8_t *) malloc(capacity);
+    if (!buffer) { return false; }
+
+    for (;;) {
+        if (size == capacity) {
+            capacity *= 2;
+            uint8_t *grown = (uint8_t *) realloc(buffer, capacity);
+            if (!grown) { free(buffer); return false; }
+            buffer = grown;
+        }
+
+        ssize_t count = read(fd, buffer + size, capacity - size);
+        if (count < 0) { free(buffer); return false; }
+        if (count == 0) { break; }
+        size += (size_t) count;
+    }
+
+    input->data = buffer;
+    input->size = size;
+    input->owned = buffer;
+    return true;
+}
+
+bool open_input(const char *filename, input_buffer *input) {
+    *input = {};
+
+    bool is_stdin = (strcmp(filename, "-") == 0);
+    int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) { return false; }
+
+    bool result = false;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        if (info.st_size == 0) {
+            result = true;
+        } else {
+            void *mapping = mmap(0, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                input->data = (const uint8_t *) mapping;
+                input->size = (size_t) info.st_size;
+                input->mapping = mapping;
+                result = true;
+            }
+        }
+    }
+
+    if (!result) {
+        result = read_stream(fd, input);
+    }
+
+    if (!is_stdin) { close(fd); }
+    return result;
 }
 
-int8_t abs(int8_t value) {
-    return value < 0 ? -value : value;
+void close_input(input_buffer *input) {
+    if (input->mapping) { munmap(input->mapping, input->size); }
+    free(input->owned);
+    *input = {};
 }
 
-const char * effective_addr_calculation[3][8] = {
-    // MOD = 00
-    [0][0] = "[bx + si]",      [0][1] = "[bx + di]",      [0][2] = "[bp + si]",      [0][3] = "[bp + di]",
-    [0][4] = "[si]",           [0][5] = "[di]",           [0][6] = "[%d]",           [0][7] = "[bx]",
-    // MOD = 01
-    [1][0] = "[bx + si %c %d]", [1][1] = "[bx + di %c %d]", [1][2] = "[bp + si %c %d]", [1][3] = "[bp + di %c %d]",
-    [1][4] = "[si %c %d]",      [1][5] = "[di %c %d]",      [1][6] = "[bp %c %d]",      [1][7] = "[bx %c %d]",
-    // MOD = 10
-    [2][0] = "[bx + si %c %d]", [2][1] = "[bx + di %c %d]", [2][2] = "[bp + si %c %d]", [2][3] = "[bp + di %c %d]",
-    [2][4] = "[si %c %d]",      [2][5] = "[di %c %d]",      [2][6] = "[bp %c %d]",      [2][7] = "[bx %c %d]"
+// Doubles the capacity of a heap array until it holds `needed` items.
+template <typename T>
+void grow_array(T **items, size_t *capacity, size_t needed, const char *what) {
+    if (needed <= *capacity) { return; }
+
+    size_t grown = *capacity ? *capacity * 2 : 64;
+    while (grown < needed) { grown *= 2; }
+
+    *items = (T *) realloc(*items, grown * sizeof(T));
+    if (!*items) {
+        fprintf(stderr, "[ERROR] Out of memory for %s\n", what);
+        exit(1);
+    }
+    *capacity = grown;
+}
+
+// Counters behind --stats. Every thread that reads, decodes or writes keeps its
+// own decode_stats and they are added together once it is done, so counting
+// never touches memory another thread writes. Nothing is counted when the
+// pointer passed around is null. What was decoded goes into an
+// instruction_histogram, either as the visitor of decode() or, where batches
+// are decoded, from the finished records: the bytes between one instruction and
+// the next are the unknown opcodes decode_batch skipped.
+// Phase times are wall time on the thread doing the work, summed over threads.
+enum stats_phase {
+    phase_read,         // opening, mapping or reading the input
+    phase_decode,       // decoding and formatting the listing text
+    phase_write,        // handing the text to the OS
+    phase_count
+};
+
+const char * phase_names[phase_count] = { "read", "decode", "write" };
+
+struct decode_stats {
+    uint64_t bytes_read;
+    uint64_t output_bytes;
+    instruction_histogram decoded;
+    double phase_seconds[phase_count];
 };
 
-const char * reg_rm_11[2][8] = {
-    // W = 0
-    [0][0] = "al", [0][1] = "cl", [0][2] = "dl", [0][3] = "bl",
-    [0][4] = "ah", [0][5] = "ch", [0][6] = "dh", [0][7] = "bh",
-    // W = 1
-    [1][0] = "ax", [1][1] = "cx", [1][2] = "dx", [1][3] = "bx",
-    [1][4] = "sp", [1][5] = "bp", [1][6] = "si", [1][7] = "di"
+inline double seconds_now() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec * 1e-9;
+}
+
+// Output written while a phase runs is timed as phase_write and is taken back
+// out of the phase.
+struct phase_timer {
+    double start;
+    double written;
 };
 
-enum mov_mode {
-    rm_to_rm,
-    imm_to_rm,
-    imm_to_r,
-    mem_to_acc,
-    acc_to_mem,
-    rm_to_seg,
-    seg_to_rm
+inline phase_timer start_phase(const decode_stats *stats) {
+    return { seconds_now(), stats->phase_seconds[phase_write] };
+}
+
+inline void end_phase(decode_stats *stats, phase_timer timer, stats_phase phase) {
+    double written = stats->phase_seconds[phase_write] - timer.written;
+    stats->phase_seconds[phase] += seconds_now() - timer.start - written;
+}
+
+inline void count_skipped(decode_stats *stats, const uint8_t *data, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+        stats->decoded.on_unknown((uint32_t) i, data[i]);
+    }
+}
+
+// `position` is where the instruction before the batch ended; it is moved past
+// the last one.
+void count_decoded(decode_stats *stats, const uint8_t *data, const instruction *batch, size_t count, size_t *position) {
+    for (size_t i = 0; i < count; ++i) {
+        const instruction *inst = &batch[i];
+        count_skipped(stats, data, *position, inst->offset);
+        stats->decoded.on_instruction(*inst);
+        *position = inst->offset + inst->length;
+    }
+}
+
+void merge_decode_stats(decode_stats *into, const decode_stats *from) {
+    into->bytes_read += from->bytes_read;
+    into->output_bytes += from->output_bytes;
+    merge_histograms(&into->decoded, &from->decoded);
+    for (uint32_t i = 0; i < phase_count; ++i) { into->phase_seconds[i] += from->phase_seconds[i]; }
+}
+
+// The report goes to stderr so it never mixes with a listing on stdout. Only
+// the families, modes and opcodes that occurred are listed.
+void print_decode_stats(const decode_stats *stats, bool json) {
+    const instruction_histogram *decoded = &stats->decoded;
+    uint64_t unknown = 0;
+    for (uint32_t i = 0; i < 256; ++i) { unknown += decoded->unknown_opcodes[i]; }
+
+    if (!json) {
+        fprintf(stderr, "; Stats: %llu bytes read, %llu instructions, %llu unknown bytes, %llu bytes written\n",
+                (unsigned long long) stats->bytes_read, (unsigned long long) decoded->instructions,
+                (unsigned long long) unknown, (unsigned long long) stats->output_bytes);
+        fprintf(stderr, ";   seconds:");
+        for (uint32_t i = 0; i < phase_count; ++i) {
+            fprintf(stderr, " %s %.6f", phase_names[i], stats->phase_seconds[i]);
+        }
+        fprintf(stderr, "\n;   families:");
+        for (uint32_t i = 0; i < family_count; ++i) {
+            if (decoded->families[i]) {
+                fprintf(stderr, " %s %llu", family_mnemonics[i].text, (unsigned long long) decoded->families[i]);
+            }
+        }
+        fprintf(stderr, "\n;   modes:");
+        for (uint32_t i = 0; i < decode_mode_count; ++i) {
+            if (decoded->modes[i]) {
+                fprintf(stderr, " %s %llu", decode_mode_names[i], (unsigned long long) decoded->modes[i]);
+            }
+        }
+        fprintf(stderr, "\n;   modrm mod: 00 %llu, 01 %llu, 10 %llu, 11 %llu\n",
+                (unsigned long long) decoded->modrm_mods[0], (unsigned long long) decoded->modrm_mods[1],
+                (unsigned long long) decoded->modrm_mods[2], (unsigned long long) decoded->modrm_mods[3]);
+        if (unknown) {
+            fprintf(stderr, ";   unknown opcodes:");
+            for (uint32_t i = 0; i < 256; ++i) {
+                if (decoded->unknown_opcodes[i]) {
+                    fprintf(stderr, " %02x %llu", i, (unsigned long long) decoded->unknown_opcodes[i]);
+                }
+            }
+            fprintf(stderr, "\n");
+        }
+        return;
+    }
+
+    fprintf(stderr, "{\n");
+    fprintf(stderr, "  \"bytes_read\": %llu,\n", (unsigned long long) stats->bytes_read);
+    fprintf(stderr, "  \"instructions\": %llu,\n", (unsigned long long) decoded->instructions);
+    fprintf(stderr, "  \"unknown_bytes\": %llu,\n", (unsigned long long) unknown);
+    fprintf(stderr, "  \"output_bytes\": %llu,\n", (unsigned long long) stats->output_bytes);
+    fprintf(stderr, "  \"seconds\": {");
+    for (uint32_t i = 0; i < phase_count; ++i) {
+        fprintf(stderr, "%s \"%s\": %.6f", i ? "," : "", phase_names[i], stats->phase_seconds[i]);
+    }
+    fprintf(stderr, " },\n  \"families\": {");
+    bool first = true;
+    for (uint32_t i = 0; i < family_count; ++i) {
+        if (decoded->families[i]) {
+            fprintf(stderr, "%s \"%s\": %llu", first ? "" : ",", family_mnemonics[i].text,
+                    (unsigned long long) decoded->families[i]);
+            first = false;
+        }
+    }
+    fprintf(stderr, " },\n  \"modes\": {");
+    first = true;
+    for (uint32_t i = 0; i < decode_mode_count; ++i) {
+        if (decoded->modes[i]) {
+            fprintf(stderr, "%s \"%s\": %llu", first ? "" : ",", decode_mode_names[i],
+                    (unsigned long long) decoded->modes[i]);
+            first = false;
+        }
+    }
+    fprintf(stderr, " },\n  \"modrm_mod\": [ %llu, %llu, %llu, %llu ],\n",
+            (unsigned long long) decoded->modrm_mods[0], (unsigned long long) decoded->modrm_mods[1],
+            (unsigned long long) decoded->modrm_mods[2], (unsigned long long) decoded->modrm_mods[3]);
+    fprintf(stderr, "  \"unknown_opcodes\": {");
+    first = true;
+    for (uint32_t i = 0; i < 256; ++i) {
+        if (decoded->unknown_opcodes[i]) {
+            fprintf(stderr, "%s \"0x%02x\": %llu", first ? "" : ",", i, (unsigned long long) decoded->unknown_opcodes[i]);
+            first = false;
+        }
+    }
+    fprintf(stderr, " }\n}\n");
+}
+
+// Listing text is built in one large buffer and handed to the OS in big writes.
+// Lines are short and bounded, so each line reserves room once up front and the
+// write_* helpers below append without checking. A writer with no file (fd < 0)
+// keeps everything in memory and grows its heap buffer instead of flushing.
+struct text_writer {
+    char *buffer;
+    size_t capacity;
+    size_t used;
+    int fd;
+    decode_stats *stats = 0;    // output bytes and write time are counted here when set
 };
 
-struct mov_opcode {
-    mov_mode mode;
-    uint8_t d;
-    uint8_t w;
-    uint8_t mod;
-    uint8_t reg;
-    uint8_t rm;
-    uint8_t disp_low;
-    uint8_t disp_high;
-    uint8_t data_low;
-    uint8_t data_high;
+enum {
+    max_line_length = 128
 };
 
-bool matches_mov_opcode(uint8_t byte, mov_mode *mov) {
-    bool result = false;
-    if (((byte >> 2) & 0b111111) == 0b100010) {
-        *mov = rm_to_rm;
-        result = true;
-    } else if (((byte >> 1) & 0b1111111) == 0b1100011) {
-        *mov = imm_to_rm;
-        result = true;
-    } else if (((byte >> 4) & 0b1111) == 0b1011) {
-        *mov = imm_to_r;
-        result = true;
-    } else if (((byte >> 1) & 0b1111111) == 0b1010000) {
-        *mov = mem_to_acc;
-        result = true;
-    } else if (((byte >> 1) & 0b1111111) == 0b1010001) {
-        *mov = acc_to_mem;
-        result = true;
-    } else if (((byte) & 0b11111111) == 0b10001110) {
-        *mov = rm_to_seg;
-        result = true;
-    } else if (((byte) & 0b11111111) == 0b10001100) {
-        *mov = seg_to_rm;
-        result = true;
+bool write_all(int fd, const char *data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t count = write(fd, data + written, size - written);
+        if (count < 0) { return false; }
+        written += (size_t) count;
     }
+    return true;
+}
 
+// Writes `size` bytes straight to the writer's file, past its buffer.
+bool writer_write(text_writer *writer, const char *data, size_t size) {
+    if (!writer->stats) { return write_all(writer->fd, data, size); }
+
+    double start = seconds_now();
+    bool result = write_all(writer->fd, data, size);
+    writer->stats->phase_seconds[phase_write] += seconds_now() - start;
+    writer->stats->output_bytes += size;
     return result;
 }
 
-// TODO(fede): Remove all these print hacks
-void print_mov(mov_opcode * opcode, uint16_t data) {
-    const char * calc = effective_addr_calculation[opcode->mod][opcode->rm];
-    const char * reg = reg_rm_11[opcode->w][opcode->reg];
-    if (opcode->d) {
-        printf("mov %s, ", reg);
-        printf(calc, data);
-        printf("\n");
-    } else {
-        printf("mov ");
-        printf(calc, data);
-        printf(", %s\n", reg);
+bool writer_flush(text_writer *writer) {
+    if (writer->fd < 0) { return true; }
+
+    bool result = writer_write(writer, writer->buffer, writer->used);
+    writer->used = 0;
+    return result;
+}
+
+void writer_grow(text_writer *writer, size_t length) {
+    size_t capacity = writer->capacity ? writer->capacity : (1 << 16);
+    while (capacity - writer->used < length) {
+        capacity *= 2;
+    }
+
+    char *grown = (char *) realloc(writer->buffer, capacity);
+    if (!grown) {
+        fprintf(stderr, "[ERROR] Out of memory for listing text\n");
+        exit(1);
     }
+
+    writer->buffer = grown;
+    writer->capacity = capacity;
 }
 
-void print_mov(mov_opcode * opcode, int16_t data) {
-    const char * calc = effective_addr_calculation[opcode->mod][opcode->rm];
-    const char * reg = reg_rm_11[opcode->w][opcode->reg];
-    char sign = '+';
-    
-    if (data < 0) {
-        sign = '-';
+inline void writer_reserve(text_writer *writer, size_t length) {
+    if (writer->capacity - writer->used < length) {
+        if (writer->fd < 0) {
+            writer_grow(writer, length);
+        } else {
+            writer_flush(writer);
+        }
     }
+}
 
-    if (opcode->d) {
-        printf("mov %s, ", reg);
-        printf(calc, sign, abs(data));
-        printf("\n");
-    } else {
-        printf("mov ");
-        printf(calc, sign, abs(data));
-        printf(", %s\n", reg);
+inline void write_bytes(text_writer *writer, const char *text, size_t length) {
+    memcpy(writer->buffer + writer->used, text, length);
+    writer->used += length;
+}
+
+inline void write_char(text_writer *writer, char c) {
+    writer->buffer[writer->used++] = c;
+}
+
+inline void write_fragment(text_writer *writer, text_fragment fragment) {
+    write_bytes(writer, fragment.text, fragment.length);
+}
+
+// Register names are always two characters.
+inline void write_register_name(text_writer *writer, const char *name) {
+    write_bytes(writer, name, 2);
+}
+
+inline void write_uint(text_writer *writer, uint64_t value) {
+    char digits[20];
+    int count = 0;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    char *at = writer->buffer + writer->used;
+    for (int i = 0; i < count; ++i) {
+        at[i] = digits[count - 1 - i];
+    }
+    writer->used += count;
+}
+
+inline void write_hex(text_writer *writer, uint32_t value) {
+    char digits[8];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value & 0xF];
+        value >>= 4;
+    } while (value);
+
+    write_bytes(writer, "0x", 2);
+    char *at = writer->buffer + writer->used;
+    for (int i = 0; i < count; ++i) {
+        at[i] = digits[count - 1 - i];
+    }
+    writer->used += count;
+}
+
+// Writes text of any length, flushing as often as needed.
+void write_text(text_writer *writer, const char *text, size_t length) {
+    while (length) {
+        writer_reserve(writer, 1);
+        size_t room = writer->capacity - writer->used;
+        size_t chunk = length < room ? length : room;
+        write_bytes(writer, text, chunk);
+        text += chunk;
+        length -= chunk;
+    }
+}
+
+// The ALU operations that also have a sign-extended byte immediate form (83).
+// NASM picks that form for any value that fits, so the word forms (81 and the
+// accumulator ones) are written `strict word` when the value would fit.
+inline bool has_byte_immediate_form(instruction_family family) {
+    switch (family) {
+        case family_add: case family_or:  case family_adc: case family_sbb:
+        case family_and: case family_sub: case family_xor: case family_cmp: {
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+inline bool fits_signed_byte(uint16_t value) {
+    return (int16_t) value >= -128 && (int16_t) value <= 127;
+}
+
+void write_operand(text_writer *writer, const instruction *inst, operand op) {
+    switch (op.kind) {
+        case operand_none: {
+            break;
+        }
+        case operand_register: {
+            write_register_name(writer, reg_rm_11[op.index >> 3][op.index & 0b00000111]);
+            break;
+        }
+        case operand_segment: {
+            write_register_name(writer, segment_registers[op.index]);
+            break;
+        }
+        case operand_memory: {
+            uint8_t mod = op.index >> 3;
+            uint8_t rm  = op.index & 0b00000111;
+            text_fragment calc = effective_addr_calculation[mod][rm];
+
+            if ((inst->flags & instruction_explicit_size) && (inst->mode != imm_to_rm || inst->operands[1].index)) {
+                write_fragment(writer, (inst->flags & instruction_wide) ? FRAGMENT("word ") : FRAGMENT("byte "));
+            }
+
+            write_char(writer, '[');
+            if (inst->flags & instruction_segment_override) {
+                write_register_name(writer, segment_registers[segment_override(inst->flags)]);
+                write_char(writer, ':');
+            }
+            write_bytes(writer, calc.text + 1, calc.length - 1);
+
+            if (mod == 0b00000000 && rm == 0b00000110) {
+                write_uint(writer, (uint16_t) inst->displacement);
+                write_char(writer, ']');
+            } else if (mod != 0b00000000) {
+                int value = inst->displacement;
+                write_bytes(writer, value < 0 ? " - " : " + ", 3);
+                write_uint(writer, (uint32_t)(value < 0 ? -value : value));
+                write_char(writer, ']');
+            }
+            break;
+        }
+        case operand_immediate: {
+            bool short_form = (inst->flags & instruction_wide) && has_byte_immediate_form(inst->family) &&
+                              fits_signed_byte(inst->immediate);
+            if (op.index) {
+                /* 83: the byte is signed, and only `byte` keeps NASM on this form */
+                int value = (int16_t) inst->immediate;
+                write_fragment(writer, FRAGMENT("byte "));
+                if (value < 0) { write_char(writer, '-'); }
+                write_uint(writer, (uint32_t)(value < 0 ? -value : value));
+                break;
+            } else if (short_form && (inst->mode == imm_to_rm || inst->mode == imm_to_acc)) {
+                write_fragment(writer, FRAGMENT("strict word "));
+            } else if ((inst->flags & instruction_explicit_size) && inst->mode == imm_to_rm) {
+                write_fragment(writer, (inst->flags & instruction_wide) ? FRAGMENT("word ") : FRAGMENT("byte "));
+            }
+            write_uint(writer, inst->immediate);
+            break;
+        }
+        case operand_relative: {
+            /* NASM's $ is the start of this instruction; `near` keeps it from picking EB */
+            int value = inst->displacement + inst->length;
+            if (inst->mode == near_label) { write_fragment(writer, FRAGMENT("near ")); }
+            write_bytes(writer, value < 0 ? "$-" : "$+", 2);
+            write_uint(writer, (uint32_t)(value < 0 ? -value : value));
+            break;
+        }
+        case operand_far: {
+            write_uint(writer, inst->immediate);
+            write_char(writer, ':');
+            write_uint(writer, (uint16_t) inst->displacement);
+            break;
+        }
+    }
+}
+
+// NASM has no ESC mnemonic, so coprocessor escapes are written as the bytes
+// they were decoded from, prefixes included.
+void write_escape_bytes(text_writer *writer, const instruction *inst) {
+    uint8_t bytes[8];
+    int count = 0;
+    if (inst->flags & instruction_lock)  { bytes[count++] = 0xF0; }
+    if (inst->flags & instruction_rep)   { bytes[count++] = 0xF3; }
+    if (inst->flags & instruction_repne) { bytes[count++] = 0xF2; }
+    if (inst->flags & instruction_segment_override) {
+        bytes[count++] = (uint8_t)(0x26 | (segment_override(inst->flags) << 3));
+    }
+
+    operand rm = inst->operands[1];
+    uint8_t mod = (rm.kind == operand_memory) ? (uint8_t)(rm.index >> 3) : 0b00000011;
+    uint16_t displacement = (uint16_t) inst->displacement;
+    bytes[count++] = (uint8_t)(0xD8 | (inst->immediate >> 3));
+    bytes[count++] = (uint8_t)((mod << 6) | ((inst->immediate & 0b00000111) << 3) | (rm.index & 0b00000111));
+    if (mod == 0b00000001) {
+        bytes[count++] = (uint8_t) displacement;
+    } else if (mod == 0b00000010 || (mod == 0b00000000 && (rm.index & 0b00000111) == 0b00000110)) {
+        bytes[count++] = (uint8_t) displacement;
+        bytes[count++] = (uint8_t)(displacement >> 8);
+    }
+
+    write_bytes(writer, "db ", 3);
+    for (int i = 0; i < count; ++i) {
+        if (i) { write_bytes(writer, ", ", 2); }
+        write_uint(writer, bytes[i]);
+    }
+}
+
+// Writes the instruction without a line break. The caller reserves room.
+void write_instruction_text(text_writer *writer, const instruction *inst) {
+    if (inst->family == family_esc) {
+        write_escape_bytes(writer, inst);
+        return;
+    }
+
+    if (inst->flags & instruction_lock)  { write_fragment(writer, FRAGMENT("lock ")); }
+    if (inst->flags & instruction_rep)   { write_fragment(writer, FRAGMENT("rep ")); }
+    if (inst->flags & instruction_repne) { write_fragment(writer, FRAGMENT("repne ")); }
+
+    if ((inst->flags & instruction_segment_override) &&
+        inst->operands[0].kind != operand_memory && inst->operands[1].kind != operand_memory) {
+        write_register_name(writer, segment_registers[segment_override(inst->flags)]);
+        write_char(writer, ' ');
+    }
+
+    write_fragment(writer, family_mnemonics[inst->family]);
+    if (inst->operands[0].kind != operand_none) {
+        write_char(writer, ' ');
+        write_operand(writer, inst, inst->operands[0]);
+    }
+    if (inst->operands[1].kind != operand_none) {
+        write_bytes(writer, ", ", 2);
+        write_operand(writer, inst, inst->operands[1]);
+    }
+}
+
+void write_instruction(text_writer *writer, const instruction *inst) {
+    writer_reserve(writer, max_line_length);
+    write_instruction_text(writer, inst);
+    write_char(writer, '\n');
+}
+
+// Clock estimates from the 8086 family user's manual. An instruction costs its
+// base clocks, plus the effective address calculation when it has a ModRM
+// memory operand, plus 4 clocks on the 8088 for every word it moves over the
+// 8-bit bus. Jumps need to know if they were taken, and REP strings and shifts
+// by CL need their count; where that is unknown (a static listing) jumps count
+// as not taken and counts as 1. Multiply and divide use the low end of their
+// ranges.
+struct instruction_clocks {
+    uint32_t base;
+    uint32_t ea;            // effective address clocks, segment override included
+    uint32_t transfers;     // word-sized memory transfers
+};
+
+struct clock_totals {
+    uint64_t clocks_8086;
+    uint64_t clocks_8088;
+};
+
+inline uint32_t clocks_8086(instruction_clocks clocks) {
+    return clocks.base + clocks.ea;
+}
+
+inline uint32_t clocks_8088(instruction_clocks clocks) {
+    return clocks.base + clocks.ea + 4u * clocks.transfers;
+}
+
+instruction_clocks estimate_clocks(const instruction *inst, bool taken, uint16_t count) {
+    operand dst = inst->operands[0];
+    operand src = inst->operands[1];
+    bool wide = (inst->flags & instruction_wide) != 0;
+    bool to_memory = (dst.kind == operand_memory);
+    bool from_memory = (src.kind == operand_memory);
+    bool memory = to_memory || from_memory;
+    bool immediate = (src.kind == operand_immediate);
+    uint8_t word = wide ? 1 : 0;
+
+    instruction_clocks c = {};
+    if (memory && inst->mode != mem_to_acc && inst->mode != acc_to_mem) {
+        uint8_t index = to_memory ? dst.index : src.index;
+        c.ea = effective_addr_clocks[index >> 3][index & 0b00000111];
+        if (inst->flags & instruction_segment_override) { c.ea += 2; }
+    }
+
+    switch (inst->family) {
+        case family_mov: {
+            if (inst->mode == mem_to_acc || inst->mode == acc_to_mem) {
+                c.base = 10;
+            } else if (to_memory) {
+                c.base = immediate ? 10 : 9;
+            } else {
+                c.base = from_memory ? 8 : immediate ? 4 : 2;
+            }
+            c.transfers = memory ? word : 0;
+            break;
+        }
+        case family_add: case family_adc: case family_sub: case family_sbb:
+        case family_and: case family_or:  case family_xor: {
+            if (to_memory) {
+                c.base = immediate ? 17 : 16;
+                c.transfers = 2 * word;
+            } else {
+                c.base = from_memory ? 9 : immediate ? 4 : 3;
+                c.transfers = from_memory ? word : 0;
+            }
+            break;
+        }
+        case family_cmp: {
+            c.base = (to_memory && immediate) ? 10 : memory ? 9 : immediate ? 4 : 3;
+            c.transfers = memory ? word : 0;
+            break;
+        }
+        case family_test: {
+            if (immediate) {
+                c.base = to_memory ? 11 : (inst->mode == imm_to_acc) ? 4 : 5;
+            } else {
+                c.base = memory ? 9 : 3;
+            }
+            c.transfers = memory ? word : 0;
+            break;
+        }
+        case family_inc:
+        case family_dec: {
+            c.base = to_memory ? 15 : wide ? 2 : 3;
+            c.transfers = to_memory ? 2 * word : 0;
+            break;
+        }
+        case family_neg:
+        case family_not: {
+            c.base = to_memory ? 16 : 3;
+            c.transfers = to_memory ? 2 * word : 0;
+            break;
+        }
+        case family_shl: case family_shr: case family_sar:
+        case family_rol: case family_ror: case family_rcl: case family_rcr: {
+            if (inst->mode == rm_by_cl) {
+                c.base = (to_memory ? 20 : 8) + 4u * count;
+            } else {
+                c.base = to_memory ? 15 : 2;
+            }
+            c.transfers = to_memory ? 2 * word : 0;
+            break;
+        }
+        case family_mul:  { c.base = wide ? (to_memory ? 124 : 118) : (to_memory ? 76 : 70); c.transfers = to_memory ? word : 0; break; }
+        case family_imul: { c.base = wide ? (to_memory ? 134 : 128) : (to_memory ? 86 : 80); c.transfers = to_memory ? word : 0; break; }
+        case family_div:  { c.base = wide ? (to_memory ? 150 : 144) : (to_memory ? 86 : 80); c.transfers = to_memory ? word : 0; break; }
+        case family_idiv: { c.base = wide ? (to_memory ? 171 : 165) : (to_memory ? 107 : 101); c.transfers = to_memory ? word : 0; break; }
+        case family_xchg: {
+            c.base = memory ? 17 : (inst->mode == reg_to_acc) ? 3 : 4;
+            c.transfers = memory ? 2 * word : 0;
+            break;
+        }
+        case family_lea: { c.base = 2; break; }
+        case family_lds:
+        case family_les: { c.base = 16; c.transfers = 2; break; }
+        case family_push: {
+            c.base = to_memory ? 16 : (dst.kind == operand_segment) ? 10 : 11;
+            c.transfers = to_memory ? 2 : 1;
+            break;
+        }
+        case family_pop: {
+            c.base = to_memory ? 17 : 8;
+            c.transfers = to_memory ? 2 : 1;
+            break;
+        }
+        case family_pushf: { c.base = 10; c.transfers = 1; break; }
+        case family_popf:  { c.base = 8;  c.transfers = 1; break; }
+        case family_lahf:
+        case family_sahf:  { c.base = 4; break; }
+        case family_cbw:   { c.base = 2; break; }
+        case family_cwd:   { c.base = 5; break; }
+        case family_aaa: case family_aas: case family_daa: case family_das: { c.base = 4; break; }
+        case family_aam:   { c.base = 83; break; }
+        case family_aad:   { c.base = 60; break; }
+        case family_xlat:  { c.base = 11; break; }
+        case family_in:
+        case family_out: {
+            bool dx = (inst->mode == dx_to_acc || inst->mode == acc_to_dx);
+            c.base = dx ? 8 : 10;
+            c.transfers = word;
+            break;
+        }
+        case family_movsb: case family_movsw: case family_cmpsb: case family_cmpsw:
+        case family_scasb: case family_scasw: case family_lodsb: case family_lodsw:
+        case family_stosb: case family_stosw: {
+            uint32_t single = 0;
+            uint32_t repeated = 0;
+            uint32_t words = 0;
+            switch (inst->family) {
+                case family_movsb: case family_movsw: { single = 18; repeated = 17; words = 2; break; }
+                case family_cmpsb: case family_cmpsw: { single = 22; repeated = 22; words = 2; break; }
+                case family_scasb: case family_scasw: { single = 15; repeated = 15; words = 1; break; }
+                case family_lodsb: case family_lodsw: { single = 12; repeated = 13; words = 1; break; }
+                default:                              { single = 11; repeated = 10; words = 1; break; }
+            }
+            words *= word;
+
+            if (inst->flags & (instruction_rep | instruction_repne)) {
+                c.base = 9 + repeated * count;
+                c.transfers = words * count;
+            } else {
+                c.base = single;
+                c.transfers = words;
+            }
+            break;
+        }
+        case family_jo:  case family_jno: case family_jb:  case family_jnb:
+        case family_je:  case family_jne: case family_jbe: case family_ja:
+        case family_js:  case family_jns: case family_jp:  case family_jnp:
+        case family_jl:  case family_jnl: case family_jle: case family_jg: {
+            c.base = taken ? 16 : 4;
+            break;
+        }
+        case family_loop:   { c.base = taken ? 17 : 5; break; }
+        case family_loopz:  { c.base = taken ? 18 : 6; break; }
+        case family_loopnz: { c.base = taken ? 19 : 5; break; }
+        case family_jcxz:   { c.base = taken ? 18 : 6; break; }
+        case family_jmp: {
+            c.base = to_memory ? 18 : (dst.kind == operand_register) ? 11 : 15;
+            c.transfers = to_memory ? 1 : 0;
+            break;
+        }
+        case family_call: {
+            if (dst.kind == operand_far) {
+                c.base = 28;
+                c.transfers = 2;
+            } else {
+                c.base = to_memory ? 21 : (dst.kind == operand_register) ? 16 : 19;
+                c.transfers = to_memory ? 2 : 1;
+            }
+            break;
+        }
+        case family_jmp_far:  { c.base = 24; c.transfers = 2; break; }
+        case family_call_far: { c.base = 37; c.transfers = 4; break; }
+        case family_ret:      { c.base = (inst->mode == imm_only) ? 12 : 8;  c.transfers = 1; break; }
+        case family_retf:     { c.base = (inst->mode == imm_only) ? 17 : 18; c.transfers = 2; break; }
+        case family_int:      { c.base = 51; c.transfers = 5; break; }
+        case family_int3:     { c.base = 52; c.transfers = 5; break; }
+        case family_into:     { c.base = taken ? 53 : 4; c.transfers = taken ? 5 : 0; break; }
+        case family_iret:     { c.base = 24; c.transfers = 3; break; }
+        case family_esc:      { c.base = memory ? 8 : 2; c.transfers = memory ? 1 : 0; break; }
+        case family_nop:
+        case family_wait:     { c.base = 3; break; }
+        default:              { c.base = 2; break; }   /* flag operations, hlt and lone prefixes */
     }
+
+    return c;
 }
 
-void print_mov(mov_opcode * opcode, int8_t data) {
-    const char * calc = effective_addr_calculation[opcode->mod][opcode->rm];
-    const char * reg = reg_rm_11[opcode->w][opcode->reg];
-    char sign = '+';
-    
-    if (data < 0) {
-        sign = '-';
+inline void add_clocks(clock_totals *totals, instruction_clocks clocks) {
+    totals->clocks_8086 += clocks_8086(clocks);
+    totals->clocks_8088 += clocks_8088(clocks);
+}
+
+// Appends " ; clocks: +15 = 30 (8 + 7ea) | 8088: +19 = 38 (8 + 7ea + 4p)", with
+// totals that already include this instruction.
+void write_clocks(text_writer *writer, instruction_clocks clocks, const clock_totals *totals) {
+    write_fragment(writer, FRAGMENT(" ; clocks: +"));
+    write_uint(writer, clocks_8086(clocks));
+    write_fragment(writer, FRAGMENT(" = "));
+    write_uint(writer, totals->clocks_8086);
+    if (clocks.ea) {
+        write_fragment(writer, FRAGMENT(" ("));
+        write_uint(writer, clocks.base);
+        write_fragment(writer, FRAGMENT(" + "));
+        write_uint(writer, clocks.ea);
+        write_fragment(writer, FRAGMENT("ea)"));
+    }
+
+    write_fragment(writer, FRAGMENT(" | 8088: +"));
+    write_uint(writer, clocks_8088(clocks));
+    write_fragment(writer, FRAGMENT(" = "));
+    write_uint(writer, totals->clocks_8088);
+    if (clocks.ea || clocks.transfers) {
+        write_fragment(writer, FRAGMENT(" ("));
+        write_uint(writer, clocks.base);
+        if (clocks.ea) {
+            write_fragment(writer, FRAGMENT(" + "));
+            write_uint(writer, clocks.ea);
+            write_fragment(writer, FRAGMENT("ea"));
+        }
+        if (clocks.transfers) {
+            write_fragment(writer, FRAGMENT(" + "));
+            write_uint(writer, 4u * clocks.transfers);
+            write_char(writer, 'p');
+        }
+        write_char(writer, ')');
     }
-    
-    if (opcode->d) {
-        printf("mov %s, ", reg);
-        printf(calc, sign, abs(data));
-        printf("\n");
+}
+
+void write_clock_totals(text_writer *writer, const clock_totals *totals) {
+    writer_reserve(writer, max_line_length);
+    write_fragment(writer, FRAGMENT("; Total clocks: "));
+    write_uint(writer, totals->clocks_8086);
+    write_fragment(writer, FRAGMENT(" on the 8086, "));
+    write_uint(writer, totals->clocks_8088);
+    write_fragment(writer, FRAGMENT(" on the 8088\n"));
+}
+
+// Where and why decoding stopped early: the instruction starting at `offset`
+// needs `needed` bytes but only `available` are left in the input.
+struct decode_error {
+    size_t offset;
+    uint32_t needed;
+    size_t available;
+};
+
+void fill_decode_error(const uint8_t *data, size_t size, size_t offset, decode_error *error) {
+    instruction_cursor at = { data, size, offset };
+    error->offset = offset;
+    error->needed = measure_instruction(&at).length;
+    error->available = size - offset;
+}
+
+void print_decode_error(const char *filename, const decode_error *error) {
+    if (filename) {
+        fprintf(stderr, "[ERROR] %s: Truncated instruction at offset %zu: needs %u bytes, only %zu left\n",
+                filename, error->offset, error->needed, error->available);
     } else {
-        printf("mov ");
-        printf(calc, sign, abs(data));
-        printf(", %s\n", reg);
+        fprintf(stderr, "[ERROR] Truncated instruction at offset %zu: needs %u bytes, only %zu left\n",
+                error->offset, error->needed, error->available);
     }
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "[ERROR] Missing filename argument.\n");
-        return 1;
+// With `clocks`, every line is annotated with its estimated clocks and the
+// running totals.
+void write_listing_batch(text_writer *out, const instruction *batch, size_t count, clock_totals *clocks) {
+    for (size_t i = 0; i < count; ++i) {
+        if (clocks) {
+            writer_reserve(out, max_line_length * 2);
+            instruction_clocks estimate = estimate_clocks(&batch[i], false, 1);
+            add_clocks(clocks, estimate);
+            write_instruction_text(out, &batch[i]);
+            write_clocks(out, estimate, clocks);
+            write_char(out, '\n');
+        } else {
+            write_instruction(out, &batch[i]);
+        }
     }
+}
 
-    const char *filename = argv[1];
-    FILE *file = fopen(filename, "rb");
+// decode() visitors for the listing. The plain one is the hot path and does
+// nothing but format; the annotated one adds clocks and counters when asked.
+struct listing_emitter : decode_visitor {
+    text_writer *out;
 
-    if (!file) {
-        fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", filename);
+    void on_instruction(const instruction &inst) { write_instruction(out, &inst); }
+};
+
+struct annotated_listing_emitter {
+    text_writer *out;
+    clock_totals *clocks;
+    instruction_histogram *decoded;
+
+    void on_instruction(const instruction &inst) {
+        write_listing_batch(out, &inst, 1, clocks);
+        if (decoded) { decoded->on_instruction(inst); }
+    }
+
+    void on_unknown(uint32_t offset, uint8_t byte) {
+        if (decoded) { decoded->on_unknown(offset, byte); }
+    }
+};
+
+// Decodes every instruction in [data, data + size) and writes the listing.
+// Returns 0 on success, 1 when an instruction runs past the end of the input,
+// in which case `error` says where.
+int decode_span(const uint8_t *data, size_t size, text_writer *out, decode_error *error,
+                clock_totals *clocks = 0, decode_stats *stats = 0) {
+    decode_result result;
+    if (clocks || stats) {
+        phase_timer timer = stats ? start_phase(stats) : phase_timer{};
+        annotated_listing_emitter emitter = { out, clocks, stats ? &stats->decoded : 0 };
+        result = decode({ data, size }, emitter);
+        if (stats) { end_phase(stats, timer, phase_decode); }
+    } else {
+        listing_emitter emitter = {};
+        emitter.out = out;
+        result = decode({ data, size }, emitter);
+    }
+
+    if (result.status == decode_truncated) {
+        error->offset = result.offset;
+        error->needed = result.needed;
+        error->available = size - result.offset;
         return 1;
     }
+    return 0;
+}
+
+// Instruction starts without decoding. A vector pass works out, for every byte,
+// how long the instruction would be if one started there; a serial walk then
+// only hops from start to start. For most opcodes the length follows from the
+// opcode byte and, for the ModRM forms, the mod/rm bits of the next byte, so
+// both can be looked up 16 or 32 bytes at a time. Prefixes, unknown bytes, the
+// groups whose length depends on the reg field and the last byte of the input
+// get a zero and are measured one at a time exactly as decode_batch does.
+enum {
+    prescan_modrm = 0x80,   // the ModRM displacement still has to be added
+    prescan_block = 1 << 14
+};
 
-    printf("; %s:\n", filename);
-    printf("bits 16\n\n");
+struct prescan_table {
+    uint8_t lengths[256];
+};
+
+constexpr prescan_table make_prescan_table() {
+    prescan_table table = {};
 
-    uint8_t byte;
+    for (int byte = 0; byte < 256; ++byte) {
+        const opcode_entry &entry = opcode_lookup.entries[byte];
+        if (entry.mode == prefix_byte || entry.group == group_unary) { continue; }
+        if (entry.family == family_unknown && entry.group == group_none) { continue; }
 
-    while ((fread(&byte, 1, 1, file))) {
-        mov_mode mode;
-        if (matches_mov_opcode(byte, &mode)) {
-            mov_opcode opcode = {};
-            opcode.mode = mode;
+        bool every_reg = true;
+        for (int reg = 0; reg < 8 && entry.group != group_none; ++reg) {
+            if (group_families[entry.group][reg] == family_unknown) { every_reg = false; }
+        }
+        if (!every_reg) { continue; }
 
-            switch (opcode.mode) {
-                case rm_to_rm: {
-                    opcode.d = (byte & 0b00000010);
-                    opcode.w = (byte & 0b00000001);
-                    size_t read_byte = fread(&byte, 1, 1, file);
-                    if (!read_byte) { return 1; }
+        uint8_t length = (uint8_t)(1 + entry.disp_length + entry.imm_length);
+        table.lengths[byte] = entry.has_modrm ? (uint8_t)((length + 1) | prescan_modrm) : length;
+    }
 
-                    opcode.mod = ((byte >> 6) & 0b00000011);
-                    opcode.reg = ((byte >> 3) & 0b00000111);
-                    opcode.rm  = ((byte >> 0) & 0b00000111);
+    return table;
+}
 
-                    switch (opcode.mod) {
-                        case 0b00000000: {
-                            char * rm_code;
-                            if (opcode.rm == 0b00000110) {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
+constexpr prescan_table prescan_lookup = make_prescan_table();
 
-                                opcode.disp_low = byte;
+// Lengths for the `count` positions from `data`; data[count] must be readable.
+void prescan_lengths_scalar(const uint8_t *data, size_t count, uint8_t *lengths) {
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t length = prescan_lookup.lengths[data[i]];
+        if (length & prescan_modrm) {
+            length = (uint8_t)((length & ~prescan_modrm) + displacement_length(data[i + 1]));
+        }
+        lengths[i] = length;
+    }
+}
 
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
+#if defined(__x86_64__) || defined(__i386__)
+// PSHUFB looks up the low nibble in one 16-byte row of the table; the row is
+// picked by comparing the high nibble against each of the 16 rows in turn.
+__attribute__((target("ssse3")))
+void prescan_lengths_ssse3(const uint8_t *data, size_t count, uint8_t *lengths) {
+    __m128i rows[16];
+    for (int row = 0; row < 16; ++row) {
+        rows[row] = _mm_loadu_si128((const __m128i *) &prescan_lookup.lengths[row * 16]);
+    }
 
-                                opcode.disp_high = byte;
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i next  = _mm_loadu_si128((const __m128i *) (data + i + 1));
+        __m128i low   = _mm_and_si128(bytes, nibble);
+        __m128i high  = _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble);
 
-                                print_mov(&opcode, (uint16_t)(((uint16_t) opcode.disp_high << 8) | opcode.disp_low));
-                                break;
-                            }
+        __m128i length = _mm_setzero_si128();
+        for (int row = 0; row < 16; ++row) {
+            __m128i selected = _mm_cmpeq_epi8(high, _mm_set1_epi8((char) row));
+            length = _mm_or_si128(length, _mm_and_si128(selected, _mm_shuffle_epi8(rows[row], low)));
+        }
 
-                            const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                            const char * reg  = reg_rm_11[opcode.w][opcode.reg];
-                            if (opcode.d) {
-                                printf("mov %s, %s\n", reg, calc);
-                            } else {
-                                printf("mov %s, %s\n", calc, reg);
-                            }
+        __m128i mod = _mm_and_si128(_mm_srli_epi16(next, 6), _mm_set1_epi8(3));
+        __m128i rm  = _mm_and_si128(next, _mm_set1_epi8(7));
+        __m128i displacement = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(mod, _mm_set1_epi8(1)), _mm_set1_epi8(1)),
+            _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(mod, _mm_set1_epi8(2)),
+                                       _mm_and_si128(_mm_cmpeq_epi8(mod, _mm_setzero_si128()),
+                                                     _mm_cmpeq_epi8(rm, _mm_set1_epi8(6)))),
+                          _mm_set1_epi8(2)));
 
-                            break;
-                        }
-                        case 0b00000001: {  /* 8 bit displacement */
-                            read_byte = fread(&byte, 1, 1, file);
-                            if (!read_byte) { return 1; }
+        __m128i modrm = _mm_cmpeq_epi8(_mm_and_si128(length, _mm_set1_epi8((char) prescan_modrm)),
+                                       _mm_set1_epi8((char) prescan_modrm));
+        length = _mm_add_epi8(_mm_and_si128(length, _mm_set1_epi8(0x7F)), _mm_and_si128(modrm, displacement));
+        _mm_storeu_si128((__m128i *) (lengths + i), length);
+    }
 
-                            opcode.disp_low = byte;
+    prescan_lengths_scalar(data + i, count - i, lengths + i);
+}
 
-                            print_mov(&opcode, (int8_t) opcode.disp_low);
-                            break;
-                        }
-                        case 0b00000010: { /* 16 bit displacement */
-                            read_byte = fread(&byte, 1, 1, file);
-                            if (!read_byte) { return 1; }
+// The same with 32 bytes at a time. VPSHUFB looks up within each 128-bit lane,
+// so every row is repeated in both lanes.
+__attribute__((target("avx2")))
+void prescan_lengths_avx2(const uint8_t *data, size_t count, uint8_t *lengths) {
+    __m256i rows[16];
+    for (int row = 0; row < 16; ++row) {
+        rows[row] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) &prescan_lookup.lengths[row * 16]));
+    }
 
-                            opcode.disp_low = byte;
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i next  = _mm256_loadu_si256((const __m256i *) (data + i + 1));
+        __m256i low   = _mm256_and_si256(bytes, nibble);
+        __m256i high  = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble);
 
-                            read_byte = fread(&byte, 1, 1, file);
-                            if (!read_byte) { return 1; }
+        __m256i length = _mm256_setzero_si256();
+        for (int row = 0; row < 16; ++row) {
+            __m256i selected = _mm256_cmpeq_epi8(high, _mm256_set1_epi8((char) row));
+            length = _mm256_or_si256(length, _mm256_and_si256(selected, _mm256_shuffle_epi8(rows[row], low)));
+        }
 
-                            opcode.disp_high = byte;
+        __m256i mod = _mm256_and_si256(_mm256_srli_epi16(next, 6), _mm256_set1_epi8(3));
+        __m256i rm  = _mm256_and_si256(next, _mm256_set1_epi8(7));
+        __m256i displacement = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(mod, _mm256_set1_epi8(1)), _mm256_set1_epi8(1)),
+            _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(mod, _mm256_set1_epi8(2)),
+                                             _mm256_and_si256(_mm256_cmpeq_epi8(mod, _mm256_setzero_si256()),
+                                                              _mm256_cmpeq_epi8(rm, _mm256_set1_epi8(6)))),
+                             _mm256_set1_epi8(2)));
 
-                            int16_t value = ((int16_t) opcode.disp_high << 8) | opcode.disp_low;
+        __m256i modrm = _mm256_cmpeq_epi8(_mm256_and_si256(length, _mm256_set1_epi8((char) prescan_modrm)),
+                                          _mm256_set1_epi8((char) prescan_modrm));
+        length = _mm256_add_epi8(_mm256_and_si256(length, _mm256_set1_epi8(0x7F)), _mm256_and_si256(modrm, displacement));
+        _mm256_storeu_si256((__m256i *) (lengths + i), length);
+    }
 
-                            print_mov(&opcode, value);
-                            break;
-                        }
-                        case 0b00000011: {
-                            if (!opcode.d) {
-                                uint8_t tmp = opcode.reg;
-                                opcode.reg = opcode.rm;
-                                opcode.rm = tmp;
-                            }
+    prescan_lengths_ssse3(data + i, count - i, lengths + i);
+}
+#endif
 
-                            const char * reg_code = reg_rm_11[opcode.w][(opcode.reg)];
-                            const char * rm_code  = reg_rm_11[opcode.w][(opcode.rm )];
+void prescan_lengths(const uint8_t *data, size_t count, uint8_t *lengths) {
+#if defined(__x86_64__) || defined(__i386__)
+    static const int level = __builtin_cpu_supports("avx2") ? 2 : (__builtin_cpu_supports("ssse3") ? 1 : 0);
+    if (level == 2) { prescan_lengths_avx2(data, count, lengths); return; }
+    if (level == 1) { prescan_lengths_ssse3(data, count, lengths); return; }
+#endif
+    prescan_lengths_scalar(data, count, lengths);
+}
 
-                            printf("mov %s, %s\n", reg_code, rm_code);
+struct prescan_result {
+    size_t count;       // instruction starts, lone prefixes included
+    size_t end;         // where the walk stopped
+    bool truncated;     // the instruction at `end` runs past the end of input
+};
 
-                            break;
-                        }
+// Sets one bit per instruction start in `starts`, which must hold (size + 63) / 64
+// zeroed words, or only counts the starts when it is null. The starts are the
+// offsets decode_span would list, so the count matches its line count.
+prescan_result prescan_starts(const uint8_t *data, size_t size, uint64_t *starts) {
+    prescan_result result = {};
+    uint8_t lengths[prescan_block];
+    size_t offset = 0;
 
-                        default: { return 1; }
-                    }
+    while (offset < size && !result.truncated) {
+        size_t base = offset;
+        size_t count = size - 1 - base;     /* the last byte has no ModRM byte after it */
+        if (count > prescan_block) { count = prescan_block; }
+        prescan_lengths(data + base, count, lengths);
 
+        do {
+            uint32_t length = offset < base + count ? lengths[offset - base] : 0;
+            if (length == 0 || length > size - offset) {
+                instruction_cursor at = { data, size, offset };
+                instruction_shape shape = measure_instruction(&at);
+                if (shape.length > size - offset) {
+                    result.truncated = true;
                     break;
                 }
-                case imm_to_rm: {
-                    opcode.w = (byte & 0b00000001);
-                    size_t read_byte = fread(&byte, 1, 1, file);
-                    if (!read_byte) { return 1; }
-                    opcode.mod = (byte >> 6 & 0b00000011);
-                    opcode.reg = (byte >> 3 & 0b00000111);
-                    opcode.rm  = (byte >> 0 & 0b00000111);
-
-                    switch (opcode.mod) {
-                        case 0b00000000: {
-                            char * rm_code;
-                            if (opcode.rm == 0b00000110) {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-
-                                opcode.disp_low = byte;
-
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-
-                                opcode.disp_high = byte;
-
-                                if (opcode.w) {
-                                    read_byte = fread(&byte, 1, 1, file);
-                                    if (!read_byte) { return 1; }
-                                    opcode.data_low = byte;
-
-                                    read_byte = fread(&byte, 1, 1, file);
-                                    if (!read_byte) { return 1; }
-                                    opcode.data_high = byte;
-
-                                    const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                    uint16_t disp_value = ((uint16_t) opcode.disp_high << 8) | opcode.disp_low;
-                                    uint16_t data_value = ((uint16_t) opcode.data_high << 8) | opcode.data_low;
-
-                                    if (opcode.d) {
-                                        printf("mov word %d, ", data_value);
-                                        printf(calc, '+', disp_value);
-                                        printf("\n");
-                                    } else {
-                                        printf("mov ");
-                                        printf(calc, '+', disp_value);
-                                        printf(", word %d\n", data_value);
-                                    }
-                                } else {
-                                    read_byte = fread(&byte, 1, 1, file);
-                                    if (!read_byte) { return 1; }
-                                    opcode.disp_low = byte;
-
-                                    const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                    uint16_t disp_value = opcode.disp_low;
-                                    uint16_t data_value = opcode.data_low;
-
-                                    if (opcode.d) {
-                                        printf("mov byte %d, ", data_value);
-                                        printf(calc, '+', disp_value);
-                                        printf("\n");
-                                    } else {
-                                        printf("mov ");
-                                        printf(calc, '+', disp_value);
-                                        printf(", byte %d\n", data_value);
-                                    }
-                                }
-                                break;
-                            }
-
-                            if (opcode.w) {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_low = byte;
-
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_high = byte;
-
-                                const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                uint16_t data_value = ((uint16_t) opcode.data_high << 8) | opcode.data_low;
-
-                                if (opcode.d) {
-                                    printf("mov word %d, %s\n", data_value, calc);
-                                } else {
-                                    printf("mov %s, word %d\n", calc, data_value);
-                                }
-                            } else {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_low = byte;
-                                
-                                const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-
-                                if (opcode.d) {
-                                    printf("mov byte %d, %s\n", opcode.data_low, calc);
-                                } else {
-                                    printf("mov %s, byte %d\n", calc, opcode.data_low);
-                                }
-                            }
-
-                            break;
-                        }
-                        case 0b00000001: {  /* 8 bit displacement */
-                            read_byte = fread(&byte, 1, 1, file);
-                            if (!read_byte) { return 1; }
-
-                            opcode.disp_low = byte;
-
-                            if (opcode.w) {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_low = byte;
-
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_high = byte;
-
-                                const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                uint16_t disp_value = ((uint16_t) opcode.disp_high << 8) | opcode.disp_low;
-                                uint16_t data_value = ((uint16_t) opcode.data_high << 8) | opcode.data_low;
-
-                                if (opcode.d) {
-                                    printf("mov word %d, ", data_value);
-                                    printf(calc, '+', disp_value);
-                                    printf("\n");
-                                } else {
-                                    printf("mov ");
-                                    printf(calc, '+', disp_value);
-                                    printf(", word %d\n", data_value);
-                                }
-                            } else {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.disp_low = byte;
-
-                                const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                uint16_t disp_value = opcode.disp_low;
-                                uint16_t data_value = opcode.data_low;
-
-                                if (opcode.d) {
-                                    printf("mov byte %d, ", data_value);
-                                    printf(calc, '+', disp_value);
-                                    printf("\n");
-                                } else {
-                                    printf("mov ");
-                                    printf(calc, '+', disp_value);
-                                    printf(", byte %d\n", data_value);
-                                }
-                            }
-
-                            break;
-                        }
-                        case 0b00000010: { /* 16 bit displacement */
-                            read_byte = fread(&byte, 1, 1, file);
-                            if (!read_byte) { return 1; }
-
-                            opcode.disp_low = byte;
-
-                            read_byte = fread(&byte, 1, 1, file);
-                            if (!read_byte) { return 1; }
-
-                            opcode.disp_high = byte;
-
-                            if (opcode.w) {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_low = byte;
-
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_high = byte;
-
-                                const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                uint16_t disp_value = ((uint16_t) opcode.disp_high << 8) | opcode.disp_low;
-                                uint16_t data_value = ((uint16_t) opcode.data_high << 8) | opcode.data_low;
-
-                                if (opcode.d) {
-                                    printf("mov word %d, ", data_value);
-                                    printf(calc, '+', disp_value);
-                                    printf("\n");
-                                } else {
-                                    printf("mov ");
-                                    printf(calc, '+', disp_value);
-                                    printf(", word %d\n", data_value);
-                                }
-                            } else {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.disp_low = byte;
-
-                                const char * calc = effective_addr_calculation[opcode.mod][opcode.rm];
-                                uint16_t disp_value = opcode.disp_low;
-                                uint16_t data_value = opcode.data_low;
-
-                                if (opcode.d) {
-                                    printf("mov byte %d, ", data_value);
-                                    printf(calc, '+', disp_value);
-                                    printf("\n");
-                                } else {
-                                    printf("mov ");
-                                    printf(calc, '+', disp_value);
-                                    printf(", byte %d\n", data_value);
-                                }
-                            }
-                            break;
-                        }
-                        case 0b00000011: {
-                            if (!opcode.d) {
-                                uint8_t tmp = opcode.reg;
-                                opcode.reg = opcode.rm;
-                                opcode.rm = tmp;
-                            }
-
-                            const char * rm_code  = reg_rm_11[opcode.w][(opcode.rm )];
-
-                            if (opcode.w) {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_low = byte;
-
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.data_high = byte;
-
-                                uint16_t data_value = ((uint16_t) opcode.data_high << 8) | opcode.data_low;
-
-                                if (opcode.d) {
-                                    printf("mov word %d, %s\n", data_value, rm_code);
-                                } else {
-                                    printf("mov %s, word %d\n", rm_code, data_value);
-                                }
-                            } else {
-                                read_byte = fread(&byte, 1, 1, file);
-                                if (!read_byte) { return 1; }
-                                opcode.disp_low = byte;
-
-                                if (opcode.d) {
-                                    printf("mov byte %d, %s\n", opcode.data_low, rm_code);
-                                } else {
-                                    printf("mov %s, byte %d\n", rm_code, opcode.data_low);
-                                }
-                            }
-
-                            break;
-                        }
-
-                        default: { return 1; }
-                    }
-                    break;
-                }
-                case imm_to_r: {
-                    opcode.w = (byte >> 3 & 0b00000001);
-                    opcode.reg = (byte & 0b00000111);
-                    const char *reg = reg_rm_11[opcode.w][opcode.reg];
-
-                    if (opcode.w) {
-                        size_t read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_low = byte;
-
-                        read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_high = byte;
-
-                        printf("mov %s, %d\n", reg, (((uint16_t) opcode.data_high << 8) | opcode.data_low));
-                    } else {
-                        size_t read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_low = byte;
-
-                        printf("mov %s, %d\n", reg, opcode.data_low);
-                    }
-                    break;
-                }
-                case mem_to_acc: {
-                    opcode.w = (byte & 0b00000001);
-                    if (opcode.w) {
-                        size_t read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_low = byte;
-
-                        read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_high = byte;
-
-                        printf("mov ax, [%d]\n", (((uint16_t) opcode.data_high << 8) | opcode.data_low));
-                    } else {
-                        size_t read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_low = byte;
-
-                        printf("mov ax, [%d]\n", opcode.data_low);
-                    }
-                    
-                    break;
-                }
-                case acc_to_mem: {
-                    opcode.w = (byte & 0b00000001);
-                    if (opcode.w) {
-                        size_t read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_low = byte;
-
-                        read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_high = byte;
-
-                        printf("mov [%d], ax\n", (((uint16_t) opcode.data_high << 8) | opcode.data_low));
-                    } else {
-                        size_t read_byte = fread(&byte, 1, 1, file);
-                        if (!read_byte) { return 1; }
-                        opcode.data_low = byte;
-
-                        printf("mov [%d], ax\n", opcode.data_low);
-                    }
-                    break;
-                }
-                case rm_to_seg: {
-                    printf("[DEBUG] REGISTER/MEMORY TO SEGMENT FOUND\n\n");
-                    break;
-                }
-                case seg_to_rm: {
-                    printf("[DEBUG] SEGMENT TO REGISTER/MEMORY FOUND\n\n");
-                    break;
-                }
-                default: {
-                    fprintf(stderr, "[ERROR] Not supported MOV opcode mode: %u\n", opcode.mode);
-                    return 1;
+                if (!shape.entry && opcode_lookup.entries[data[offset]].mode != prefix_byte) {
+                    offset += 1;    /* unknown byte, skipped */
+                    continue;
                 }
+                length = shape.entry ? shape.length : 1;
             }
+
+            if (starts) { starts[offset >> 6] |= (uint64_t) 1 << (offset & 63); }
+            result.count += 1;
+            offset += length;
+        } while (offset < base + count);
+    }
+
+    result.end = offset;
+    return result;
+}
+
+// Where the serial decode enters the bytes from `offset` on: the end of the
+// instruction that straddles `offset`, or `offset` itself.
+size_t prescan_entry(const uint8_t *data, size_t size, const uint64_t *starts, size_t offset) {
+    const size_t longest = max_prefixes + 6;
+    for (size_t back = 1; back <= longest && back <= offset; ++back) {
+        size_t start = offset - back;
+        if (starts[start >> 6] & ((uint64_t) 1 << (start & 63))) {
+            instruction_cursor at = { data, size, start };
+            instruction_shape shape = measure_instruction(&at);
+            size_t end = start + (shape.entry ? shape.length : 1);
+            return end > offset ? end : offset;
         }
     }
+    return offset;
+}
 
-    fclose(file);
+// Parallel listing of large images. The input is cut into fixed-size chunks and
+// the pre-scan above says where the serial decode enters each of them, so a
+// worker can start a chunk at its true entry point. Without the instruction
+// starts (out of memory, or past a truncated instruction) the worker decodes
+// the chunk speculatively from its first byte and the first few instruction
+// starts are remembered as sync points. Once the previous chunk is done, its
+// final offset is the true entry point: if that lands on one of the sync points
+// (x86 code falls back into step within a few instructions) the chunk's text is
+// used from there, otherwise the chunk is decoded again from the true entry.
+enum {
+    parallel_chunk_size = 1 << 20,
+    max_sync_points = 64,
+    max_threads = 256
+};
 
-    return 0;
+struct sync_point {
+    uint32_t gap_begin;     // bytes in [gap_begin, start) were skipped as unknown
+    uint32_t start;
+    uint32_t text;          // listing text offset of the instruction at start
+};
+
+struct decode_chunk {
+    size_t entry;           // where decoding of this chunk started
+    size_t end;             // instructions starting before end belong to the chunk
+    size_t final_offset;    // first instruction boundary at or after end
+    size_t truncated_at;
+    bool truncated;
+    text_writer text;
+    decode_stats *stats;    // counts for this chunk alone, null unless counting
+    uint32_t sync_count;
+    sync_point sync[max_sync_points];
+};
+
+// Decodes the instructions that start in [entry, chunk->end) into the chunk's
+// text. Instructions may read past the end of the chunk, just not past `size`.
+void decode_chunk_from(const uint8_t *data, size_t size, size_t entry, decode_chunk *chunk) {
+    instruction_cursor input = { data, size, entry };
+    instruction batch[256];
+    size_t last_end = entry;
+
+    chunk->entry = entry;
+    chunk->text.used = 0;
+    chunk->sync_count = 0;
+    chunk->truncated = false;
+
+    decode_stats *stats = chunk->stats;
+    phase_timer timer = {};
+    if (stats) {
+        memset(stats, 0, sizeof(decode_stats));
+        timer = start_phase(stats);
+    }
+
+    while (input.offset < chunk->end) {
+        decode_batch_result result = decode_batch(&input, batch, 256);
+
+        for (size_t i = 0; i < result.count; ++i) {
+            instruction *inst = &batch[i];
+            if (inst->offset >= chunk->end) {
+                input.offset = inst->offset;
+                break;
+            }
+
+            if (chunk->sync_count < max_sync_points) {
+                chunk->sync[chunk->sync_count++] = { (uint32_t) last_end, inst->offset, (uint32_t) chunk->text.used };
+            }
+
+            write_instruction(&chunk->text, inst);
+            if (stats) {
+                count_decoded(stats, data, inst, 1, &last_end);
+            }
+            last_end = inst->offset + inst->length;
+        }
+
+        if (result.truncated && input.offset < chunk->end) {
+            chunk->truncated = true;
+            chunk->truncated_at = input.offset;
+            break;
+        }
+
+        if (!cursor_remaining(&input)) { break; }
+    }
+
+    chunk->final_offset = last_end > chunk->end ? last_end : chunk->end;
+
+    if (stats) {
+        count_skipped(stats, data, last_end, chunk->truncated ? chunk->truncated_at : chunk->end);
+        end_phase(stats, timer, phase_decode);
+    }
+}
+
+// Where in the chunk's text the serial listing picks up when it enters the
+// chunk at `entry`, or -1 when the speculative decode never fell into step.
+long sync_text_offset(decode_chunk *chunk, size_t entry) {
+    if (entry == chunk->entry) { return 0; }
+
+    for (uint32_t i = 0; i < chunk->sync_count; ++i) {
+        sync_point *point = &chunk->sync[i];
+        if (point->gap_begin <= entry && entry <= point->start) {
+            return point->text;
+        }
+        if (point->start > entry) { break; }
+    }
+
+    return -1;
+}
+
+int decode_span_parallel(const uint8_t *data, size_t size, text_writer *out, unsigned thread_count, decode_error *error,
+                         decode_stats *stats = 0) {
+    if (thread_count > max_threads) { thread_count = max_threads; }
+
+    size_t chunk_count = (size + parallel_chunk_size - 1) / parallel_chunk_size;
+    size_t round_size = (size_t) thread_count * 4;
+    decode_chunk *chunks = (decode_chunk *) calloc(round_size, sizeof(decode_chunk));
+    if (!chunks) {
+        fprintf(stderr, "[ERROR] Out of memory for decode chunks\n");
+        return 1;
+    }
+
+    decode_stats *chunk_stats = 0;
+    if (stats) {
+        chunk_stats = (decode_stats *) calloc(round_size, sizeof(decode_stats));
+        if (!chunk_stats) {
+            fprintf(stderr, "[ERROR] Out of memory for decode chunks\n");
+            free(chunks);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < round_size; ++i) {
+        chunks[i].text.fd = -1;
+        chunks[i].stats = chunk_stats ? &chunk_stats[i] : 0;
+    }
+
+    uint64_t *starts = (uint64_t *) calloc((size + 63) / 64, sizeof(uint64_t));
+    prescan_result scan = {};
+    if (starts) {
+        phase_timer timer = stats ? start_phase(stats) : phase_timer{};
+        scan = prescan_starts(data, size, starts);
+        if (stats) { end_phase(stats, timer, phase_decode); }
+    }
+
+    size_t entry = 0;
+    int result = 0;
+
+    for (size_t first = 0; first < chunk_count && !result; first += round_size) {
+        size_t count = chunk_count - first < round_size ? chunk_count - first : round_size;
+        std::atomic<size_t> next_chunk(0);
+
+        auto worker = [&]() {
+            for (;;) {
+                size_t i = next_chunk.fetch_add(1);
+                if (i >= count) { break; }
+
+                size_t begin = (first + i) * parallel_chunk_size;
+                chunks[i].end = begin + parallel_chunk_size < size ? begin + parallel_chunk_size : size;
+                if (starts && begin <= scan.end) {
+                    begin = prescan_entry(data, size, starts, begin);
+                }
+                decode_chunk_from(data, size, begin, &chunks[i]);
+            }
+        };
+
+        std::thread workers[max_threads];
+        for (unsigned t = 0; t < thread_count; ++t) {
+            workers[t] = std::thread(worker);
+        }
+        for (unsigned t = 0; t < thread_count; ++t) {
+            workers[t].join();
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            decode_chunk *chunk = &chunks[i];
+            long text_offset = sync_text_offset(chunk, entry);
+
+            /* a chunk entered part way in would also count what comes before the entry */
+            if (text_offset < 0 || (stats && text_offset > 0)) {
+                decode_chunk_from(data, size, entry, chunk);
+                text_offset = 0;
+            }
+            if (stats) {
+                merge_decode_stats(stats, chunk->stats);
+            }
+
+            if (!writer_flush(out) ||
+                !writer_write(out, chunk->text.buffer + text_offset, chunk->text.used - (size_t) text_offset)) {
+                fprintf(stderr, "[ERROR] Error writing output\n");
+                result = 1;
+                break;
+            }
+
+            if (chunk->truncated) {
+                fill_decode_error(data, size, chunk->truncated_at, error);
+                result = 1;
+                break;
+            }
+
+            entry = chunk->final_offset;
+        }
+    }
+
+    for (size_t i = 0; i < round_size; ++i) {
+        free(chunks[i].text.buffer);
+    }
+    free(chunks);
+    free(chunk_stats);
+    free(starts);
+
+    return result;
+}
+
+// Streaming listing for pipes and FIFOs. A reader thread reads the input into a
+// ring of fixed-size blocks while the calling thread decodes and writes the
+// listing, so memory stays at stream_block_count blocks however long the stream
+// runs, and a slow consumer stops the reader and through the pipe the producer.
+// A block is handed over as soon as a read returns, so output keeps up with
+// input that trickles in. Each block has room in front of its data for the
+// tail of the block before it: the bytes of an instruction that straddles the
+// boundary are copied there, so every instruction is decoded from contiguous
+// memory and the listing is the same as for the whole input at once.
+enum {
+    stream_block_size = 1 << 18,
+    stream_block_count = 16,
+    stream_carry_size = 16     // more than the longest instruction with all its prefixes
+};
+
+struct stream_block {
+    uint8_t storage[stream_carry_size + stream_block_size];
+    size_t filled;
+};
+
+struct stream_ring {
+    stream_block *blocks;
+    size_t read_count;          // blocks filled by the reader so far
+    size_t release_count;       // blocks the decoder is done with
+    bool finished;              // no more blocks will come
+    bool failed;                // ... because a read failed
+    bool counting;
+    decode_stats read_stats;    // the reader's own counters, when counting
+    std::mutex lock;
+    std::condition_variable filled;
+    std::condition_variable released;
+};
+
+void read_stream_blocks(int fd, stream_ring *ring) {
+    for (;;) {
+        stream_block *block;
+        {
+            std::unique_lock<std::mutex> guard(ring->lock);
+            while (ring->read_count - ring->release_count == stream_block_count) {
+                ring->released.wait(guard);
+            }
+            block = &ring->blocks[ring->read_count % stream_block_count];
+        }
+
+        phase_timer timer = ring->counting ? start_phase(&ring->read_stats) : phase_timer{};
+        ssize_t count = read(fd, block->storage + stream_carry_size, stream_block_size);
+        if (ring->counting) {
+            end_phase(&ring->read_stats, timer, phase_read);
+            ring->read_stats.bytes_read += count > 0 ? (uint64_t) count : 0;
+        }
+
+        std::lock_guard<std::mutex> guard(ring->lock);
+        if (count > 0) {
+            block->filled = (size_t) count;
+            ring->read_count += 1;
+        } else {
+            ring->finished = true;
+            ring->failed = count < 0;
+        }
+        ring->filled.notify_one();
+        if (count <= 0) { break; }
+    }
+}
+
+// Decodes everything readable from `fd` until end of input. Returns 0 on
+// success, 1 when the stream ends inside an instruction (`error` says where)
+// and -1 when reading failed.
+int decode_stream(int fd, text_writer *out, decode_error *error, clock_totals *clocks = 0,
+                  decode_stats *stats = 0) {
+    stream_ring ring;
+    ring.blocks = (stream_block *) malloc(stream_block_count * sizeof(stream_block));
+    ring.read_count = 0;
+    ring.release_count = 0;
+    ring.finished = false;
+    ring.failed = false;
+    ring.counting = stats != 0;
+    ring.read_stats = {};
+    if (!ring.blocks) {
+        fprintf(stderr, "[ERROR] Out of memory for stream blocks\n");
+        return -1;
+    }
+
+    std::thread reader(read_stream_blocks, fd, &ring);
+
+    instruction batch[1024];
+    uint8_t carry[stream_carry_size];
+    size_t carry_size = 0;
+    size_t stream_offset = 0;    // offset in the stream of the first carried byte
+    int result = 0;
+
+    for (;;) {
+        bool last = false;
+        stream_block *block = 0;
+        {
+            std::unique_lock<std::mutex> guard(ring.lock);
+            if (ring.read_count == ring.release_count && !ring.finished) {
+                /* nothing to decode yet: let what is done so far through */
+                guard.unlock();
+                writer_flush(out);
+                guard.lock();
+            }
+            while (ring.read_count == ring.release_count && !ring.finished) {
+                ring.filled.wait(guard);
+            }
+            if (ring.read_count == ring.release_count) {
+                last = true;
+                result = ring.failed ? -1 : 0;
+            } else {
+                block = &ring.blocks[ring.release_count % stream_block_count];
+            }
+        }
+
+        if (last) {
+            if (carry_size && result == 0) {
+                fill_decode_error(carry, carry_size, 0, error);
+                error->offset += stream_offset;
+                result = 1;
+            }
+            break;
+        }
+
+        uint8_t *data = block->storage + stream_carry_size - carry_size;
+        memcpy(data, carry, carry_size);
+        instruction_cursor input = { data, carry_size + block->filled, 0 };
+        size_t position = 0;
+        phase_timer timer = stats ? start_phase(stats) : phase_timer{};
+
+        for (;;) {
+            decode_batch_result decoded = decode_batch(&input, batch, 1024);
+            write_listing_batch(out, batch, decoded.count, clocks);
+            if (stats) {
+                count_decoded(stats, data, batch, decoded.count, &position);
+            }
+            if (decoded.truncated || !cursor_remaining(&input)) { break; }
+        }
+
+        if (stats) {
+            count_skipped(stats, data, position, input.offset);
+            end_phase(stats, timer, phase_decode);
+        }
+
+        /* whatever is left is the start of an instruction the next block finishes */
+        stream_offset += input.offset;
+        carry_size = cursor_remaining(&input);
+        memcpy(carry, data + input.offset, carry_size);
+
+        std::lock_guard<std::mutex> guard(ring.lock);
+        ring.release_count += 1;
+        ring.released.notify_one();
+    }
+
+    reader.join();
+    if (stats) {
+        merge_decode_stats(stats, &ring.read_stats);
+    }
+    free(ring.blocks);
+    return result;
+}
+
+// Columnar binary listing. Instead of text, the decoded instructions are
+// written as one fixed-width column per field, so other tools can mmap the file
+// and read only the columns they need without parsing anything. All values are
+// little-endian. The file is laid out as:
+//
+//   column_file_header
+//   column_entry[column_count]       where each column starts and how wide it is
+//   source file name                 name_length bytes, not terminated
+//   columns                          each at a multiple of column_alignment
+//
+// Readers look columns up by id and skip ids they do not know, so columns can
+// be added without a new version; changing an existing column needs one.
+enum column_id : uint32_t {
+    column_offset,          // uint32_t, offset of the instruction in the input
+    column_length,          // uint8_t
+    column_family,          // uint8_t, instruction_family
+    column_mode,            // uint8_t, decode_mode
+    column_flags,           // uint8_t, instruction_flags
+    column_operands,        // destination then source, each operand_kind and index
+    column_displacement,    // int16_t
+    column_immediate,       // uint16_t
+    column_kinds
+};
+
+const uint32_t column_widths[column_kinds] = { 4, 1, 1, 1, 1, 4, 2, 2 };
+
+enum {
+    column_format_version = 1,
+    column_alignment = 64
+};
+
+const char column_magic[8] = { 'S', 'I', 'M', '8', '6', 'C', 'O', 'L' };
+
+struct column_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t column_count;
+    uint64_t instruction_count;
+    uint64_t source_size;
+    uint32_t name_length;
+    uint32_t reserved;
+};
+
+struct column_entry {
+    uint32_t id;
+    uint32_t width;
+    uint64_t offset;        // from the start of the file
+};
+
+static_assert(sizeof(column_file_header) == 40 && sizeof(column_entry) == 16, "the header layout is part of the format");
+
+inline uint64_t align_column(uint64_t offset) {
+    return (offset + column_alignment - 1) & ~(uint64_t)(column_alignment - 1);
+}
+
+// Decodes [data, data + size) into a column file at `path`. The instruction
+// count comes from the pre-scan, so the file is sized once, mapped and filled
+// in a single decoding pass. Returns 0 on success, 1 when an instruction runs
+// past the end of the input (the instructions before it are still written and
+// `error` says where) and -1 when the file could not be written.
+int write_column_file(const uint8_t *data, size_t size, const char *source_name, const char *path,
+                      decode_error *error) {
+    prescan_result scan = prescan_starts(data, size, 0);
+    uint32_t name_length = (uint32_t) strlen(source_name);
+
+    column_file_header header = {};
+    memcpy(header.magic, column_magic, sizeof(header.magic));
+    header.version = column_format_version;
+    header.column_count = column_kinds;
+    header.instruction_count = scan.count;
+    header.source_size = size;
+    header.name_length = name_length;
+
+    column_entry entries[column_kinds];
+    uint64_t file_size = sizeof(header) + sizeof(entries) + name_length;
+    for (uint32_t id = 0; id < column_kinds; ++id) {
+        file_size = align_column(file_size);
+        entries[id] = { id, column_widths[id], file_size };
+        file_size += scan.count * column_widths[id];
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "[ERROR] Could not create %s\n", path);
+        return -1;
+    }
+
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, (off_t) file_size) == 0) {
+        mapping = mmap(0, (size_t) file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "[ERROR] Could not map %s for writing\n", path);
+        return -1;
+    }
+
+    uint8_t *file = (uint8_t *) mapping;
+    memcpy(file, &header, sizeof(header));
+    memcpy(file + sizeof(header), entries, sizeof(entries));
+    memcpy(file + sizeof(header) + sizeof(entries), source_name, name_length);
+
+    uint32_t *offsets       = (uint32_t *) (file + entries[column_offset].offset);
+    uint8_t *lengths        = file + entries[column_length].offset;
+    uint8_t *families       = file + entries[column_family].offset;
+    uint8_t *modes          = file + entries[column_mode].offset;
+    uint8_t *flags          = file + entries[column_flags].offset;
+    operand *operands       = (operand *) (file + entries[column_operands].offset);
+    int16_t *displacements  = (int16_t *) (file + entries[column_displacement].offset);
+    uint16_t *immediates    = (uint16_t *) (file + entries[column_immediate].offset);
+
+    instruction_cursor input = { data, size, 0 };
+    instruction batch[1024];
+    uint64_t row = 0;
+    int result = 0;
+
+    for (;;) {
+        decode_batch_result decoded = decode_batch(&input, batch, 1024);
+
+        for (size_t i = 0; i < decoded.count && row < scan.count; ++i, ++row) {
+            const instruction *inst = &batch[i];
+            offsets[row]           = inst->offset;
+            lengths[row]           = inst->length;
+            families[row]          = inst->family;
+            modes[row]             = inst->mode;
+            flags[row]             = inst->flags;
+            operands[row * 2 + 0]  = inst->operands[0];
+            operands[row * 2 + 1]  = inst->operands[1];
+            displacements[row]     = inst->displacement;
+            immediates[row]        = inst->immediate;
+        }
+
+        if (decoded.truncated) {
+            fill_decode_error(data, size, input.offset, error);
+            result = 1;
+            break;
+        }
+
+        if (!cursor_remaining(&input)) { break; }
+    }
+
+    if (munmap(mapping, (size_t) file_size) != 0) {
+        fprintf(stderr, "[ERROR] Error writing %s\n", path);
+        return -1;
+    }
+
+    return result;
+}
+
+// Read side of the column format: the file is mapped and every known column is
+// a plain array into the mapping.
+struct column_file {
+    uint64_t count;
+    uint64_t source_size;
+    const char *source_name;
+    uint32_t name_length;
+    const uint32_t *offsets;
+    const uint8_t *lengths;
+    const uint8_t *families;
+    const uint8_t *modes;
+    const uint8_t *flags;
+    const operand *operands;        // two per instruction
+    const int16_t *displacements;
+    const uint16_t *immediates;
+    void *mapping;
+    size_t size;
+};
+
+void close_column_file(column_file *file) {
+    if (file->mapping) { munmap(file->mapping, file->size); }
+    *file = {};
+}
+
+// Maps the column file at `path` and checks its header and column table.
+// Prints the problem and returns false when the file cannot be used.
+bool open_column_file(const char *path, column_file *file) {
+    *file = {};
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) { close(fd); }
+        fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", path);
+        return false;
+    }
+
+    if ((size_t) info.st_size >= sizeof(column_file_header)) {
+        void *mapping = mmap(0, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            file->mapping = mapping;
+            file->size = (size_t) info.st_size;
+        }
+    }
+    close(fd);
+
+    const uint8_t *bytes = (const uint8_t *) file->mapping;
+    const column_file_header *header = (const column_file_header *) bytes;
+    if (!bytes || memcmp(header->magic, column_magic, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "[ERROR] %s is not a column file\n", path);
+        close_column_file(file);
+        return false;
+    }
+    if (header->version != column_format_version) {
+        fprintf(stderr, "[ERROR] %s has column format version %u, expected %u\n",
+                path, header->version, (unsigned) column_format_version);
+        close_column_file(file);
+        return false;
+    }
+
+    uint64_t table_end = sizeof(column_file_header) + (uint64_t) header->column_count * sizeof(column_entry);
+    const void *columns[column_kinds] = {};
+    bool valid = table_end + header->name_length <= file->size;
+
+    for (uint32_t i = 0; i < header->column_count && valid; ++i) {
+        column_entry entry;
+        memcpy(&entry, bytes + sizeof(column_file_header) + i * sizeof(column_entry), sizeof(entry));
+        if (entry.id >= column_kinds) { continue; }
+
+        valid = entry.width == column_widths[entry.id] && entry.offset % column_alignment == 0 &&
+                entry.offset <= file->size &&
+                header->instruction_count <= (file->size - entry.offset) / entry.width;
+        columns[entry.id] = bytes + entry.offset;
+    }
+    for (uint32_t id = 0; id < column_kinds && valid; ++id) {
+        valid = columns[id] != 0;
+    }
+
+    if (!valid) {
+        fprintf(stderr, "[ERROR] %s has a damaged column table\n", path);
+        close_column_file(file);
+        return false;
+    }
+
+    file->count         = header->instruction_count;
+    file->source_size   = header->source_size;
+    file->source_name   = (const char *) bytes + table_end;
+    file->name_length   = header->name_length;
+    file->offsets       = (const uint32_t *) columns[column_offset];
+    file->lengths       = (const uint8_t *) columns[column_length];
+    file->families      = (const uint8_t *) columns[column_family];
+    file->modes         = (const uint8_t *) columns[column_mode];
+    file->flags         = (const uint8_t *) columns[column_flags];
+    file->operands      = (const operand *) columns[column_operands];
+    file->displacements = (const int16_t *) columns[column_displacement];
+    file->immediates    = (const uint16_t *) columns[column_immediate];
+    return true;
+}
+
+inline bool valid_operand(operand op) {
+    switch (op.kind) {
+        case operand_none:
+        case operand_immediate:
+        case operand_relative:
+        case operand_far:       return true;
+        case operand_register:  return op.index < 16;
+        case operand_segment:   return op.index < 4;
+        case operand_memory:    return op.index < 24;
+    }
+    return false;
+}
+
+// Puts row `row` back together as a decoded instruction. Returns false when the
+// row holds values the listing tables have no entry for.
+bool column_instruction(const column_file *file, uint64_t row, instruction *out) {
+    *out = {};
+    out->offset       = file->offsets[row];
+    out->length       = file->lengths[row];
+    out->family       = (instruction_family) file->families[row];
+    out->mode         = (decode_mode) file->modes[row];
+    out->flags        = file->flags[row];
+    out->operands[0]  = file->operands[row * 2 + 0];
+    out->operands[1]  = file->operands[row * 2 + 1];
+    out->displacement = file->displacements[row];
+    out->immediate    = file->immediates[row];
+
+    return out->family < family_count && out->mode < decode_mode_count &&
+           valid_operand(out->operands[0]) && valid_operand(out->operands[1]);
+}
+
+// Writes the same listing the source file gives when decoded directly.
+int render_column_file(const column_file *file, text_writer *out) {
+    write_text(out, "; ", 2);
+    write_text(out, file->source_name, file->name_length);
+    write_text(out, ":\nbits 16\n\n", 11);
+
+    for (uint64_t row = 0; row < file->count; ++row) {
+        instruction inst;
+        if (!column_instruction(file, row, &inst)) {
+            fprintf(stderr, "[ERROR] Column file row %llu is not a valid instruction\n", (unsigned long long) row);
+            return 1;
+        }
+        write_instruction(out, &inst);
+    }
+
+    return 0;
+}
+
+// Batch listing of many small files in one process. Files are dealt out
+// round-robin to per-worker deques; a worker takes from the back of its own
+// deque and, once that is empty, steals from the front of the others, so a few
+// huge files do not leave the rest of the pool idle. Listings go either to one
+// file per input under an output directory or, in input order, to stdout.
+struct path_list {
+    char **items;
+    size_t count;
+    size_t capacity;
+};
+
+void path_list_push(path_list *list, const char *path) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->items = (char **) realloc(list->items, list->capacity * sizeof(char *));
+        if (!list->items) {
+            fprintf(stderr, "[ERROR] Out of memory for file list\n");
+            exit(1);
+        }
+    }
+    list->items[list->count++] = strdup(path);
+}
+
+void path_list_free(path_list *list) {
+    for (size_t i = 0; i < list->count; ++i) {
+        free(list->items[i]);
+    }
+    free(list->items);
+    *list = {};
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Adds `path`, or every regular file below it when it is a directory. Directory
+// entries are sorted so the batch order does not depend on the file system.
+bool add_batch_path(path_list *list, const char *path) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", path);
+        return false;
+    }
+
+    if (!S_ISDIR(info.st_mode)) {
+        path_list_push(list, path);
+        return true;
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir) {
+        fprintf(stderr, "[ERROR] Error opening directory = %s\n", path);
+        return false;
+    }
+
+    path_list entries = {};
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') { continue; }
+
+        size_t length = strlen(path) + strlen(entry->d_name) + 2;
+        char *child = (char *) malloc(length);
+        snprintf(child, length, "%s/%s", path, entry->d_name);
+        path_list_push(&entries, child);
+        free(child);
+    }
+    closedir(dir);
+
+    qsort(entries.items, entries.count, sizeof(char *), compare_paths);
+
+    bool result = true;
+    for (size_t i = 0; i < entries.count; ++i) {
+        result = add_batch_path(list, entries.items[i]) && result;
+    }
+
+    path_list_free(&entries);
+    return result;
+}
+
+// One path per line; blank lines are ignored.
+bool read_manifest(path_list *list, const char *manifest) {
+    FILE *file = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!file) {
+        fprintf(stderr, "[ERROR] Error opening manifest = %s\n", manifest);
+        return false;
+    }
+
+    bool result = true;
+    char line[4096];
+    while (fgets(line, sizeof(line), file)) {
+        size_t length = strcspn(line, "\r\n");
+        line[length] = 0;
+        if (length) {
+            result = add_batch_path(list, line) && result;
+        }
+    }
+
+    if (file != stdin) { fclose(file); }
+    return result;
+}
+
+struct batch_job {
+    const char *path;
+    text_writer text;
+    decode_error error;
+    int result;             // 0, 1 for a decode error, 2 when the file could not be read or written
+    std::atomic<bool> done;
+};
+
+struct work_deque {
+    std::mutex lock;
+    size_t *items;
+    size_t head;
+    size_t tail;
+};
+
+bool work_deque_pop(work_deque *deque, size_t *item) {
+    std::lock_guard<std::mutex> guard(deque->lock);
+    if (deque->head == deque->tail) { return false; }
+    *item = deque->items[--deque->tail];
+    return true;
+}
+
+bool work_deque_steal(work_deque *deque, size_t *item) {
+    std::lock_guard<std::mutex> guard(deque->lock);
+    if (deque->head == deque->tail) { return false; }
+    *item = deque->items[deque->head++];
+    return true;
+}
+
+// "dir/sub/a.com" is written to "<output_dir>/dir_sub_a.com.asm", so inputs
+// with the same base name in different directories do not overwrite each other.
+void batch_output_path(char *buffer, size_t size, const char *output_dir, const char *path) {
+    while (path[0] == '.' && path[1] == '/') { path += 2; }
+    while (path[0] == '/') { path += 1; }
+
+    int length = snprintf(buffer, size, "%s/", output_dir);
+    for (const char *at = path; *at && (size_t) length + 5 < size; ++at) {
+        buffer[length++] = (*at == '/') ? '_' : *at;
+    }
+    snprintf(buffer + length, size - (size_t) length, ".asm");
+}
+
+void run_batch_job(batch_job *job, const char *output_dir, decode_stats *stats) {
+    phase_timer timer = stats ? start_phase(stats) : phase_timer{};
+    input_buffer input;
+    if (!open_input(job->path, &input)) {
+        job->result = 2;
+        return;
+    }
+    if (stats) {
+        end_phase(stats, timer, phase_read);
+        stats->bytes_read += input.size;
+    }
+
+    char output_path[4096];
+    if (output_dir) {
+        batch_output_path(output_path, sizeof(output_path), output_dir, job->path);
+        job->text.fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job->text.fd < 0) {
+            close_input(&input);
+            job->result = 2;
+            return;
+        }
+        job->text.stats = stats;
+        writer_grow(&job->text, 1 << 16);
+    }
+
+    write_text(&job->text, "; ", 2);
+    write_text(&job->text, job->path, strlen(job->path));
+    write_text(&job->text, ":\nbits 16\n\n", 11);
+
+    job->result = decode_span(input.data, input.size, &job->text, &job->error, 0, stats);
+    close_input(&input);
+
+    if (output_dir) {
+        if (!writer_flush(&job->text)) { job->result = 2; }
+        close(job->text.fd);
+        free(job->text.buffer);
+        job->text = {};
+    }
+}
+
+// With `stats`, every worker counts into its own decode_stats and they are
+// added to `stats` once the workers are done.
+int decode_batch_files(path_list *paths, const char *output_dir, unsigned thread_count, text_writer *out,
+                       decode_stats *stats = 0) {
+    if (thread_count > max_threads) { thread_count = max_threads; }
+    if (thread_count > paths->count) { thread_count = (unsigned) paths->count; }
+    if (thread_count == 0) { return 0; }
+
+    decode_stats *thread_stats = 0;
+    if (stats) {
+        thread_stats = (decode_stats *) calloc(thread_count, sizeof(decode_stats));
+        if (!thread_stats) {
+            fprintf(stderr, "[ERROR] Out of memory for statistics\n");
+            return 1;
+        }
+    }
+
+    batch_job *jobs = new batch_job[paths->count];
+    work_deque *deques = new work_deque[thread_count];
+    size_t *slots = (size_t *) malloc(paths->count * sizeof(size_t));
+
+    size_t per_worker = (paths->count + thread_count - 1) / thread_count;
+    for (unsigned t = 0; t < thread_count; ++t) {
+        deques[t].items = slots + t * per_worker;
+        deques[t].head = 0;
+        deques[t].tail = 0;
+    }
+
+    for (size_t i = 0; i < paths->count; ++i) {
+        jobs[i].path = paths->items[i];
+        jobs[i].text = { 0, 0, 0, -1 };
+        jobs[i].error = {};
+        jobs[i].result = 0;
+        jobs[i].done = false;
+
+        /* dealt so that each deque holds a contiguous run, with the earliest files at the back */
+        work_deque *deque = &deques[i / per_worker];
+        deque->items[deque->tail++] = i;
+    }
+    for (unsigned t = 0; t < thread_count; ++t) {
+        for (size_t a = 0, b = deques[t].tail; a + 1 < b; ++a, --b) {
+            size_t tmp = deques[t].items[a];
+            deques[t].items[a] = deques[t].items[b - 1];
+            deques[t].items[b - 1] = tmp;
+        }
+    }
+
+    std::mutex done_lock;
+    std::condition_variable done_signal;
+
+    auto worker = [&](unsigned self) {
+        size_t item;
+        for (;;) {
+            bool found = work_deque_pop(&deques[self], &item);
+            for (unsigned i = 1; !found && i < thread_count; ++i) {
+                found = work_deque_steal(&deques[(self + i) % thread_count], &item);
+            }
+            if (!found) { break; }
+
+            run_batch_job(&jobs[item], output_dir, thread_stats ? &thread_stats[self] : 0);
+
+            std::lock_guard<std::mutex> guard(done_lock);
+            jobs[item].done = true;
+            done_signal.notify_one();
+        }
+    };
+
+    std::thread workers[max_threads];
+    for (unsigned t = 0; t < thread_count; ++t) {
+        workers[t] = std::thread(worker, t);
+    }
+
+    /* listings and errors are reported in input order as soon as they are ready */
+    int result = 0;
+    for (size_t i = 0; i < paths->count; ++i) {
+        batch_job *job = &jobs[i];
+        {
+            std::unique_lock<std::mutex> guard(done_lock);
+            done_signal.wait(guard, [job]() { return job->done.load(); });
+        }
+
+        if (!output_dir && job->text.used) {
+            if (!writer_flush(out) || !writer_write(out, job->text.buffer, job->text.used)) {
+                fprintf(stderr, "[ERROR] Error writing output\n");
+                result = 1;
+            }
+        }
+        free(job->text.buffer);
+        job->text = {};
+
+        if (job->result == 1) {
+            print_decode_error(job->path, &job->error);
+            result = 1;
+        } else if (job->result == 2) {
+            fprintf(stderr, "[ERROR] Error reading or writing listing for filename = %s\n", job->path);
+            result = 1;
+        }
+    }
+
+    for (unsigned t = 0; t < thread_count; ++t) {
+        workers[t].join();
+        if (stats) {
+            merge_decode_stats(stats, &thread_stats[t]);
+        }
+    }
+
+    free(thread_stats);
+    free(slots);
+    delete[] deques;
+    delete[] jobs;
+
+    return result;
+}
+
+// Execution. A machine is the 8086 register file plus a flat 1 MiB memory; the
+// program image is loaded at linear address 0 with every segment register and
+// IP at zero, and runs until it halts, leaves the loaded image or hits an
+// instruction it cannot complete. The step loop is a template on `trace` so the
+// plain run does no text work at all.
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "AL/AH aliasing over the word registers assumes a little-endian host"
+#endif
+
+enum {
+    memory_size = 1 << 20,
+    memory_mask = memory_size - 1
+};
+
+enum register_index {
+    reg_ax, reg_cx, reg_dx, reg_bx, reg_sp, reg_bp, reg_si, reg_di
+};
+
+enum segment_index {
+    seg_es, seg_cs, seg_ss, seg_ds
+};
+
+enum cpu_flags : uint16_t {
+    flag_carry     = 1 << 0,
+    flag_parity    = 1 << 2,
+    flag_auxiliary = 1 << 4,
+    flag_zero      = 1 << 6,
+    flag_sign      = 1 << 7,
+    flag_trap      = 1 << 8,
+    flag_interrupt = 1 << 9,
+    flag_direction = 1 << 10,
+    flag_overflow  = 1 << 11
+};
+
+const char flag_letters[16] = { 'C', 0, 'P', 0, 'A', 0, 'Z', 'S', 'T', 'I', 'D', 'O' };
+
+enum stop_reason {
+    stop_running,
+    stop_end_of_program,
+    stop_halt,
+    stop_unknown_opcode,
+    stop_unhandled_interrupt,
+    stop_step_limit
+};
+
+// Predecode cache. Decoded records are kept in a direct-mapped table indexed by
+// the low bits of the linear address they were fetched from, so a loop body is
+// only run through the ModRM logic once. Memory is split into 256-byte pages;
+// a page that holds the start or end of a cached instruction is marked as code
+// in the machine's page map, and a write to a code page drops every cached
+// record that overlaps it.
+enum {
+    predecode_slots = 1 << 16,
+    predecode_slot_mask = predecode_slots - 1,
+    code_page_shift = 8,
+    code_page_size = 1 << code_page_shift,
+    code_page_count = memory_size >> code_page_shift,
+    max_instruction_length = max_prefixes + 6,
+    predecode_empty = 0xFFFFFFFF
+};
+
+enum code_page_bits : uint8_t {
+    code_page_predecoded = 1,   // the predecode cache holds records from this page
+    code_page_translated = 2,   // a translated block holds instructions from this page
+    code_page_shared = 4        // the page still holds what the shared predecode cache was built from
+};
+
+struct predecode_cache {
+    uint32_t tags[predecode_slots];             // linear address of the record, or predecode_empty
+    instruction records[predecode_slots];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;                     // page writes that dropped cached code
+};
+
+// Block translation. Straight-line runs of instructions ending at a control
+// transfer are compiled into arrays of handlers with their register operands
+// resolved to offsets into the register file. Each handler does its work and
+// tail-calls the next one; the last op of every block is block_exit, which
+// returns to the run loop. Blocks remember the CS:IP of their last two
+// successors and the index of the block there, so hot loops go from block to
+// block without a table lookup. A store into a translated page throws every
+// block away.
+enum {
+    max_block_ops = 32,
+    block_op_capacity = 1 << 16,
+    max_blocks = 1 << 13,
+    block_slots = 1 << 12,
+    block_slot_mask = block_slots - 1,
+    no_block = -1
+};
+
+struct machine;
+struct block_op;
+
+typedef void (*block_handler)(machine *m, const block_op *op);
+
+struct block_op {
+    block_handler handler;
+    instruction inst;
+    uint16_t next_ip;           // IP after this instruction
+    uint8_t destination;        // byte offset of a register operand in machine::registers
+    uint8_t source;
+};
+
+struct translated_block {
+    uint32_t key;               // CS << 16 | IP of the first instruction
+    uint32_t first_op;
+    uint32_t op_count;          // instructions, not counting block_exit
+    uint32_t successor_keys[2];
+    int32_t successors[2];      // block index, or no_block
+};
+
+struct block_cache {
+    block_op ops[block_op_capacity];
+    translated_block blocks[max_blocks];
+    int32_t slots[block_slots];                 // direct-mapped on the linear address
+    uint32_t op_count;
+    uint32_t block_count;
+    uint32_t generation;                        // bumped whenever every block is dropped
+    uint64_t translated;
+    uint64_t chained;                           // block entries that skipped the lookup
+    uint64_t flushes;
+};
+
+// Lazy flags. The arithmetic flags are not computed when an instruction runs;
+// the operation, its operands and its unmasked result are recorded instead, and
+// single flags are worked out from them when something reads one. Until then
+// machine::flags only holds TF, IF and DF plus whatever was last resolved.
+enum lazy_operation : uint8_t {
+    lazy_none,      // machine::flags is up to date
+    lazy_add,
+    lazy_sub,
+    lazy_inc,       // like add, but CF is the one recorded in `carry`
+    lazy_dec,
+    lazy_logic
+};
+
+enum {
+    arithmetic_flags = flag_carry | flag_parity | flag_auxiliary | flag_zero | flag_sign | flag_overflow
+};
+
+struct pending_flags {
+    uint32_t result;            // before masking to the operand size
+    uint16_t a;
+    uint16_t b;
+    lazy_operation operation;
+    uint8_t carry;              // carry/borrow in for ADC/SBB, the previous CF for INC/DEC
+    bool wide;
+};
+
+// Execution trace recording. Every executed instruction appends one record to
+// an arena: a mask of the registers, segment registers and flags it changed,
+// the change in IP, each changed value as the difference from its old one, and
+// the bytes it wrote to memory. Numbers are LEB128 varints and differences are
+// zigzag coded, so most steps take three to six bytes. The arena goes to the
+// file whenever it fills up. Every checkpoint_interval steps a checkpoint with
+// the full register state and the contents of every page written since the
+// start is recorded too, and its position goes into an index at the end of the
+// file, so a replayer can restore the nearest checkpoint and roll forward from
+// there without executing anything. The file is laid out as:
+//
+//   trace_header, program image (image_size bytes)
+//   step and checkpoint records
+//   trace_checkpoint_entry[checkpoint_count]
+//   trace_footer
+enum : uint32_t {
+    trace_format_version = 1,
+    trace_arena_size = 1 << 22,
+    trace_state_count = 14,             // registers, segment registers, flags, IP
+    trace_changed_memory = 1 << 13,     // mask bits 0-12 follow the order of trace_state
+    trace_checkpoint_marker = 1 << 14,
+    default_checkpoint_interval = 1 << 18
+};
+
+const char trace_magic[8] = { 'S', 'I', 'M', '8', '6', 'T', 'R', 'C' };
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t image_size;
+    uint64_t checkpoint_interval;
+};
+
+struct trace_checkpoint_entry {
+    uint64_t steps;
+    uint64_t offset;        // of the checkpoint record in the file
+};
+
+struct trace_footer {
+    uint64_t index_offset;
+    uint64_t checkpoint_count;
+    uint64_t step_count;
+    char magic[8];
+};
+
+struct trace_memory_write {
+    uint32_t address;
+    uint8_t value;
+};
+
+struct trace_recorder {
+    int fd;
+    bool failed;
+    uint8_t *arena;
+    size_t used;
+    size_t capacity;
+    uint64_t flushed;                   // bytes of the file already written
+    uint16_t last[trace_state_count];   // state after the previous step
+    uint32_t last_address;              // of the previous memory write, reset by checkpoints
+    trace_memory_write *writes;         // memory writes of the current step
+    size_t write_count;
+    size_t write_capacity;
+    uint64_t checkpoint_interval;
+    uint64_t next_checkpoint;
+    trace_checkpoint_entry *checkpoints;
+    size_t checkpoint_count;
+    size_t checkpoint_capacity;
+    uint8_t written_pages[code_page_count];
+};
+
+inline void record_memory_write(trace_recorder *recorder, uint32_t address, uint8_t value) {
+    if (recorder->write_count == recorder->write_capacity) {
+        grow_array(&recorder->writes, &recorder->write_capacity, recorder->write_count + 1, "trace memory writes");
+    }
+    recorder->writes[recorder->write_count++] = { address, value };
+    recorder->written_pages[address >> code_page_shift] = 1;
+}
+
+struct machine {
+    uint16_t registers[8];
+    uint16_t segments[4];
+    uint16_t ip;
+    uint16_t flags;
+    pending_flags pending;
+    bool eager_flags;           // compute every flag as it changes (the reference for --check-flags)
+    uint8_t *memory;
+    predecode_cache *cache;     // null when every instruction is decoded on fetch
+    const predecode_cache *shared_cache;    // read-only records for pages marked code_page_shared
+    block_cache *blocks;        // null when instructions are interpreted one at a time
+    trace_recorder *recorder;   // null unless the run is being recorded
+    uint8_t *code_pages;        // code_page_bits for each page of memory
+    uint32_t program_begin;     // linear range of the loaded image
+    uint32_t program_end;
+    uint64_t steps;
+    stop_reason stop;
+    uint8_t stop_detail;        // opcode or interrupt number for the error
+    void *snapshot;             // mapping memory and code_pages (and maybe cache) live in, when restored
+    size_t snapshot_size;
+};
+
+inline uint32_t linear_address(uint16_t segment, uint16_t offset) {
+    return (((uint32_t) segment << 4) + offset) & memory_mask;
+}
+
+inline uint8_t *byte_register(machine *m, uint8_t reg) {
+    return (uint8_t *) &m->registers[reg & 0b011] + (reg >> 2);
+}
+
+inline uint16_t read_memory(machine *m, uint32_t address, bool wide) {
+    uint16_t value = m->memory[address];
+    if (wide) {
+        value |= (uint16_t)(m->memory[(address + 1) & memory_mask] << 8);
+    }
+    return value;
+}
+
+void flush_blocks(machine *m) {
+    block_cache *blocks = m->blocks;
+    for (int i = 0; i < block_slots; ++i) {
+        blocks->slots[i] = no_block;
+    }
+    for (uint32_t page = 0; page < code_page_count; ++page) {
+        m->code_pages[page] &= ~code_page_translated;
+    }
+
+    blocks->op_count = 0;
+    blocks->block_count = 0;
+    blocks->generation += 1;
+    blocks->flushes += 1;
+}
+
+void drop_predecoded_page(predecode_cache *cache, uint32_t page) {
+    // Records start at most max_instruction_length - 1 bytes before the page.
+    uint32_t first = (page << code_page_shift) - (max_instruction_length - 1);
+    uint32_t end = (page + 1) << code_page_shift;
+
+    for (uint32_t address = first; address != end; ++address) {
+        uint32_t linear = address & memory_mask;
+        uint32_t slot = linear & predecode_slot_mask;
+        if (cache->tags[slot] != linear) { continue; }
+
+        uint32_t last = (linear + cache->records[slot].length - 1) & memory_mask;
+        if ((linear >> code_page_shift) == page || (last >> code_page_shift) == page) {
+            cache->tags[slot] = predecode_empty;
+        }
+    }
+
+    cache->invalidations += 1;
+}
+
+void invalidate_code_page(machine *m, uint32_t page) {
+    if ((m->code_pages[page] & code_page_predecoded) && m->cache) {
+        drop_predecoded_page(m->cache, page);
+    }
+    if ((m->code_pages[page] & code_page_translated) && m->blocks) {
+        flush_blocks(m);
+    }
+    m->code_pages[page] = 0;
+}
+
+inline void write_memory_byte(machine *m, uint32_t address, uint8_t value) {
+    m->memory[address] = value;
+    if (m->recorder) {
+        record_memory_write(m->recorder, address, value);
+    }
+    if (m->code_pages[address >> code_page_shift]) {
+        invalidate_code_page(m, address >> code_page_shift);
+    }
+}
+
+inline void write_memory(machine *m, uint32_t address, uint16_t value, bool wide) {
+    write_memory_byte(m, address, (uint8_t) value);
+    if (wide) {
+        write_memory_byte(m, (address + 1) & memory_mask, (uint8_t)(value >> 8));
+    }
+}
+
+inline void push_word(machine *m, uint16_t value) {
+    m->registers[reg_sp] -= 2;
+    write_memory(m, linear_address(m->segments[seg_ss], m->registers[reg_sp]), value, true);
+}
+
+inline uint16_t pop_word(machine *m) {
+    uint16_t value = read_memory(m, linear_address(m->segments[seg_ss], m->registers[reg_sp]), true);
+    m->registers[reg_sp] += 2;
+    return value;
+}
+
+// Offset part of a ModRM memory operand, before the segment is applied.
+inline uint16_t effective_offset(machine *m, const instruction *inst, uint8_t index) {
+    uint8_t mod = index >> 3;
+    uint8_t rm  = index & 0b00000111;
+    uint16_t *r = m->registers;
+
+    if (mod == 0b00000000 && rm == 0b00000110) { return (uint16_t) inst->displacement; }
+
+    uint16_t base = 0;
+    switch (rm) {
+        case 0: { base = r[reg_bx] + r[reg_si]; break; }
+        case 1: { base = r[reg_bx] + r[reg_di]; break; }
+        case 2: { base = r[reg_bp] + r[reg_si]; break; }
+        case 3: { base = r[reg_bp] + r[reg_di]; break; }
+        case 4: { base = r[reg_si]; break; }
+        case 5: { base = r[reg_di]; break; }
+        case 6: { base = r[reg_bp]; break; }
+        case 7: { base = r[reg_bx]; break; }
+    }
+
+    return (uint16_t)(base + (mod ? inst->displacement : 0));
+}
+
+// Segment for data accesses: the override prefix if there is one, otherwise SS
+// for BP-based addresses and DS for everything else.
+inline uint16_t data_segment(machine *m, const instruction *inst, uint8_t index) {
+    if (inst->flags & instruction_segment_override) {
+        return m->segments[segment_override(inst->flags)];
+    }
+
+    uint8_t mod = index >> 3;
+    uint8_t rm  = index & 0b00000111;
+    bool bp_based = (rm == 2 || rm == 3 || (rm == 6 && mod != 0b00000000));
+    return m->segments[bp_based ? seg_ss : seg_ds];
+}
+
+inline uint32_t operand_address(machine *m, const instruction *inst, operand op) {
+    return linear_address(data_segment(m, inst, op.index), effective_offset(m, inst, op.index));
+}
+
+// Reads an operand. `address` is the linear address of the instruction's memory
+// operand, worked out once per instruction.
+inline uint16_t load_operand(machine *m, const instruction *inst, operand op, uint32_t address, bool wide) {
+    switch (op.kind) {
+        case operand_register: {
+            if (op.index >> 3) { return m->registers[op.index & 0b00000111]; }
+            return *byte_register(m, op.index);
+        }
+        case operand_segment: {
+            return m->segments[op.index];
+        }
+        case operand_memory: {
+            return read_memory(m, address, wide);
+        }
+        case operand_immediate: {
+            return wide ? inst->immediate : (uint8_t) inst->immediate;
+        }
+        default: {
+            return 0;
+        }
+    }
+}
+
+inline void store_operand(machine *m, operand op, uint32_t address, bool wide, uint16_t value) {
+    switch (op.kind) {
+        case operand_register: {
+            if (op.index >> 3) {
+                m->registers[op.index & 0b00000111] = value;
+            } else {
+                *byte_register(m, op.index) = (uint8_t) value;
+            }
+            break;
+        }
+        case operand_segment: {
+            m->segments[op.index] = value;
+            break;
+        }
+        case operand_memory: {
+            write_memory(m, address, value, wide);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+struct parity_table {
+    bool even[256];
+};
+
+constexpr parity_table make_parity_table() {
+    parity_table table = {};
+    for (int value = 0; value < 256; ++value) {
+        int bits = 0;
+        for (int bit = 0; bit < 8; ++bit) {
+            bits += (value >> bit) & 1;
+        }
+        table.even[value] = !(bits & 1);
+    }
+    return table;
+}
+
+constexpr parity_table parity_lookup = make_parity_table();
+
+inline bool carry_flag(const machine *m) {
+    const pending_flags *p = &m->pending;
+    switch (p->operation) {
+        case lazy_none:  { return (m->flags & flag_carry) != 0; }
+        case lazy_add:   { return p->result > (p->wide ? 0xFFFFu : 0xFFu); }
+        case lazy_sub:   { return (uint32_t) p->b + p->carry > p->a; }
+        case lazy_inc:
+        case lazy_dec:   { return p->carry != 0; }
+        case lazy_logic: { return false; }
+    }
+    return false;
+}
+
+inline bool zero_flag(const machine *m) {
+    const pending_flags *p = &m->pending;
+    if (p->operation == lazy_none) { return (m->flags & flag_zero) != 0; }
+    return (p->result & (p->wide ? 0xFFFFu : 0xFFu)) == 0;
+}
+
+inline bool sign_flag(const machine *m) {
+    const pending_flags *p = &m->pending;
+    if (p->operation == lazy_none) { return (m->flags & flag_sign) != 0; }
+    return (p->result & (p->wide ? 0x8000u : 0x80u)) != 0;
+}
+
+inline bool parity_flag(const machine *m) {
+    const pending_flags *p = &m->pending;
+    if (p->operation == lazy_none) { return (m->flags & flag_parity) != 0; }
+    return parity_lookup.even[(uint8_t) p->result];
+}
+
+inline bool overflow_flag(const machine *m) {
+    const pending_flags *p = &m->pending;
+    uint32_t sign = p->wide ? 0x8000 : 0x80;
+    switch (p->operation) {
+        case lazy_none:  { return (m->flags & flag_overflow) != 0; }
+        case lazy_add:
+        case lazy_inc:   { return ((p->a ^ p->result) & (p->b ^ p->result) & sign) != 0; }
+        case lazy_sub:
+        case lazy_dec:   { return ((p->a ^ p->b) & (p->a ^ p->result) & sign) != 0; }
+        case lazy_logic: { return false; }
+    }
+    return false;
+}
+
+inline bool auxiliary_flag(const machine *m) {
+    const pending_flags *p = &m->pending;
+    if (p->operation == lazy_none) { return (m->flags & flag_auxiliary) != 0; }
+    if (p->operation == lazy_logic) { return false; }
+    return ((p->a ^ p->b ^ p->result) & 0x10) != 0;
+}
+
+// The full flags word, without touching the machine.
+uint16_t evaluate_flags(const machine *m) {
+    if (m->pending.operation == lazy_none) { return m->flags; }
+
+    uint16_t flags = m->flags & ~arithmetic_flags;
+    if (carry_flag(m))     { flags |= flag_carry; }
+    if (parity_flag(m))    { flags |= flag_parity; }
+    if (auxiliary_flag(m)) { flags |= flag_auxiliary; }
+    if (zero_flag(m))      { flags |= flag_zero; }
+    if (sign_flag(m))      { flags |= flag_sign; }
+    if (overflow_flag(m))  { flags |= flag_overflow; }
+    return flags;
+}
+
+// Folds any pending operation into machine::flags, for code that reads or
+// changes the flags word as a whole.
+inline uint16_t resolve_flags(machine *m) {
+    if (m->pending.operation != lazy_none) {
+        m->flags = evaluate_flags(m);
+        m->pending.operation = lazy_none;
+    }
+    return m->flags;
+}
+
+inline void set_flag(machine *m, uint16_t flag, bool on) {
+    uint16_t flags = resolve_flags(m);
+    m->flags = on ? (flags | flag) : (flags & ~flag);
+}
+
+// ZF, SF and PF from a result of the given width.
+inline void set_result_flags(machine *m, uint32_t result, bool wide) {
+    uint32_t mask = wide ? 0xFFFF : 0xFF;
+    uint32_t sign = wide ? 0x8000 : 0x80;
+    set_flag(m, flag_zero, (result & mask) == 0);
+    set_flag(m, flag_sign, (result & sign) != 0);
+    set_flag(m, flag_parity, parity_lookup.even[(uint8_t) result]);
+}
+
+inline void record_flags(machine *m, lazy_operation operation, uint32_t a, uint32_t b,
+                         uint32_t carry, uint32_t result, bool wide) {
+    m->pending.result = result;
+    m->pending.a = (uint16_t) a;
+    m->pending.b = (uint16_t) b;
+    m->pending.operation = operation;
+    m->pending.carry = (uint8_t) carry;
+    m->pending.wide = wide;
+}
+
+uint16_t alu_add(machine *m, uint32_t a, uint32_t b, uint32_t carry, bool wide, bool keep_carry = false) {
+    uint32_t mask = wide ? 0xFFFF : 0xFF;
+    uint32_t sign = wide ? 0x8000 : 0x80;
+    uint32_t result = a + b + carry;
+
+    if (!m->eager_flags) {
+        if (keep_carry) {
+            record_flags(m, lazy_inc, a, b, carry_flag(m), result, wide);
+        } else {
+            record_flags(m, lazy_add, a, b, carry, result, wide);
+        }
+        return (uint16_t)(result & mask);
+    }
+
+    if (!keep_carry) { set_flag(m, flag_carry, result > mask); }
+    set_flag(m, flag_auxiliary, ((a ^ b ^ result) & 0x10) != 0);
+    set_flag(m, flag_overflow, ((a ^ result) & (b ^ result) & sign) != 0);
+    set_result_flags(m, result, wide);
+    return (uint16_t)(result & mask);
+}
+
+uint16_t alu_sub(machine *m, uint32_t a, uint32_t b, uint32_t borrow, bool wide, bool keep_carry = false) {
+    uint32_t mask = wide ? 0xFFFF : 0xFF;
+    uint32_t sign = wide ? 0x8000 : 0x80;
+    uint32_t result = a - b - borrow;
+
+    if (!m->eager_flags) {
+        if (keep_carry) {
+            record_flags(m, lazy_dec, a, b, carry_flag(m), result, wide);
+        } else {
+            record_flags(m, lazy_sub, a, b, borrow, result, wide);
+        }
+        return (uint16_t)(result & mask);
+    }
+
+    if (!keep_carry) { set_flag(m, flag_carry, b + borrow > a); }
+    set_flag(m, flag_auxiliary, ((a ^ b ^ result) & 0x10) != 0);
+    set_flag(m, flag_overflow, ((a ^ b) & (a ^ result) & sign) != 0);
+    set_result_flags(m, result, wide);
+    return (uint16_t)(result & mask);
+}
+
+uint16_t alu_logic(machine *m, uint32_t result, bool wide) {
+    if (!m->eager_flags) {
+        record_flags(m, lazy_logic, 0, 0, 0, result, wide);
+        return (uint16_t) result;
+    }
+
+    set_flag(m, flag_carry, false);
+    set_flag(m, flag_overflow, false);
+    set_flag(m, flag_auxiliary, false);
+    set_result_flags(m, result, wide);
+    return (uint16_t) result;
+}
+
+// Shifts and rotates one bit at a time; the 8086 does not mask the count.
+uint16_t alu_shift(machine *m, instruction_family family, uint32_t value, uint32_t count, bool wide) {
+    if (count == 0) { return (uint16_t) value; }
+
+    uint32_t mask = wide ? 0xFFFF : 0xFF;
+    uint32_t sign = wide ? 0x8000 : 0x80;
+    bool carry = carry_flag(m);
+    bool overflow = false;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        bool top = (value & sign) != 0;
+        bool bottom = (value & 1) != 0;
+
+        switch (family) {
+            case family_shl: { value = (value << 1) & mask; carry = top; break; }
+            case family_shr: { value = value >> 1; carry = bottom; break; }
+            case family_sar: { value = (value >> 1) | (top ? sign : 0); carry = bottom; break; }
+            case family_rol: { value = ((value << 1) & mask) | (top ? 1 : 0); carry = top; break; }
+            case family_ror: { value = (value >> 1) | (bottom ? sign : 0); carry = bottom; break; }
+            case family_rcl: { value = ((value << 1) & mask) | (carry ? 1 : 0); carry = top; break; }
+            case family_rcr: { value = (value >> 1) | (carry ? sign : 0); carry = bottom; break; }
+            default: { break; }
+        }
+
+        if (family == family_shr) {
+            overflow = top;
+        } else if (family == family_sar) {
+            overflow = false;
+        } else if (family == family_ror || family == family_rcr) {
+            overflow = ((value ^ (value << 1)) & sign) != 0;
+        } else {
+            overflow = (((value & sign) != 0) != carry);
+        }
+    }
+
+    set_flag(m, flag_carry, carry);
+    set_flag(m, flag_overflow, overflow);
+    if (family == family_shl || family == family_shr || family == family_sar) {
+        set_result_flags(m, value, wide);
+    }
+    return (uint16_t) value;
+}
+
+// The two-operand ALU families. Handlers with a constant family fold the switch.
+inline uint16_t alu_binary(machine *m, instruction_family family, uint16_t a, uint16_t b, bool wide) {
+    uint32_t carry = (family == family_adc || family == family_sbb) ? carry_flag(m) : 0;
+
+    switch (family) {
+        case family_add:  { return alu_add(m, a, b, 0, wide); }
+        case family_adc:  { return alu_add(m, a, b, carry, wide); }
+        case family_sub:
+        case family_cmp:  { return alu_sub(m, a, b, 0, wide); }
+        case family_sbb:  { return alu_sub(m, a, b, carry, wide); }
+        case family_and:
+        case family_test: { return alu_logic(m, a & b, wide); }
+        case family_or:   { return alu_logic(m, a | b, wide); }
+        case family_xor:  { return alu_logic(m, a ^ b, wide); }
+        default:          { return 0; }
+    }
+}
+
+inline bool jump_taken(machine *m, instruction_family family) {
+    switch (family) {
+        case family_jo:  { return overflow_flag(m); }
+        case family_jno: { return !overflow_flag(m); }
+        case family_jb:  { return carry_flag(m); }
+        case family_jnb: { return !carry_flag(m); }
+        case family_je:  { return zero_flag(m); }
+        case family_jne: { return !zero_flag(m); }
+        case family_jbe: { return carry_flag(m) || zero_flag(m); }
+        case family_ja:  { return !carry_flag(m) && !zero_flag(m); }
+        case family_js:  { return sign_flag(m); }
+        case family_jns: { return !sign_flag(m); }
+        case family_jp:  { return parity_flag(m); }
+        case family_jnp: { return !parity_flag(m); }
+        case family_jl:  { return sign_flag(m) != overflow_flag(m); }
+        case family_jnl: { return sign_flag(m) == overflow_flag(m); }
+        case family_jle: { return zero_flag(m) || sign_flag(m) != overflow_flag(m); }
+        case family_jg:  { return !zero_flag(m) && sign_flag(m) == overflow_flag(m); }
+        default:         { return false; }
+    }
+}
+
+// Enters an interrupt handler through the vector table at 0000:0000. A vector
+// of 0000:0000 means nothing is installed and execution stops.
+bool interrupt(machine *m, uint8_t number) {
+    uint16_t offset  = read_memory(m, (uint32_t) number * 4, true);
+    uint16_t segment = read_memory(m, (uint32_t) number * 4 + 2, true);
+    if (!offset && !segment) {
+        m->stop = stop_unhandled_interrupt;
+        m->stop_detail = number;
+        return false;
+    }
+
+    push_word(m, resolve_flags(m));
+    set_flag(m, flag_interrupt, false);
+    set_flag(m, flag_trap, false);
+    push_word(m, m->segments[seg_cs]);
+    push_word(m, m->ip);
+    m->segments[seg_cs] = segment;
+    m->ip = offset;
+    return true;
+}
+
+// Runs one string instruction, with its REP prefix if it has one.
+void execute_string(machine *m, const instruction *inst) {
+    bool wide = (inst->flags & instruction_wide) != 0;
+    bool repeat = (inst->flags & (instruction_rep | instruction_repne)) != 0;
+    uint16_t step = wide ? 2 : 1;
+    uint16_t source_segment = (inst->flags & instruction_segment_override)
+        ? m->segments[segment_override(inst->flags)] : m->segments[seg_ds];
+    uint16_t *r = m->registers;
+
+    while (!repeat || r[reg_cx]) {
+        uint32_t source = linear_address(source_segment, r[reg_si]);
+        uint32_t destination = linear_address(m->segments[seg_es], r[reg_di]);
+        bool uses_si = true;
+        bool uses_di = true;
+        bool compares = false;
+
+        switch (inst->family) {
+            case family_movsb:
+            case family_movsw: {
+                write_memory(m, destination, read_memory(m, source, wide), wide);
+                break;
+            }
+            case family_cmpsb:
+            case family_cmpsw: {
+                alu_sub(m, read_memory(m, source, wide), read_memory(m, destination, wide), 0, wide);
+                compares = true;
+                break;
+            }
+            case family_scasb:
+            case family_scasw: {
+                alu_sub(m, wide ? r[reg_ax] : (r[reg_ax] & 0xFF), read_memory(m, destination, wide), 0, wide);
+                uses_si = false;
+                compares = true;
+                break;
+            }
+            case family_lodsb:
+            case family_lodsw: {
+                store_operand(m, { operand_register, (uint8_t)(wide ? 0b1000 : 0) }, 0, wide, read_memory(m, source, wide));
+                uses_di = false;
+                break;
+            }
+            case family_stosb:
+            case family_stosw: {
+                write_memory(m, destination, r[reg_ax], wide);
+                uses_si = false;
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+
+        uint16_t delta = (m->flags & flag_direction) ? (uint16_t) -step : step;
+        if (uses_si) { r[reg_si] += delta; }
+        if (uses_di) { r[reg_di] += delta; }
+
+        if (!repeat) { break; }
+
+        r[reg_cx] -= 1;
+        if (compares) {
+            bool zero = zero_flag(m);
+            if ((inst->flags & instruction_rep) && !zero) { break; }
+            if ((inst->flags & instruction_repne) && zero) { break; }
+        }
+    }
+}
+
+// Executes one decoded instruction. IP already points past it. Returns false
+// when the machine has to stop, with the reason in m->stop.
+bool execute_instruction(machine *m, const instruction *inst) {
+    bool wide = (inst->flags & instruction_wide) != 0;
+    operand dst = inst->operands[0];
+    operand src = inst->operands[1];
+    uint16_t *r = m->registers;
+
+    uint32_t address = 0;
+    if (dst.kind == operand_memory) {
+        address = operand_address(m, inst, dst);
+    } else if (src.kind == operand_memory) {
+        address = operand_address(m, inst, src);
+    }
+
+    switch (inst->family) {
+        case family_mov: {
+            store_operand(m, dst, address, wide, load_operand(m, inst, src, address, wide));
+            break;
+        }
+        case family_add: case family_adc: case family_sub: case family_sbb: case family_cmp:
+        case family_and: case family_or:  case family_xor: case family_test: {
+            uint16_t a = load_operand(m, inst, dst, address, wide);
+            uint16_t b = load_operand(m, inst, src, address, wide);
+            uint16_t result = alu_binary(m, inst->family, a, b, wide);
+
+            if (inst->family != family_cmp && inst->family != family_test) {
+                store_operand(m, dst, address, wide, result);
+            }
+            break;
+        }
+        case family_inc:
+        case family_dec: {
+            uint16_t a = load_operand(m, inst, dst, address, wide);
+            uint16_t result = (inst->family == family_inc) ? alu_add(m, a, 1, 0, wide, true)
+                                                           : alu_sub(m, a, 1, 0, wide, true);
+            store_operand(m, dst, address, wide, result);
+            break;
+        }
+        case family_neg: {
+            uint16_t a = load_operand(m, inst, dst, address, wide);
+            store_operand(m, dst, address, wide, alu_sub(m, 0, a, 0, wide));
+            break;
+        }
+        case family_not: {
+            store_operand(m, dst, address, wide, (uint16_t) ~load_operand(m, inst, dst, address, wide));
+            break;
+        }
+        case family_shl: case family_shr: case family_sar:
+        case family_rol: case family_ror: case family_rcl: case family_rcr: {
+            uint16_t value = load_operand(m, inst, dst, address, wide);
+            uint16_t count = (src.kind == operand_immediate) ? 1 : (r[reg_cx] & 0xFF);
+            store_operand(m, dst, address, wide, alu_shift(m, inst->family, value, count, wide));
+            break;
+        }
+        case family_mul:
+        case family_imul: {
+            uint16_t value = load_operand(m, inst, dst, address, wide);
+            bool overflow;
+            if (wide) {
+                uint32_t product = (inst->family == family_mul)
+                    ? (uint32_t) r[reg_ax] * value
+                    : (uint32_t)((int32_t)(int16_t) r[reg_ax] * (int16_t) value);
+                r[reg_ax] = (uint16_t) product;
+                r[reg_dx] = (uint16_t)(product >> 16);
+                overflow = (inst->family == family_mul) ? r[reg_dx] != 0
+                                                        : (int32_t) product != (int16_t) r[reg_ax];
+            } else {
+                uint16_t product = (inst->family == family_mul)
+                    ? (uint16_t)((r[reg_ax] & 0xFF) * (value & 0xFF))
+                    : (uint16_t)((int8_t) r[reg_ax] * (int8_t) value);
+                r[reg_ax] = product;
+                overflow = (inst->family == family_mul) ? (product >> 8) != 0
+                                                        : (int16_t) product != (int8_t) product;
+            }
+            set_flag(m, flag_carry, overflow);
+            set_flag(m, flag_overflow, overflow);
+            break;
+        }
+        case family_div:
+        case family_idiv: {
+            uint16_t divisor = load_operand(m, inst, dst, address, wide);
+            bool fault = (wide ? divisor : (divisor & 0xFF)) == 0;
+
+            if (!fault && inst->family == family_div && wide) {
+                uint32_t dividend = ((uint32_t) r[reg_dx] << 16) | r[reg_ax];
+                uint32_t quotient = dividend / divisor;
+                fault = quotient > 0xFFFF;
+                if (!fault) {
+                    r[reg_dx] = (uint16_t)(dividend % divisor);
+                    r[reg_ax] = (uint16_t) quotient;
+                }
+            } else if (!fault && inst->family == family_div) {
+                uint16_t quotient = r[reg_ax] / (divisor & 0xFF);
+                fault = quotient > 0xFF;
+                if (!fault) {
+                    r[reg_ax] = (uint16_t)(((r[reg_ax] % (divisor & 0xFF)) << 8) | quotient);
+                }
+            } else if (!fault && wide) {
+                /* in 64 bits: 0x80000000 / -1 does not fit an int32_t and would trap on the host */
+                int64_t dividend = (int32_t)(((uint32_t) r[reg_dx] << 16) | r[reg_ax]);
+                int64_t quotient = dividend / (int16_t) divisor;
+                fault = quotient > 32767 || quotient < -32768;
+                if (!fault) {
+                    r[reg_dx] = (uint16_t)(dividend % (int16_t) divisor);
+                    r[reg_ax] = (uint16_t) quotient;
+                }
+            } else if (!fault) {
+                int32_t dividend = (int16_t) r[reg_ax];
+                int32_t quotient = dividend / (int8_t) divisor;
+                fault = quotient > 127 || quotient < -128;
+                if (!fault) {
+                    r[reg_ax] = (uint16_t)((((uint8_t)(dividend % (int8_t) divisor)) << 8) | (uint8_t) quotient);
+                }
+            }
+
+            if (fault) { return interrupt(m, 0); }
+            break;
+        }
+        case family_cbw: {
+            r[reg_ax] = (uint16_t)(int16_t)(int8_t) r[reg_ax];
+            break;
+        }
+        case family_cwd: {
+            r[reg_dx] = (r[reg_ax] & 0x8000) ? 0xFFFF : 0;
+            break;
+        }
+        case family_daa:
+        case family_das: {
+            uint8_t al = (uint8_t) r[reg_ax];
+            uint8_t old_al = al;
+            bool carry = carry_flag(m);
+            bool adjust = (al & 0x0F) > 9 || auxiliary_flag(m);
+            bool high = old_al > 0x99 || carry;
+
+            if (adjust) { al = (inst->family == family_daa) ? (uint8_t)(al + 6) : (uint8_t)(al - 6); }
+            if (high)   { al = (inst->family == family_daa) ? (uint8_t)(al + 0x60) : (uint8_t)(al - 0x60); }
+
+            *byte_register(m, 0) = al;
+            set_flag(m, flag_auxiliary, adjust);
+            set_flag(m, flag_carry, high);
+            set_result_flags(m, al, false);
+            break;
+        }
+        case family_aaa:
+        case family_aas: {
+            uint8_t *al = byte_register(m, 0);
+            uint8_t *ah = byte_register(m, 4);
+            bool adjust = (*al & 0x0F) > 9 || auxiliary_flag(m);
+            if (adjust) {
+                /* AL and AH separately, so AL never carries into AH; the 80286 adds 0x106 to AX instead */
+                if (inst->family == family_aaa) {
+                    *al += 6;
+                    *ah += 1;
+                } else {
+                    *al -= 6;
+                    *ah -= 1;
+                }
+            }
+            *al &= 0x0F;
+            set_flag(m, flag_auxiliary, adjust);
+            set_flag(m, flag_carry, adjust);
+            break;
+        }
+        case family_aam: {
+            uint8_t base = (uint8_t) inst->immediate;
+            if (!base) { return interrupt(m, 0); }
+            uint8_t al = (uint8_t) r[reg_ax];
+            r[reg_ax] = (uint16_t)(((al / base) << 8) | (al % base));
+            set_result_flags(m, r[reg_ax] & 0xFF, false);
+            break;
+        }
+        case family_aad: {
+            uint8_t base = (uint8_t) inst->immediate;
+            uint8_t al = (uint8_t)((r[reg_ax] & 0xFF) + (r[reg_ax] >> 8) * base);
+            r[reg_ax] = al;
+            set_result_flags(m, al, false);
+            break;
+        }
+        case family_xchg: {
+            uint16_t a = load_operand(m, inst, dst, address, wide);
+            uint16_t b = load_operand(m, inst, src, address, wide);
+            store_operand(m, dst, address, wide, b);
+            store_operand(m, src, address, wide, a);
+            break;
+        }
+        case family_lea: {
+            store_operand(m, dst, 0, true, effective_offset(m, inst, src.index));
+            break;
+        }
+        case family_lds:
+        case family_les: {
+            store_operand(m, dst, 0, true, read_memory(m, address, true));
+            m->segments[inst->family == family_lds ? seg_ds : seg_es] =
+                read_memory(m, (address + 2) & memory_mask, true);
+            break;
+        }
+        case family_xlat: {
+            uint16_t segment = (inst->flags & instruction_segment_override)
+                ? m->segments[segment_override(inst->flags)] : m->segments[seg_ds];
+            *byte_register(m, 0) = m->memory[linear_address(segment, (uint16_t)(r[reg_bx] + (r[reg_ax] & 0xFF)))];
+            break;
+        }
+        case family_lahf: {
+            *byte_register(m, 4) = (uint8_t)((resolve_flags(m) & 0xD5) | 0x02);
+            break;
+        }
+        case family_sahf: {
+            m->flags = (uint16_t)((resolve_flags(m) & 0xFF00) | ((r[reg_ax] >> 8) & 0xD5));
+            break;
+        }
+        case family_pushf: {
+            push_word(m, resolve_flags(m));
+            break;
+        }
+        case family_popf: {
+            m->flags = pop_word(m) & 0x0FD5;
+            m->pending.operation = lazy_none;
+            break;
+        }
+        case family_push: {
+            /* the 8086 pushes SP after it has been decremented */
+            if (dst.kind == operand_register && dst.index == (0b1000 | reg_sp)) {
+                push_word(m, (uint16_t)(r[reg_sp] - 2));
+            } else {
+                push_word(m, load_operand(m, inst, dst, address, true));
+            }
+            break;
+        }
+        case family_pop: {
+            uint16_t value = pop_word(m);
+            if (dst.kind == operand_memory) {
+                address = operand_address(m, inst, dst);
+            }
+            store_operand(m, dst, address, true, value);
+            break;
+        }
+        case family_in: {
+            store_operand(m, dst, 0, wide, 0xFFFF);   /* no devices: the bus floats high */
+            break;
+        }
+        case family_out:
+        case family_nop:
+        case family_wait:
+        case family_esc:
+        case family_lock:
+        case family_rep:
+        case family_repne:
+        case family_es:
+        case family_cs:
+        case family_ss:
+        case family_ds: {
+            break;
+        }
+        case family_movsb: case family_movsw: case family_cmpsb: case family_cmpsw:
+        case family_scasb: case family_scasw: case family_lodsb: case family_lodsw:
+        case family_stosb: case family_stosw: {
+            execute_string(m, inst);
+            break;
+        }
+        case family_jo:  case family_jno: case family_jb:  case family_jnb:
+        case family_je:  case family_jne: case family_jbe: case family_ja:
+        case family_js:  case family_jns: case family_jp:  case family_jnp:
+        case family_jl:  case family_jnl: case family_jle: case family_jg: {
+            if (jump_taken(m, inst->family)) {
+                m->ip = (uint16_t)(m->ip + inst->displacement);
+            }
+            break;
+        }
+        case family_loop:
+        case family_loopz:
+        case family_loopnz: {
+            r[reg_cx] -= 1;
+            bool zero = zero_flag(m);
+            bool taken = r[reg_cx] != 0 &&
+                         (inst->family == family_loop || (inst->family == family_loopz) == zero);
+            if (taken) {
+                m->ip = (uint16_t)(m->ip + inst->displacement);
+            }
+            break;
+        }
+        case family_jcxz: {
+            if (!r[reg_cx]) {
+                m->ip = (uint16_t)(m->ip + inst->displacement);
+            }
+            break;
+        }
+        case family_jmp:
+        case family_call: {
+            bool call = (inst->family == family_call);
+            if (dst.kind == operand_far) {
+                if (call) {
+                    push_word(m, m->segments[seg_cs]);
+                    push_word(m, m->ip);
+                }
+                m->segments[seg_cs] = inst->immediate;
+                m->ip = (uint16_t) inst->displacement;
+            } else {
+                uint16_t target = (dst.kind == operand_relative)
+                    ? (uint16_t)(m->ip + inst->displacement)
+                    : load_operand(m, inst, dst, address, true);
+                if (call) { push_word(m, m->ip); }
+                m->ip = target;
+            }
+            break;
+        }
+        case family_jmp_far:
+        case family_call_far: {
+            uint16_t offset  = read_memory(m, address, true);
+            uint16_t segment = read_memory(m, (address + 2) & memory_mask, true);
+            if (inst->family == family_call_far) {
+                push_word(m, m->segments[seg_cs]);
+                push_word(m, m->ip);
+            }
+            m->segments[seg_cs] = segment;
+            m->ip = offset;
+            break;
+        }
+        case family_ret:
+        case family_retf: {
+            m->ip = pop_word(m);
+            if (inst->family == family_retf) {
+                m->segments[seg_cs] = pop_word(m);
+            }
+            if (inst->mode == imm_only) {
+                r[reg_sp] += inst->immediate;
+            }
+            break;
+        }
+        case family_int:   { return interrupt(m, (uint8_t) inst->immediate); }
+        case family_int3:  { return interrupt(m, 3); }
+        case family_into:  { return overflow_flag(m) ? interrupt(m, 4) : true; }
+        case family_iret: {
+            m->ip = pop_word(m);
+            m->segments[seg_cs] = pop_word(m);
+            m->flags = pop_word(m) & 0x0FD5;
+            m->pending.operation = lazy_none;
+            break;
+        }
+        case family_clc: { set_flag(m, flag_carry, false); break; }
+        case family_stc: { set_flag(m, flag_carry, true); break; }
+        case family_cmc: { set_flag(m, flag_carry, !carry_flag(m)); break; }
+        case family_cld: { set_flag(m, flag_direction, false); break; }
+        case family_std: { set_flag(m, flag_direction, true); break; }
+        case family_cli: { set_flag(m, flag_interrupt, false); break; }
+        case family_sti: { set_flag(m, flag_interrupt, true); break; }
+        case family_hlt: {
+            m->stop = stop_halt;
+            return false;
+        }
+        case family_unknown:
+        case family_count: {
+            m->stop = stop_unknown_opcode;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const char * register_names[8] = { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" };
+
+void write_flag_letters(text_writer *writer, uint16_t flags) {
+    for (int bit = 0; bit < 12; ++bit) {
+        if ((flags & (1 << bit)) && flag_letters[bit]) {
+            write_char(writer, flag_letters[bit]);
+        }
+    }
+}
+
+// Appends " ; ax:0x0->0x1 ip:0x0->0x3 flags:->PZ" for whatever changed, with
+// " |" instead of " ;" when the line already has a comment.
+void write_state_changes(text_writer *writer, const machine *before, const machine *after, bool continued) {
+    write_bytes(writer, continued ? " |" : " ;", 2);
+
+    for (int i = 0; i < 8; ++i) {
+        if (before->registers[i] != after->registers[i]) {
+            write_char(writer, ' ');
+            write_register_name(writer, register_names[i]);
+            write_char(writer, ':');
+            write_hex(writer, before->registers[i]);
+            write_bytes(writer, "->", 2);
+            write_hex(writer, after->registers[i]);
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (before->segments[i] != after->segments[i]) {
+            write_char(writer, ' ');
+            write_register_name(writer, segment_registers[i]);
+            write_char(writer, ':');
+            write_hex(writer, before->segments[i]);
+            write_bytes(writer, "->", 2);
+            write_hex(writer, after->segments[i]);
+        }
+    }
+
+    write_bytes(writer, " ip:", 4);
+    write_hex(writer, before->ip);
+    write_bytes(writer, "->", 2);
+    write_hex(writer, after->ip);
+
+    uint16_t before_flags = evaluate_flags(before);
+    uint16_t after_flags = evaluate_flags(after);
+    if (before_flags != after_flags) {
+        write_bytes(writer, " flags:", 7);
+        write_flag_letters(writer, before_flags);
+        write_bytes(writer, "->", 2);
+        write_flag_letters(writer, after_flags);
+    }
+
+    write_char(writer, '\n');
+}
+
+void write_register_lines(text_writer *writer, const machine *m) {
+    writer_reserve(writer, 64 * 16);
+
+    for (int i = 0; i < 8; ++i) {
+        if (m->registers[i]) {
+            write_fragment(writer, FRAGMENT(";       "));
+            write_register_name(writer, register_names[i]);
+            write_bytes(writer, ": ", 2);
+            write_hex(writer, m->registers[i]);
+            write_bytes(writer, " (", 2);
+            write_uint(writer, m->registers[i]);
+            write_bytes(writer, ")\n", 2);
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (m->segments[i]) {
+            write_fragment(writer, FRAGMENT(";       "));
+            write_register_name(writer, segment_registers[i]);
+            write_bytes(writer, ": ", 2);
+            write_hex(writer, m->segments[i]);
+            write_bytes(writer, " (", 2);
+            write_uint(writer, m->segments[i]);
+            write_bytes(writer, ")\n", 2);
+        }
+    }
+
+    write_fragment(writer, FRAGMENT(";       ip: "));
+    write_hex(writer, m->ip);
+    write_bytes(writer, " (", 2);
+    write_uint(writer, m->ip);
+    write_bytes(writer, ")\n", 2);
+
+    uint16_t flags = evaluate_flags(m);
+    if (flags) {
+        write_fragment(writer, FRAGMENT(";    flags: "));
+        write_flag_letters(writer, flags);
+        write_char(writer, '\n');
+    }
+}
+
+void write_final_registers(text_writer *writer, const machine *m) {
+    writer_reserve(writer, max_line_length);
+    write_fragment(writer, FRAGMENT("\n; Final registers:\n"));
+    write_register_lines(writer, m);
+}
+
+void write_predecode_counters(text_writer *writer, const predecode_cache *cache) {
+    writer_reserve(writer, max_line_length);
+    write_fragment(writer, FRAGMENT("; Predecode cache: "));
+    write_uint(writer, cache->hits);
+    write_fragment(writer, FRAGMENT(" hits, "));
+    write_uint(writer, cache->misses);
+    write_fragment(writer, FRAGMENT(" misses, "));
+    write_uint(writer, cache->invalidations);
+    write_fragment(writer, FRAGMENT(" invalidations\n"));
+}
+
+bool load_program(machine *m, const uint8_t *data, size_t size) {
+    *m = {};
+    if (size > memory_size) { return false; }
+
+    m->memory = (uint8_t *) calloc(memory_size, 1);
+    m->code_pages = (uint8_t *) calloc(code_page_count, 1);
+    if (!m->memory || !m->code_pages) { return false; }
+
+    memcpy(m->memory, data, size);
+    m->program_begin = 0;
+    m->program_end = (uint32_t) size;
+    return true;
+}
+
+predecode_cache *create_predecode_cache() {
+    predecode_cache *cache = (predecode_cache *) calloc(1, sizeof(predecode_cache));
+    if (cache) {
+        memset(cache->tags, 0xFF, sizeof(cache->tags));
+    }
+    return cache;
+}
+
+inline bool in_snapshot(const machine *m, const void *pointer) {
+    const uint8_t *begin = (const uint8_t *) m->snapshot;
+    return begin && (const uint8_t *) pointer >= begin && (const uint8_t *) pointer < begin + m->snapshot_size;
+}
+
+void free_machine(machine *m) {
+    if (!in_snapshot(m, m->cache)) { free(m->cache); }
+    if (m->snapshot) {
+        munmap(m->snapshot, m->snapshot_size);
+    } else {
+        free(m->memory);
+        free(m->code_pages);
+    }
+    free(m->blocks);
+    m->memory = 0;
+    m->code_pages = 0;
+    m->cache = 0;
+    m->blocks = 0;
+    m->snapshot = 0;
+}
+
+// Decodes the instruction at a linear address straight out of machine memory,
+// or copies it out of the predecode cache when the machine has one. A shared
+// cache is only trusted while both pages under the record are unwritten.
+inline bool fetch_instruction_at(machine *m, uint32_t address, instruction *inst) {
+    predecode_cache *cache = m->cache;
+    uint32_t slot = address & predecode_slot_mask;
+
+    if (cache && cache->tags[slot] == address) {
+        cache->hits += 1;
+        *inst = cache->records[slot];
+        return true;
+    }
+
+    const predecode_cache *shared = m->shared_cache;
+    if (shared && shared->tags[slot] == address) {
+        const instruction *record = &shared->records[slot];
+        uint32_t last = (address + record->length - 1) & memory_mask;
+        if (m->code_pages[address >> code_page_shift] & m->code_pages[last >> code_page_shift] & code_page_shared) {
+            *inst = *record;
+            return true;
+        }
+    }
+
+    instruction_cursor cursor = { m->memory, memory_size, address };
+    instruction_shape shape = measure_instruction(&cursor);
+
+    if (!shape.entry || shape.length > cursor_remaining(&cursor)) {
+        m->stop = stop_unknown_opcode;
+        m->stop_detail = m->memory[address];
+        return false;
+    }
+
+    decode_instruction(&shape, &cursor, inst);
+
+    if (cache) {
+        cache->misses += 1;
+        cache->tags[slot] = address;
+        cache->records[slot] = *inst;
+        m->code_pages[address >> code_page_shift] |= code_page_predecoded;
+        m->code_pages[(address + inst->length - 1) >> code_page_shift] |= code_page_predecoded;
+    }
+    return true;
+}
+
+inline bool fetch_instruction(machine *m, instruction *inst) {
+    return fetch_instruction_at(m, linear_address(m->segments[seg_cs], m->ip), inst);
+}
+
+// Profiling. Execution counts and estimated 8086 clocks are kept per linear
+// address in flat arrays. Calls, interrupts and returns are mirrored on a
+// calling context tree: every node is a function entry point under a given
+// chain of callers, and the clocks of each instruction are charged to the node
+// that is running. The run loop only does any of this when it is instantiated
+// with profiling on, so a normal run pays nothing for it.
+enum {
+    max_profile_nodes = 1 << 16,
+    profile_node_slots = 1 << 17,
+    profile_node_slot_mask = profile_node_slots - 1,
+    max_profile_depth = 256,
+    hot_report_length = 40
+};
+
+struct profile_node {
+    uint32_t parent;
+    uint32_t function;          // linear address of the entry point
+    uint64_t clocks;            // charged while this node was running
+};
+
+struct profile {
+    uint32_t *counts;           // executions per linear address
+    uint64_t *clocks;           // estimated clocks per linear address
+    profile_node *nodes;        // nodes[0] is the program entry
+    int32_t *slots;             // (parent, function) -> node, open addressing
+    uint32_t node_count;
+    uint32_t current;
+    uint32_t depth;
+    uint32_t dropped;           // calls past max_profile_depth not on the stack
+    uint32_t stack[max_profile_depth];
+    uint64_t total_clocks;
+};
+
+bool create_profile(profile *p) {
+    *p = {};
+    p->counts = (uint32_t *) calloc(memory_size, sizeof(uint32_t));
+    p->clocks = (uint64_t *) calloc(memory_size, sizeof(uint64_t));
+    p->nodes = (profile_node *) calloc(max_profile_nodes, sizeof(profile_node));
+    p->slots = (int32_t *) malloc(profile_node_slots * sizeof(int32_t));
+    if (!p->counts || !p->clocks || !p->nodes || !p->slots) { return false; }
+
+    for (int i = 0; i < profile_node_slots; ++i) {
+        p->slots[i] = -1;
+    }
+    p->node_count = 1;
+    return true;
+}
+
+void free_profile(profile *p) {
+    free(p->counts);
+    free(p->clocks);
+    free(p->nodes);
+    free(p->slots);
+    *p = {};
+}
+
+inline void profile_instruction(profile *p, uint32_t address, uint32_t clocks) {
+    p->counts[address] += 1;
+    p->clocks[address] += clocks;
+    p->nodes[p->current].clocks += clocks;
+    p->total_clocks += clocks;
+}
+
+// Enters `function` from the running node. Past the node limit the callee is
+// charged to its caller. Past the depth limit the call is only counted, so the
+// matching return leaves the stack as it was and deeper callees are charged to
+// the deepest node on it.
+void profile_call(profile *p, uint32_t function) {
+    if (p->depth == max_profile_depth) {
+        p->dropped += 1;
+        return;
+    }
+    p->stack[p->depth++] = p->current;
+
+    uint32_t slot = (p->current * 0x9E3779B1u ^ function) & profile_node_slot_mask;
+    while (p->slots[slot] != -1) {
+        profile_node *node = &p->nodes[p->slots[slot]];
+        if (node->parent == p->current && node->function == function) {
+            p->current = (uint32_t) p->slots[slot];
+            return;
+        }
+        slot = (slot + 1) & profile_node_slot_mask;
+    }
+
+    if (p->node_count == max_profile_nodes) { return; }
+    uint32_t index = p->node_count++;
+    p->nodes[index] = { p->current, function, 0 };
+    p->slots[slot] = (int32_t) index;
+    p->current = index;
+}
+
+void profile_return(profile *p) {
+    if (p->dropped) {
+        p->dropped -= 1;
+    } else if (p->depth) {
+        p->current = p->stack[--p->depth];
+    }
+}
+
+inline bool is_call(instruction_family family) {
+    switch (family) {
+        case family_call: case family_call_far: case family_int: case family_int3: case family_into:
+        case family_div:  case family_idiv:     case family_aam: {
+            return true;    /* the last three only when they raise interrupt 0 */
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+inline bool is_return(instruction_family family) {
+    return family == family_ret || family == family_retf || family == family_iret;
+}
+
+struct hot_address {
+    uint32_t address;
+    uint32_t count;
+    uint64_t clocks;
+};
+
+int compare_hot_addresses(const void *a, const void *b) {
+    const hot_address *x = (const hot_address *) a;
+    const hot_address *y = (const hot_address *) b;
+    if (x->clocks != y->clocks) { return x->clocks > y->clocks ? -1 : 1; }
+    return x->address < y->address ? -1 : x->address > y->address;
+}
+
+// The most expensive addresses, with the instruction that is there now.
+void write_hot_report(text_writer *writer, const profile *p, machine *m) {
+    size_t used = 0;
+    for (uint32_t address = 0; address < memory_size; ++address) {
+        used += p->counts[address] != 0;
+    }
+
+    hot_address *hot = (hot_address *) malloc((used ? used : 1) * sizeof(hot_address));
+    size_t count = 0;
+    for (uint32_t address = 0; address < memory_size; ++address) {
+        if (p->counts[address]) {
+            hot[count++] = { address, p->counts[address], p->clocks[address] };
+        }
+    }
+    qsort(hot, count, sizeof(hot_address), compare_hot_addresses);
+
+    char line[max_line_length];
+    int length = snprintf(line, sizeof(line), "\n; Hot instructions (%zu addresses, %llu clocks):\n",
+                          count, (unsigned long long) p->total_clocks);
+    write_text(writer, line, (size_t) length);
+    length = snprintf(line, sizeof(line), "; %12s %9s %11s  %-7s  %s\n",
+                      "clocks", "share", "executions", "address", "instruction");
+    write_text(writer, line, (size_t) length);
+
+    predecode_cache *cache = m->cache;
+    stop_reason stop = m->stop;
+    uint8_t stop_detail = m->stop_detail;
+    m->cache = 0;   /* decode what is in memory now without touching the counters */
+
+    for (size_t i = 0; i < count && i < hot_report_length; ++i) {
+        uint64_t tenths = p->total_clocks ? hot[i].clocks * 1000 / p->total_clocks : 0;
+        length = snprintf(line, sizeof(line), "; %12llu %6llu.%llu%% %11u  %05x    ",
+                          (unsigned long long) hot[i].clocks, (unsigned long long)(tenths / 10),
+                          (unsigned long long)(tenths % 10), hot[i].count, hot[i].address);
+        write_text(writer, line, (size_t) length);
+
+        instruction inst;
+        writer_reserve(writer, max_line_length);
+        if (fetch_instruction_at(m, hot[i].address, &inst)) {
+            write_instruction_text(writer, &inst);
+        } else {
+            write_fragment(writer, FRAGMENT("(unknown)"));
+        }
+        write_char(writer, '\n');
+    }
+
+    m->cache = cache;
+    m->stop = stop;
+    m->stop_detail = stop_detail;
+    free(hot);
+}
+
+// Code addresses are named the same way in profiles, folded stacks and the
+// control flow listing.
+inline void write_label(text_writer *writer, uint32_t address) {
+    write_fragment(writer, FRAGMENT("label_"));
+    char digits[12];
+    int length = snprintf(digits, sizeof(digits), "%04x", address);
+    write_bytes(writer, digits, (size_t) length);
+}
+
+// One "entry;label_0100;label_0200 <clocks>" line per node that spent any
+// clocks, in the folded format flame graph tools read.
+bool write_folded_stacks(const char *filename, const profile *p) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return false; }
+
+    static char storage[1 << 16];
+    text_writer writer = { storage, sizeof(storage), 0, fd };
+    uint32_t chain[max_profile_depth + 1];
+
+    for (uint32_t index = 0; index < p->node_count; ++index) {
+        if (!p->nodes[index].clocks) { continue; }
+
+        uint32_t depth = 0;
+        for (uint32_t node = index; node != 0; node = p->nodes[node].parent) {
+            chain[depth++] = p->nodes[node].function;
+        }
+
+        writer_reserve(&writer, 32 + depth * 16);
+        write_fragment(&writer, FRAGMENT("entry"));
+        while (depth) {
+            write_char(&writer, ';');
+            write_label(&writer, chain[--depth]);
+        }
+        write_char(&writer, ' ');
+        write_uint(&writer, p->nodes[index].clocks);
+        write_char(&writer, '\n');
+    }
+
+    bool written = writer_flush(&writer);
+    close(fd);
+    return written;
+}
+
+inline uint8_t *put_varint(uint8_t *at, uint32_t value) {
+    while (value >= 0x80) {
+        *at++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *at++ = (uint8_t) value;
+    return at;
+}
+
+inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t) value << 1) ^ (uint32_t)(value >> 31);
+}
+
+inline int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+inline void trace_state(const machine *m, uint16_t *state) {
+    memcpy(state, m->registers, sizeof(m->registers));
+    memcpy(state + 8, m->segments, sizeof(m->segments));
+    state[12] = evaluate_flags(m);
+    state[13] = m->ip;
+}
+
+void flush_trace(trace_recorder *recorder) {
+    if (!write_all(recorder->fd, (const char *) recorder->arena, recorder->used)) {
+        recorder->failed = true;
+    }
+    recorder->flushed += recorder->used;
+    recorder->used = 0;
+}
+
+// Makes room for `size` more bytes in the arena. Only a single step that writes
+// more memory than the arena holds (a long REP string) makes it grow.
+uint8_t *reserve_trace(trace_recorder *recorder, size_t size) {
+    if (recorder->capacity - recorder->used < size) {
+        flush_trace(recorder);
+    }
+    if (recorder->capacity < size) {
+        grow_array(&recorder->arena, &recorder->capacity, size, "the trace arena");
+    }
+    return recorder->arena + recorder->used;
+}
+
+// Full state after m->steps steps: the registers and every page written so far.
+void record_checkpoint(trace_recorder *recorder, const machine *m) {
+    uint32_t page_count = 0;
+    for (uint32_t page = 0; page < code_page_count; ++page) {
+        page_count += recorder->written_pages[page];
+    }
+
+    grow_array(&recorder->checkpoints, &recorder->checkpoint_capacity, recorder->checkpoint_count + 1, "trace checkpoints");
+    uint8_t *at = reserve_trace(recorder, 8 + sizeof(uint64_t) + sizeof(recorder->last) + 4 +
+                                          page_count * (2 + code_page_size));
+    recorder->checkpoints[recorder->checkpoint_count++] = { m->steps, recorder->flushed + recorder->used };
+
+    trace_state(m, recorder->last);
+    at = put_varint(at, trace_checkpoint_marker);
+    memcpy(at, &m->steps, sizeof(uint64_t));
+    at += sizeof(uint64_t);
+    memcpy(at, recorder->last, sizeof(recorder->last));
+    at += sizeof(recorder->last);
+    memcpy(at, &page_count, 4);
+    at += 4;
+
+    for (uint32_t page = 0; page < code_page_count; ++page) {
+        if (!recorder->written_pages[page]) { continue; }
+        uint16_t index = (uint16_t) page;
+        memcpy(at, &index, 2);
+        memcpy(at + 2, m->memory + (page << code_page_shift), code_page_size);
+        at += 2 + code_page_size;
+    }
+
+    recorder->used = (size_t)(at - recorder->arena);
+    recorder->last_address = 0;
+    recorder->next_checkpoint = m->steps + recorder->checkpoint_interval;
+}
+
+// Creates the trace file and writes the header and the program image. Call
+// right after load_program or restore_snapshot, before the first step.
+trace_recorder *create_trace_recorder(const char *path, const machine *m, uint64_t checkpoint_interval) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return 0; }
+
+    trace_recorder *recorder = (trace_recorder *) calloc(1, sizeof(trace_recorder));
+    uint8_t *arena = (uint8_t *) malloc(trace_arena_size);
+    if (!recorder || !arena) {
+        free(recorder);
+        free(arena);
+        close(fd);
+        return 0;
+    }
+
+    recorder->fd = fd;
+    recorder->arena = arena;
+    recorder->capacity = trace_arena_size;
+    recorder->checkpoint_interval = checkpoint_interval ? checkpoint_interval : (uint64_t) default_checkpoint_interval;
+    trace_state(m, recorder->last);
+
+    trace_header header = {};
+    memcpy(header.magic, trace_magic, sizeof(header.magic));
+    header.version = trace_format_version;
+    header.image_size = m->program_end;
+    header.checkpoint_interval = recorder->checkpoint_interval;
+
+    memcpy(reserve_trace(recorder, sizeof(header)), &header, sizeof(header));
+    recorder->used += sizeof(header);
+    flush_trace(recorder);
+    if (!write_all(fd, (const char *) m->memory, m->program_end)) {
+        recorder->failed = true;
+    }
+    recorder->flushed += m->program_end;
+
+    /* a machine restored from a snapshot may already have data past the image */
+    for (uint32_t page = m->program_end >> code_page_shift; page < code_page_count; ++page) {
+        const uint8_t *bytes = m->memory + (page << code_page_shift);
+        for (uint32_t i = 0; i < code_page_size && !recorder->written_pages[page]; ++i) {
+            recorder->written_pages[page] = bytes[i] != 0;
+        }
+    }
+
+    record_checkpoint(recorder, m);
+    return recorder;
+}
+
+// One record for the step just executed.
+inline void record_step(trace_recorder *recorder, const machine *m) {
+    uint16_t state[trace_state_count];
+    trace_state(m, state);
+
+    uint8_t *at = reserve_trace(recorder, 5 * (trace_state_count + 2) + recorder->write_count * 6);
+    uint32_t changed = 0;
+    for (uint32_t i = 0; i < trace_state_count - 1; ++i) {
+        changed |= (uint32_t)(state[i] != recorder->last[i]) << i;
+    }
+
+    at = put_varint(at, changed | (recorder->write_count ? (uint32_t) trace_changed_memory : 0u));
+    at = put_varint(at, zigzag((int16_t)(state[13] - recorder->last[13])));
+    for (uint32_t bits = changed; bits; bits &= bits - 1) {
+        int i = __builtin_ctz(bits);
+        at = put_varint(at, zigzag((int16_t)(state[i] - recorder->last[i])));
+    }
+
+    if (recorder->write_count) {
+        at = put_varint(at, (uint32_t) recorder->write_count);
+        for (size_t i = 0; i < recorder->write_count; ++i) {
+            trace_memory_write write = recorder->writes[i];
+            at = put_varint(at, zigzag((int32_t)(write.address - recorder->last_address)));
+            *at++ = write.value;
+            recorder->last_address = write.address;
+        }
+        recorder->write_count = 0;
+    }
+
+    recorder->used = (size_t)(at - recorder->arena);
+    memcpy(recorder->last, state, sizeof(state));
+}
+
+// Writes what is left in the arena, the checkpoint index and the footer.
+// Returns false when any part of the trace could not be written.
+bool finish_trace_recorder(trace_recorder *recorder, const machine *m) {
+    flush_trace(recorder);
+
+    trace_footer footer = {};
+    footer.index_offset = recorder->flushed;
+    footer.checkpoint_count = recorder->checkpoint_count;
+    footer.step_count = m->steps;
+    memcpy(footer.magic, trace_magic, sizeof(footer.magic));
+
+    bool written = !recorder->failed &&
+                   write_all(recorder->fd, (const char *) recorder->checkpoints,
+                             recorder->checkpoint_count * sizeof(trace_checkpoint_entry)) &&
+                   write_all(recorder->fd, (const char *) &footer, sizeof(footer));
+    written = (close(recorder->fd) == 0) && written;
+
+    free(recorder->arena);
+    free(recorder->writes);
+    free(recorder->checkpoints);
+    free(recorder);
+    return written;
+}
+
+// Replays a recorded trace. The machine only holds registers and memory: steps
+// are applied from the records, never executed.
+struct trace_replay {
+    const uint8_t *data;
+    size_t size;
+    void *mapping;
+    uint32_t image_size;
+    uint64_t checkpoint_count;
+    uint64_t step_count;
+    uint64_t index_offset;
+    uint64_t position;      // of the next record once positioned
+    machine m;
+};
+
+void close_trace(trace_replay *replay) {
+    if (replay->mapping) { munmap(replay->mapping, replay->size); }
+    free_machine(&replay->m);
+    *replay = {};
+}
+
+bool open_trace(const char *path, trace_replay *replay) {
+    *replay = {};
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) { close(fd); }
+        fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", path);
+        return false;
+    }
+    if ((size_t) info.st_size >= sizeof(trace_header) + sizeof(trace_footer)) {
+        void *mapping = mmap(0, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            replay->mapping = mapping;
+            replay->data = (const uint8_t *) mapping;
+            replay->size = (size_t) info.st_size;
+        }
+    }
+    close(fd);
+
+    trace_header header;
+    trace_footer footer;
+    bool valid = replay->data != 0;
+    if (valid) {
+        memcpy(&header, replay->data, sizeof(header));
+        memcpy(&footer, replay->data + replay->size - sizeof(footer), sizeof(footer));
+        valid = memcmp(header.magic, trace_magic, sizeof(header.magic)) == 0 &&
+                memcmp(footer.magic, trace_magic, sizeof(footer.magic)) == 0;
+    }
+    if (!valid) {
+        fprintf(stderr, "[ERROR] %s is not a complete trace\n", path);
+        close_trace(replay);
+        return false;
+    }
+    if (header.version != trace_format_version) {
+        fprintf(stderr, "[ERROR] %s has trace format version %u, expected %u\n",
+                path, header.version, (unsigned) trace_format_version);
+        close_trace(replay);
+        return false;
+    }
+
+    uint64_t records = sizeof(header) + (uint64_t) header.image_size;
+    uint64_t index_end = replay->size - sizeof(footer);
+    valid = header.image_size <= memory_size && records <= footer.index_offset && footer.index_offset <= index_end &&
+            footer.checkpoint_count == (index_end - footer.index_offset) / sizeof(trace_checkpoint_entry) &&
+            footer.checkpoint_count > 0;
+    if (!valid || !load_program(&replay->m, replay->data + sizeof(header), header.image_size)) {
+        fprintf(stderr, "[ERROR] %s has a damaged checkpoint index\n", path);
+        close_trace(replay);
+        return false;
+    }
+
+    replay->image_size = header.image_size;
+    replay->checkpoint_count = footer.checkpoint_count;
+    replay->step_count = footer.step_count;
+    replay->index_offset = footer.index_offset;
+    return true;
+}
+
+inline bool get_varint(const trace_replay *replay, uint64_t *position, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*position >= replay->index_offset) { return false; }
+        uint8_t byte = replay->data[(*position)++];
+        *value |= (uint32_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) { return true; }
+    }
+    return false;
+}
+
+inline void apply_trace_state(machine *m, const uint16_t *state) {
+    memcpy(m->registers, state, sizeof(m->registers));
+    memcpy(m->segments, state + 8, sizeof(m->segments));
+    m->flags = state[12];
+    m->pending.operation = lazy_none;
+    m->ip = state[13];
+}
+
+// Applies the record at replay->position. Returns false on a damaged record.
+bool apply_trace_record(trace_replay *replay, uint32_t *last_address) {
+    machine *m = &replay->m;
+    uint64_t at = replay->position;
+    uint32_t mask;
+    if (!get_varint(replay, &at, &mask)) { return false; }
+
+    if (mask == trace_checkpoint_marker) {
+        uint16_t state[trace_state_count];
+        uint32_t page_count;
+        if (replay->index_offset - at < sizeof(uint64_t) + sizeof(state) + 4) { return false; }
+        memcpy(&m->steps, replay->data + at, sizeof(uint64_t));
+        memcpy(state, replay->data + at + sizeof(uint64_t), sizeof(state));
+        memcpy(&page_count, replay->data + at + sizeof(uint64_t) + sizeof(state), 4);
+        at += sizeof(uint64_t) + sizeof(state) + 4;
+
+        if (page_count > code_page_count || (replay->index_offset - at) / (2 + code_page_size) < page_count) {
+            return false;
+        }
+        memset(m->memory, 0, memory_size);
+        memcpy(m->memory, replay->data + sizeof(trace_header), replay->image_size);
+        for (uint32_t i = 0; i < page_count; ++i, at += 2 + code_page_size) {
+            uint16_t page;
+            memcpy(&page, replay->data + at, 2);
+            if (page >= code_page_count) { return false; }
+            memcpy(m->memory + ((uint32_t) page << code_page_shift), replay->data + at + 2, code_page_size);
+        }
+
+        apply_trace_state(m, state);
+        *last_address = 0;
+        replay->position = at;
+        return true;
+    }
+
+    uint32_t value;
+    uint16_t *fields[trace_state_count - 1];
+    for (int i = 0; i < 8; ++i) { fields[i] = &m->registers[i]; }
+    for (int i = 0; i < 4; ++i) { fields[8 + i] = &m->segments[i]; }
+    fields[12] = &m->flags;
+
+    if (!get_varint(replay, &at, &value)) { return false; }
+    m->ip = (uint16_t)(m->ip + unzigzag(value));
+    for (uint32_t i = 0; i < trace_state_count - 1; ++i) {
+        if (!(mask & (1u << i))) { continue; }
+        if (!get_varint(replay, &at, &value)) { return false; }
+        *fields[i] = (uint16_t)(*fields[i] + unzigzag(value));
+    }
+
+    if (mask & trace_changed_memory) {
+        uint32_t count;
+        if (!get_varint(replay, &at, &count)) { return false; }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (!get_varint(replay, &at, &value) || at >= replay->index_offset) { return false; }
+            *last_address = (uint32_t)(*last_address + unzigzag(value));
+            m->memory[*last_address & memory_mask] = replay->data[at++];
+        }
+    }
+
+    m->steps += 1;
+    replay->position = at;
+    return true;
+}
+
+// Puts the machine in the state after `step` steps: restores the last
+// checkpoint at or before it and applies the records from there.
+bool seek_trace(trace_replay *replay, uint64_t step) {
+    if (step > replay->step_count) { return false; }
+
+    uint64_t low = 0;
+    uint64_t high = replay->checkpoint_count;
+    while (high - low > 1) {
+        uint64_t middle = (low + high) / 2;
+        trace_checkpoint_entry entry;
+        memcpy(&entry, replay->data + replay->index_offset + middle * sizeof(entry), sizeof(entry));
+        if (entry.steps <= step) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+
+    trace_checkpoint_entry entry;
+    memcpy(&entry, replay->data + replay->index_offset + low * sizeof(entry), sizeof(entry));
+    if (entry.steps > step || entry.offset >= replay->index_offset) { return false; }
+
+    uint32_t last_address = 0;
+    replay->position = entry.offset;
+    if (!apply_trace_record(replay, &last_address)) { return false; }
+    while (replay->m.steps < step) {
+        if (!apply_trace_record(replay, &last_address)) { return false; }
+    }
+    return true;
+}
+
+// With `clocks`, the estimated clocks of every executed instruction are added
+// up, using the real jump outcomes, REP counts and shift counts.
+template <bool trace, bool profiled = false>
+void run_machine(machine *m, uint64_t max_steps, text_writer *out, clock_totals *clocks = 0,
+                 profile *prof = 0) {
+    m->stop = stop_running;
+
+    while (m->stop == stop_running) {
+        uint32_t address = linear_address(m->segments[seg_cs], m->ip);
+        if (address < m->program_begin || address >= m->program_end) {
+            m->stop = stop_end_of_program;
+            break;
+        }
+        if (max_steps && m->steps >= max_steps) {
+            m->stop = stop_step_limit;
+            break;
+        }
+
+        instruction inst;
+        if (!fetch_instruction(m, &inst)) { break; }
+
+        trace_recorder *recorder = m->recorder;
+        if (recorder && m->steps >= recorder->next_checkpoint) {
+            record_checkpoint(recorder, m);
+        }
+
+        machine before;
+        if (trace) { before = *m; }
+
+        uint16_t cs = m->segments[seg_cs];
+        uint16_t count = 1;
+        if (inst.flags & (instruction_rep | instruction_repne)) {
+            count = m->registers[reg_cx];
+        } else if (inst.mode == rm_by_cl) {
+            count = m->registers[reg_cx] & 0xFF;
+        }
+
+        m->ip = (uint16_t)(m->ip + inst.length);
+        m->steps += 1;
+        uint16_t next_ip = m->ip;
+        bool keep_going = execute_instruction(m, &inst);
+
+        instruction_clocks estimate = {};
+        if (clocks || profiled) {
+            bool taken = (m->ip != next_ip || m->segments[seg_cs] != cs);
+            estimate = estimate_clocks(&inst, taken, count);
+            if (clocks) { add_clocks(clocks, estimate); }
+
+            if (profiled) {
+                profile_instruction(prof, linear_address(cs, (uint16_t)(next_ip - inst.length)), clocks_8086(estimate));
+                if (taken && is_call(inst.family)) {
+                    profile_call(prof, linear_address(m->segments[seg_cs], m->ip));
+                } else if (is_return(inst.family)) {
+                    profile_return(prof);
+                }
+            }
+        }
+
+        if (trace) {
+            writer_reserve(out, max_line_length * 6);
+            write_instruction_text(out, &inst);
+            if (clocks) { write_clocks(out, estimate, clocks); }
+            write_state_changes(out, &before, m, clocks != 0);
+        }
+
+        if (recorder) {
+            record_step(recorder, m);
+        }
+
+        if (!keep_going) { break; }
+    }
+}
+
+// --check-flags: runs the program on two machines in lockstep, one with lazy
+// and one with eager flags, and stops at the first instruction after which the
+// registers or the flags they report differ. Returns false on a mismatch.
+bool check_lazy_flags(machine *lazy, machine *eager, uint64_t max_steps) {
+    lazy->stop = stop_running;
+    eager->stop = stop_running;
+
+    while (lazy->stop == stop_running) {
+        uint32_t address = linear_address(lazy->segments[seg_cs], lazy->ip);
+        if (address < lazy->program_begin || address >= lazy->program_end) {
+            lazy->stop = stop_end_of_program;
+            break;
+        }
+        if (max_steps && lazy->steps >= max_steps) {
+            lazy->stop = stop_step_limit;
+            break;
+        }
+
+        instruction inst;
+        if (!fetch_instruction(lazy, &inst)) { break; }
+        uint16_t cs = lazy->segments[seg_cs];
+        uint16_t ip = lazy->ip;
+
+        lazy->ip = (uint16_t)(lazy->ip + inst.length);
+        lazy->steps += 1;
+        eager->ip = (uint16_t)(eager->ip + inst.length);
+        eager->steps += 1;
+        bool keep_going = execute_instruction(lazy, &inst);
+        execute_instruction(eager, &inst);
+
+        uint16_t lazy_flags = evaluate_flags(lazy);
+        if (lazy_flags != eager->flags || lazy->ip != eager->ip ||
+            memcmp(lazy->registers, eager->registers, sizeof(lazy->registers)) != 0 ||
+            memcmp(lazy->segments, eager->segments, sizeof(lazy->segments)) != 0) {
+            char storage[max_line_length * 2];
+            text_writer message = { storage, sizeof(storage), 0, STDERR_FILENO };
+            write_fragment(&message, FRAGMENT("[ERROR] Lazy and eager flags disagree after "));
+            write_instruction_text(&message, &inst);
+            write_fragment(&message, FRAGMENT(" at "));
+            write_hex(&message, cs);
+            write_char(&message, ':');
+            write_hex(&message, ip);
+            write_fragment(&message, FRAGMENT(": lazy "));
+            write_flag_letters(&message, lazy_flags);
+            write_fragment(&message, FRAGMENT(", eager "));
+            write_flag_letters(&message, eager->flags);
+            write_char(&message, '\n');
+            writer_flush(&message);
+            return false;
+        }
+
+        if (!keep_going) { break; }
+    }
+
+    return true;
+}
+
+// Tail call into the next op of the block. Blocks are at most max_block_ops
+// long, so even without the tail call the stack stays shallow.
+#if defined(__clang__)
+#define NEXT_OP(m, op) [[clang::musttail]] return (op)[1].handler(m, (op) + 1)
+#else
+#define NEXT_OP(m, op) return (op)[1].handler(m, (op) + 1)
+#endif
+
+inline uint16_t *word_at(machine *m, uint8_t offset) {
+    return (uint16_t *)((uint8_t *) m->registers + offset);
+}
+
+inline uint8_t *byte_at(machine *m, uint8_t offset) {
+    return (uint8_t *) m->registers + offset;
+}
+
+void block_exit(machine *, const block_op *) {
+}
+
+// Anything without a specialised handler goes through execute_instruction.
+// The block is left early if the instruction stopped the machine, transferred
+// control (an interrupt out of DIV, say) or wrote over translated code.
+void op_execute(machine *m, const block_op *op) {
+    uint32_t generation = m->blocks->generation;
+    uint16_t cs = m->segments[seg_cs];
+
+    m->ip = op->next_ip;
+    m->steps += 1;
+    if (!execute_instruction(m, &op->inst)) { return; }
+    if (m->ip != op->next_ip || m->segments[seg_cs] != cs) { return; }
+    if (m->blocks->generation != generation) { return; }
+
+    NEXT_OP(m, op);
+}
+
+template <bool wide>
+void op_mov_reg_imm(machine *m, const block_op *op) {
+    if (wide) {
+        *word_at(m, op->destination) = op->inst.immediate;
+    } else {
+        *byte_at(m, op->destination) = (uint8_t) op->inst.immediate;
+    }
+    m->ip = op->next_ip;
+    m->steps += 1;
+    NEXT_OP(m, op);
+}
+
+template <bool wide>
+void op_mov_reg_reg(machine *m, const block_op *op) {
+    if (wide) {
+        *word_at(m, op->destination) = *word_at(m, op->source);
+    } else {
+        *byte_at(m, op->destination) = *byte_at(m, op->source);
+    }
+    m->ip = op->next_ip;
+    m->steps += 1;
+    NEXT_OP(m, op);
+}
+
+template <instruction_family family, bool wide, bool immediate>
+void op_alu_reg(machine *m, const block_op *op) {
+    uint16_t a = wide ? *word_at(m, op->destination) : *byte_at(m, op->destination);
+    uint16_t b = immediate ? op->inst.immediate
+               : wide ? *word_at(m, op->source) : *byte_at(m, op->source);
+    if (!wide) { b &= 0xFF; }
+
+    uint16_t result = alu_binary(m, family, a, b, wide);
+    if (family != family_cmp && family != family_test) {
+        if (wide) {
+            *word_at(m, op->destination) = result;
+        } else {
+            *byte_at(m, op->destination) = (uint8_t) result;
+        }
+    }
+    m->ip = op->next_ip;
+    m->steps += 1;
+    NEXT_OP(m, op);
+}
+
+template <instruction_family family>
+void op_step_reg16(machine *m, const block_op *op) {
+    uint16_t *reg = word_at(m, op->destination);
+    *reg = (family == family_inc) ? alu_add(m, *reg, 1, 0, true, true)
+                                  : alu_sub(m, *reg, 1, 0, true, true);
+    m->ip = op->next_ip;
+    m->steps += 1;
+    NEXT_OP(m, op);
+}
+
+// Conditional jumps and loops only ever end a block, so they return instead of
+// calling on into block_exit.
+template <instruction_family family>
+void op_jump(machine *m, const block_op *op) {
+    bool taken;
+    if (family == family_loop || family == family_loopz || family == family_loopnz) {
+        m->registers[reg_cx] -= 1;
+        bool zero = zero_flag(m);
+        taken = m->registers[reg_cx] != 0 &&
+                (family == family_loop || (family == family_loopz) == zero);
+    } else if (family == family_jcxz) {
+        taken = m->registers[reg_cx] == 0;
+    } else if (family == family_jmp) {
+        taken = true;
+    } else {
+        taken = jump_taken(m, family);
+    }
+
+    m->ip = taken ? (uint16_t)(op->next_ip + op->inst.displacement) : op->next_ip;
+    m->steps += 1;
+}
+
+inline uint8_t register_offset(operand op) {
+    uint8_t reg = op.index & 0b00000111;
+    if (op.index >> 3) { return (uint8_t)(reg * 2); }
+    return (uint8_t)((reg & 0b011) * 2 + (reg >> 2));
+}
+
+template <bool wide, bool immediate>
+block_handler alu_handler(instruction_family family) {
+    switch (family) {
+        case family_add:  { return op_alu_reg<family_add, wide, immediate>; }
+        case family_adc:  { return op_alu_reg<family_adc, wide, immediate>; }
+        case family_sub:  { return op_alu_reg<family_sub, wide, immediate>; }
+        case family_sbb:  { return op_alu_reg<family_sbb, wide, immediate>; }
+        case family_cmp:  { return op_alu_reg<family_cmp, wide, immediate>; }
+        case family_and:  { return op_alu_reg<family_and, wide, immediate>; }
+        case family_or:   { return op_alu_reg<family_or, wide, immediate>; }
+        case family_xor:  { return op_alu_reg<family_xor, wide, immediate>; }
+        case family_test: { return op_alu_reg<family_test, wide, immediate>; }
+        default:          { return 0; }
+    }
+}
+
+block_handler jump_handler(const instruction *inst) {
+    if (inst->operands[0].kind != operand_relative) { return 0; }
+
+    switch (inst->family) {
+        case family_jo:     { return op_jump<family_jo>; }
+        case family_jno:    { return op_jump<family_jno>; }
+        case family_jb:     { return op_jump<family_jb>; }
+        case family_jnb:    { return op_jump<family_jnb>; }
+        case family_je:     { return op_jump<family_je>; }
+        case family_jne:    { return op_jump<family_jne>; }
+        case family_jbe:    { return op_jump<family_jbe>; }
+        case family_ja:     { return op_jump<family_ja>; }
+        case family_js:     { return op_jump<family_js>; }
+        case family_jns:    { return op_jump<family_jns>; }
+        case family_jp:     { return op_jump<family_jp>; }
+        case family_jnp:    { return op_jump<family_jnp>; }
+        case family_jl:     { return op_jump<family_jl>; }
+        case family_jnl:    { return op_jump<family_jnl>; }
+        case family_jle:    { return op_jump<family_jle>; }
+        case family_jg:     { return op_jump<family_jg>; }
+        case family_loop:   { return op_jump<family_loop>; }
+        case family_loopz:  { return op_jump<family_loopz>; }
+        case family_loopnz: { return op_jump<family_loopnz>; }
+        case family_jcxz:   { return op_jump<family_jcxz>; }
+        case family_jmp:    { return op_jump<family_jmp>; }
+        default:            { return 0; }
+    }
+}
+
+// Picks the handler for an op and resolves its register operands.
+void select_handler(block_op *op) {
+    const instruction *inst = &op->inst;
+    operand dst = inst->operands[0];
+    operand src = inst->operands[1];
+    bool wide = (inst->flags & instruction_wide) != 0;
+    block_handler handler = 0;
+
+    if (dst.kind == operand_register) {
+        op->destination = register_offset(dst);
+    }
+    if (src.kind == operand_register) {
+        op->source = register_offset(src);
+    }
+
+    if (inst->family == family_mov && dst.kind == operand_register) {
+        if (src.kind == operand_immediate) {
+            handler = wide ? op_mov_reg_imm<true> : op_mov_reg_imm<false>;
+        } else if (src.kind == operand_register) {
+            handler = wide ? op_mov_reg_reg<true> : op_mov_reg_reg<false>;
+        }
+    } else if (dst.kind == operand_register && src.kind == operand_register) {
+        handler = wide ? alu_handler<true, false>(inst->family) : alu_handler<false, false>(inst->family);
+    } else if (dst.kind == operand_register && src.kind == operand_immediate) {
+        handler = wide ? alu_handler<true, true>(inst->family) : alu_handler<false, true>(inst->family);
+    } else if (dst.kind == operand_register && src.kind == operand_none && wide) {
+        if (inst->family == family_inc) { handler = op_step_reg16<family_inc>; }
+        if (inst->family == family_dec) { handler = op_step_reg16<family_dec>; }
+    } else {
+        handler = jump_handler(inst);
+    }
+
+    op->handler = handler ? handler : op_execute;
+}
+
+inline bool ends_block(const instruction *inst) {
+    switch (inst->family) {
+        case family_jo:  case family_jno: case family_jb:  case family_jnb:
+        case family_je:  case family_jne: case family_jbe: case family_ja:
+        case family_js:  case family_jns: case family_jp:  case family_jnp:
+        case family_jl:  case family_jnl: case family_jle: case family_jg:
+        case family_loop: case family_loopz: case family_loopnz: case family_jcxz:
+        case family_jmp: case family_call: case family_jmp_far: case family_call_far:
+        case family_ret: case family_retf: case family_iret:
+        case family_int: case family_int3: case family_into: case family_hlt: {
+            return true;
+        }
+        default: {
+            /* writing CS moves execution somewhere else too */
+            return (inst->operands[0].kind == operand_segment && inst->operands[0].index == seg_cs);
+        }
+    }
+}
+
+block_cache *create_block_cache() {
+    block_cache *blocks = (block_cache *) calloc(1, sizeof(block_cache));
+    if (blocks) {
+        for (int i = 0; i < block_slots; ++i) {
+            blocks->slots[i] = no_block;
+        }
+    }
+    return blocks;
+}
+
+inline uint32_t block_key(const machine *m) {
+    return ((uint32_t) m->segments[seg_cs] << 16) | m->ip;
+}
+
+inline uint32_t block_slot(uint32_t key) {
+    return linear_address((uint16_t)(key >> 16), (uint16_t) key) & block_slot_mask;
+}
+
+// Translates the block starting at CS:IP. Returns its index, or no_block when
+// the first instruction cannot be decoded (m->stop says why).
+int32_t translate_block(machine *m) {
+    block_cache *blocks = m->blocks;
+    if (blocks->block_count == max_blocks || blocks->op_count + max_block_ops + 1 > block_op_capacity) {
+        flush_blocks(m);
+    }
+
+    uint16_t cs = m->segments[seg_cs];
+    uint16_t ip = m->ip;
+    uint32_t first_op = blocks->op_count;
+    uint32_t count = 0;
+
+    while (count < max_block_ops) {
+        uint32_t address = linear_address(cs, ip);
+        if (address < m->program_begin || address >= m->program_end) { break; }
+
+        block_op *op = &blocks->ops[first_op + count];
+        *op = {};
+        if (!fetch_instruction_at(m, address, &op->inst)) {
+            if (count) { m->stop = stop_running; }
+            break;
+        }
+
+        m->code_pages[address >> code_page_shift] |= code_page_translated;
+        m->code_pages[(address + op->inst.length - 1) >> code_page_shift] |= code_page_translated;
+
+        ip = (uint16_t)(ip + op->inst.length);
+        op->next_ip = ip;
+        select_handler(op);
+        count += 1;
+
+        if (ends_block(&op->inst)) { break; }
+    }
+
+    if (!count) { return no_block; }
+
+    blocks->ops[first_op + count] = {};
+    blocks->ops[first_op + count].handler = block_exit;
+    blocks->op_count += count + 1;
+
+    int32_t index = (int32_t) blocks->block_count++;
+    translated_block *block = &blocks->blocks[index];
+    block->key = block_key(m);
+    block->first_op = first_op;
+    block->op_count = count;
+    block->successor_keys[0] = block->successor_keys[1] = 0xFFFFFFFF;
+    block->successors[0] = block->successors[1] = no_block;
+
+    blocks->slots[block_slot(block->key)] = index;
+    blocks->translated += 1;
+    return index;
+}
+
+void run_blocks(machine *m, uint64_t max_steps) {
+    block_cache *blocks = m->blocks;
+    int32_t previous = no_block;
+    m->stop = stop_running;
+
+    while (m->stop == stop_running) {
+        uint32_t address = linear_address(m->segments[seg_cs], m->ip);
+        if (address < m->program_begin || address >= m->program_end) {
+            m->stop = stop_end_of_program;
+            break;
+        }
+
+        uint32_t key = block_key(m);
+        int32_t index = no_block;
+
+        if (previous != no_block) {
+            translated_block *from = &blocks->blocks[previous];
+            if (from->successor_keys[0] == key) {
+                index = from->successors[0];
+            } else if (from->successor_keys[1] == key) {
+                index = from->successors[1];
+            }
+            if (index != no_block) { blocks->chained += 1; }
+        }
+
+        if (index == no_block) {
+            uint32_t generation = blocks->generation;
+            int32_t slot = blocks->slots[block_slot(key)];
+            index = (slot != no_block && blocks->blocks[slot].key == key) ? slot : translate_block(m);
+            if (index == no_block) { break; }
+
+            if (previous != no_block && blocks->generation == generation) {
+                translated_block *from = &blocks->blocks[previous];
+                int which = (from->successor_keys[0] == 0xFFFFFFFF) ? 0 : 1;
+                from->successor_keys[which] = key;
+                from->successors[which] = index;
+            }
+        }
+
+        translated_block *block = &blocks->blocks[index];
+        if (max_steps && max_steps - m->steps < block->op_count) {
+            /* finish the last few instructions one at a time so the limit is exact */
+            run_machine<false>(m, max_steps, 0);
+            return;
+        }
+
+        uint32_t generation = blocks->generation;
+        const block_op *op = &blocks->ops[block->first_op];
+        op->handler(m, op);
+        previous = (blocks->generation == generation) ? index : no_block;
+
+        if (max_steps && m->steps >= max_steps && m->stop == stop_running) {
+            m->stop = stop_step_limit;
+        }
+    }
+}
+
+void write_block_counters(text_writer *writer, const block_cache *blocks) {
+    writer_reserve(writer, max_line_length);
+    write_fragment(writer, FRAGMENT("; Translated blocks: "));
+    write_uint(writer, blocks->translated);
+    write_fragment(writer, FRAGMENT(" translated, "));
+    write_uint(writer, blocks->chained);
+    write_fragment(writer, FRAGMENT(" chained, "));
+    write_uint(writer, blocks->flushes);
+    write_fragment(writer, FRAGMENT(" flushes\n"));
+}
+
+void print_stop_reason(const machine *m) {
+    switch (m->stop) {
+        case stop_unknown_opcode: {
+            fprintf(stderr, "[ERROR] Unknown opcode 0x%02x at %04x:%04x\n",
+                    m->stop_detail, m->segments[seg_cs], m->ip);
+            break;
+        }
+        case stop_unhandled_interrupt: {
+            fprintf(stderr, "[ERROR] Interrupt %u has no handler at %04x:%04x\n",
+                    m->stop_detail, m->segments[seg_cs], m->ip);
+            break;
+        }
+        case stop_step_limit: {
+            fprintf(stderr, "[ERROR] Stopped after %llu instructions\n", (unsigned long long) m->steps);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+// Machine snapshots. The whole state of a machine goes into one file that is
+// laid out so it can be mapped back in place: the header with the registers
+// sits in the first page, and the 1 MiB memory image, the code page map and
+// the predecode cache each start on a page boundary after it. Restoring maps
+// the file private and writable and points the machine straight into it, so a
+// restored run only pays for the pages it touches, and the pages it writes are
+// copied on write and never reach the file; any number of runs can start from
+// the same snapshot at once. Translated blocks hold code pointers and are
+// cheap to rebuild, so they are not saved. The version changes whenever the
+// layout of the header or of a predecode_cache does.
+enum {
+    snapshot_format_version = 1,
+    snapshot_page_size = 4096
+};
+
+const char snapshot_magic[8] = { 'S', 'I', 'M', '8', '6', 'S', 'N', 'P' };
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t memory_size;           // checked against this build
+    uint32_t code_page_count;
+    uint32_t cache_size;            // sizeof(predecode_cache), or 0 when there is no cache
+    uint16_t registers[8];
+    uint16_t segments[4];
+    uint16_t ip;
+    uint16_t flags;
+    uint32_t program_begin;
+    uint32_t program_end;
+    uint32_t reserved;
+    uint64_t steps;
+    uint64_t memory_offset;
+    uint64_t code_pages_offset;
+    uint64_t cache_offset;
+    uint64_t file_size;
+};
+
+inline uint64_t align_snapshot(uint64_t offset) {
+    return (offset + snapshot_page_size - 1) & ~(uint64_t)(snapshot_page_size - 1);
+}
+
+bool write_snapshot_part(int fd, uint64_t offset, const void *data, size_t size) {
+    return lseek(fd, (off_t) offset, SEEK_SET) == (off_t) offset && write_all(fd, (const char *) data, size);
+}
+
+// Returns false when the file could not be written. Pending flags are worked
+// out first, so the snapshot has no lazy flag state.
+bool save_snapshot(const char *path, machine *m) {
+    snapshot_header header = {};
+    memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+    header.version = snapshot_format_version;
+    header.memory_size = memory_size;
+    header.code_page_count = code_page_count;
+    header.cache_size = m->cache ? sizeof(predecode_cache) : 0;
+    memcpy(header.registers, m->registers, sizeof(header.registers));
+    memcpy(header.segments, m->segments, sizeof(header.segments));
+    header.ip = m->ip;
+    header.flags = resolve_flags(m);
+    header.program_begin = m->program_begin;
+    header.program_end = m->program_end;
+    header.steps = m->steps;
+    header.memory_offset = align_snapshot(sizeof(header));
+    header.code_pages_offset = align_snapshot(header.memory_offset + memory_size);
+    header.cache_offset = m->cache ? align_snapshot(header.code_pages_offset + code_page_count) : 0;
+    header.file_size = m->cache ? header.cache_offset + sizeof(predecode_cache)
+                                : header.code_pages_offset + code_page_count;
+
+    /* without the blocks, only the predecode marks stay meaningful */
+    uint8_t pages[code_page_count];
+    for (uint32_t page = 0; page < code_page_count; ++page) {
+        pages[page] = m->cache ? (m->code_pages[page] & code_page_predecoded) : 0;
+    }
+
+    /* written beside the target and renamed over it, so a run restored from the
+       same path keeps its mapping of the old file */
+    char temporary[4096];
+    if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >= (int) sizeof(temporary)) { return false; }
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return false; }
+
+    bool written = write_snapshot_part(fd, 0, &header, sizeof(header)) &&
+                   write_snapshot_part(fd, header.memory_offset, m->memory, memory_size) &&
+                   write_snapshot_part(fd, header.code_pages_offset, pages, sizeof(pages)) &&
+                   (!m->cache || write_snapshot_part(fd, header.cache_offset, m->cache, sizeof(predecode_cache)));
+    written = close(fd) == 0 && written && rename(temporary, path) == 0;
+    if (!written) { unlink(temporary); }
+    return written;
+}
+
+// Maps a snapshot into `m`. Prints the problem and returns false when the file
+// cannot be used.
+bool restore_snapshot(const char *path, machine *m) {
+    *m = {};
+
+    int fd = open(path, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+        if (fd >= 0) { close(fd); }
+        fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", path);
+        return false;
+    }
+
+    size_t size = (size_t) info.st_size;
+    void *mapping = MAP_FAILED;
+    if (size >= sizeof(snapshot_header)) {
+        mapping = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    snapshot_header header = {};
+    if (mapping != MAP_FAILED) {
+        memcpy(&header, mapping, sizeof(header));
+    }
+    if (mapping == MAP_FAILED || memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "[ERROR] %s is not a machine snapshot\n", path);
+        if (mapping != MAP_FAILED) { munmap(mapping, size); }
+        return false;
+    }
+    if (header.version != snapshot_format_version) {
+        fprintf(stderr, "[ERROR] %s has snapshot format version %u, expected %u\n",
+                path, header.version, (unsigned) snapshot_format_version);
+        munmap(mapping, size);
+        return false;
+    }
+
+    bool valid = header.memory_size == memory_size && header.code_page_count == code_page_count &&
+                 (header.cache_size == 0 || header.cache_size == sizeof(predecode_cache)) &&
+                 header.file_size == size && header.program_begin <= header.program_end &&
+                 header.program_end <= memory_size &&
+                 header.memory_offset % snapshot_page_size == 0 && header.memory_offset <= size &&
+                 size - header.memory_offset >= memory_size &&
+                 header.code_pages_offset % snapshot_page_size == 0 && header.code_pages_offset <= size &&
+                 size - header.code_pages_offset >= code_page_count;
+    if (valid && header.cache_size) {
+        valid = header.cache_offset % snapshot_page_size == 0 && header.cache_offset <= size &&
+                size - header.cache_offset >= sizeof(predecode_cache);
+    }
+    if (!valid) {
+        fprintf(stderr, "[ERROR] %s is damaged or was saved by a different build\n", path);
+        munmap(mapping, size);
+        return false;
+    }
+
+    uint8_t *bytes = (uint8_t *) mapping;
+    memcpy(m->registers, header.registers, sizeof(m->registers));
+    memcpy(m->segments, header.segments, sizeof(m->segments));
+    m->ip = header.ip;
+    m->flags = header.flags;
+    m->program_begin = header.program_begin;
+    m->program_end = header.program_end;
+    m->steps = header.steps;
+    m->memory = bytes + header.memory_offset;
+    m->code_pages = bytes + header.code_pages_offset;
+    m->cache = header.cache_size ? (predecode_cache *)(bytes + header.cache_offset) : 0;
+    m->snapshot = mapping;
+    m->snapshot_size = size;
+    return true;
+}
+
+// Recursive traversal listing. Instead of decoding every byte in order, decoding
+// starts at the entry points and follows jumps and calls through a worklist, so
+// data between pieces of code is never taken for instructions and cannot throw
+// the decoder out of step. Which bytes are already code is kept as a sorted set
+// of intervals rather than a flag per byte, so the cost follows the amount of
+// code, not the size of the image. Once everything reachable is decoded the
+// instructions are cut into basic blocks, branch targets get labels, and the
+// bytes that were never reached are listed as data.
+struct byte_interval {
+    uint32_t begin;
+    uint32_t end;
+};
+
+struct interval_set {
+    byte_interval *items;
+    size_t count;
+    size_t capacity;
+};
+
+// Index of the first interval that ends after `offset`.
+size_t interval_after(const interval_set *set, uint32_t offset) {
+    size_t low = 0;
+    size_t high = set->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (set->items[middle].end <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+inline bool interval_overlaps(const interval_set *set, uint32_t begin, uint32_t end) {
+    size_t i = interval_after(set, begin);
+    return i < set->count && set->items[i].begin < end;
+}
+
+// Adds [begin, end), merging it with every interval it overlaps or touches.
+void interval_add(interval_set *set, uint32_t begin, uint32_t end) {
+    size_t first = interval_after(set, begin ? begin - 1 : 0);
+    size_t last = first;
+    while (last < set->count && set->items[last].begin <= end) {
+        if (set->items[last].begin < begin) { begin = set->items[last].begin; }
+        if (set->items[last].end > end)     { end = set->items[last].end; }
+        last += 1;
+    }
+
+    if (last == first) {
+        grow_array(&set->items, &set->capacity, set->count + 1, "code intervals");
+        memmove(set->items + first + 1, set->items + first, (set->count - first) * sizeof(byte_interval));
+        set->count += 1;
+    } else {
+        memmove(set->items + first + 1, set->items + last, (set->count - last) * sizeof(byte_interval));
+        set->count -= last - first - 1;
+    }
+    set->items[first] = { begin, end };
+}
+
+enum flow_target_kind : uint8_t {
+    target_entry = 1 << 0,
+    target_jump  = 1 << 1,
+    target_call  = 1 << 2
+};
+
+struct flow_target {
+    uint32_t offset;
+    uint8_t kinds;
+};
+
+enum : uint32_t {
+    no_flow_block = 0xFFFFFFFF
+};
+
+struct flow_block {
+    uint32_t first;             // index of the first instruction
+    uint32_t count;
+    uint32_t successors[2];     // fall-through and jump target, or no_flow_block
+    uint32_t callee;            // block called at the end of this one, or no_flow_block
+    uint32_t visited;           // generation of the last call graph walk that saw it
+};
+
+struct flow_graph {
+    instruction *instructions;
+    size_t count;
+    size_t capacity;
+    flow_target *targets;       // sorted by offset once the traversal is done
+    size_t target_count;
+    size_t target_capacity;
+    uint32_t *work;
+    size_t work_count;
+    size_t work_capacity;
+    flow_block *blocks;
+    size_t block_count;
+    size_t block_capacity;
+    interval_set code;
+    uint32_t conflicts;         // targets inside an instruction decoded from elsewhere
+};
+
+void free_flow_graph(flow_graph *graph) {
+    free(graph->instructions);
+    free(graph->targets);
+    free(graph->work);
+    free(graph->blocks);
+    free(graph->code.items);
+    *graph = {};
+}
+
+// Where the instruction transfers control to, when that is known without
+// running it: relative jumps and calls, and far ones into segment 0-based
+// linear addresses. May lie outside the image.
+inline bool static_branch_target(const instruction *inst, int64_t *target) {
+    operand op = inst->operands[0];
+    if (op.kind == operand_relative) {
+        *target = (int64_t) inst->offset + inst->length + inst->displacement;
+        return true;
+    }
+    if (op.kind == operand_far) {
+        *target = ((int64_t) inst->immediate << 4) + (uint16_t) inst->displacement;
+        return true;
+    }
+    return false;
+}
+
+inline bool falls_through(const instruction *inst) {
+    switch (inst->family) {
+        case family_jmp: case family_jmp_far:
+        case family_ret: case family_retf: case family_iret: case family_hlt: {
+            return false;
+        }
+        default: {
+            return true;
+        }
+    }
+}
+
+void add_flow_target(flow_graph *graph, uint32_t offset, uint8_t kind) {
+    grow_array(&graph->targets, &graph->target_capacity, graph->target_count + 1, "branch targets");
+    graph->targets[graph->target_count++] = { offset, kind };
+
+    grow_array(&graph->work, &graph->work_capacity, graph->work_count + 1, "the traversal worklist");
+    graph->work[graph->work_count++] = offset;
+}
+
+// Decodes straight-line code from `offset` until control leaves it, the bytes
+// are not an instruction, or they were already decoded from another path.
+void follow_code(flow_graph *graph, const uint8_t *data, size_t size, uint32_t offset) {
+    while (offset < size) {
+        instruction_cursor at = { data, size, offset };
+        instruction_shape shape = measure_instruction(&at);
+        bool lone_prefix = !shape.entry && opcode_lookup.entries[data[offset]].mode == prefix_byte;
+        uint32_t length = shape.entry ? shape.length : 1;
+
+        if (shape.length > size - offset || (!shape.entry && !lone_prefix) ||
+            interval_overlaps(&graph->code, offset, offset + length)) {
+            break;
+        }
+
+        grow_array(&graph->instructions, &graph->capacity, graph->count + 1, "decoded instructions");
+        instruction *inst = &graph->instructions[graph->count++];
+        if (lone_prefix) {
+            decode_lone_prefix(&at, inst);
+        } else {
+            decode_instruction(&shape, &at, inst);
+        }
+        interval_add(&graph->code, offset, offset + length);
+
+        int64_t target;
+        if (static_branch_target(inst, &target) && target >= 0 && target < (int64_t) size) {
+            bool call = inst->family == family_call || inst->family == family_call_far;
+            add_flow_target(graph, (uint32_t) target, call ? target_call : target_jump);
+        }
+
+        if (!falls_through(inst)) { break; }
+        offset += length;
+    }
+}
+
+int compare_instruction_offsets(const void *a, const void *b) {
+    uint32_t x = ((const instruction *) a)->offset;
+    uint32_t y = ((const instruction *) b)->offset;
+    return (x > y) - (x < y);
+}
+
+int compare_flow_targets(const void *a, const void *b) {
+    uint32_t x = ((const flow_target *) a)->offset;
+    uint32_t y = ((const flow_target *) b)->offset;
+    return (x > y) - (x < y);
+}
+
+// Index of the instruction that starts at `offset`, or -1.
+long find_flow_instruction(const flow_graph *graph, uint32_t offset) {
+    size_t low = 0;
+    size_t high = graph->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (graph->instructions[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return (low < graph->count && graph->instructions[low].offset == offset) ? (long) low : -1;
+}
+
+// The target record for `offset`, or null when nothing branches there.
+const flow_target *find_flow_target(const flow_graph *graph, uint32_t offset) {
+    size_t low = 0;
+    size_t high = graph->target_count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (graph->targets[middle].offset < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return (low < graph->target_count && graph->targets[low].offset == offset) ? &graph->targets[low] : 0;
+}
+
+// Block index of the block starting at instruction `index`, or no_flow_block.
+uint32_t find_flow_block(const flow_graph *graph, long index) {
+    if (index < 0) { return no_flow_block; }
+
+    size_t low = 0;
+    size_t high = graph->block_count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (graph->blocks[middle].first < (uint32_t) index) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return (low < graph->block_count && graph->blocks[low].first == (uint32_t) index) ? (uint32_t) low : no_flow_block;
+}
+
+// Runs the traversal from `entries` and builds the basic blocks.
+void build_flow_graph(flow_graph *graph, const uint8_t *data, size_t size, const uint32_t *entries, size_t entry_count) {
+    for (size_t i = 0; i < entry_count; ++i) {
+        add_flow_target(graph, entries[i], target_entry);
+    }
+    while (graph->work_count) {
+        follow_code(graph, data, size, graph->work[--graph->work_count]);
+    }
+
+    qsort(graph->instructions, graph->count, sizeof(instruction), compare_instruction_offsets);
+    qsort(graph->targets, graph->target_count, sizeof(flow_target), compare_flow_targets);
+
+    /* one record per offset, and only those that are instruction starts */
+    size_t kept = 0;
+    for (size_t i = 0; i < graph->target_count; ++i) {
+        flow_target target = graph->targets[i];
+        if (kept && graph->targets[kept - 1].offset == target.offset) {
+            graph->targets[kept - 1].kinds |= target.kinds;
+        } else if (find_flow_instruction(graph, target.offset) >= 0) {
+            graph->targets[kept++] = target;
+        } else if (i == 0 || graph->targets[i - 1].offset != target.offset) {
+            graph->conflicts += 1;
+        }
+    }
+    graph->target_count = kept;
+
+    /* a block starts at a target, after a control transfer, or after a gap */
+    for (size_t i = 0; i < graph->count; ++i) {
+        const instruction *inst = &graph->instructions[i];
+        const instruction *previous = i ? &graph->instructions[i - 1] : 0;
+        bool leader = !previous || previous->offset + previous->length != inst->offset ||
+                      ends_block(previous) || find_flow_target(graph, inst->offset);
+
+        if (leader) {
+            grow_array(&graph->blocks, &graph->block_capacity, graph->block_count + 1, "basic blocks");
+            graph->blocks[graph->block_count++] = { (uint32_t) i, 0, { no_flow_block, no_flow_block }, no_flow_block, 0 };
+        }
+        graph->blocks[graph->block_count - 1].count += 1;
+    }
+
+    for (size_t b = 0; b < graph->block_count; ++b) {
+        flow_block *block = &graph->blocks[b];
+        uint32_t last_index = block->first + block->count - 1;
+        const instruction *last = &graph->instructions[last_index];
+
+        if (falls_through(last) && last_index + 1 < graph->count &&
+            graph->instructions[last_index + 1].offset == last->offset + last->length) {
+            block->successors[0] = (uint32_t) b + 1;
+        }
+
+        int64_t target;
+        if (static_branch_target(last, &target) && target >= 0 && target <= 0xFFFFFFFF) {
+            uint32_t to = find_flow_block(graph, find_flow_instruction(graph, (uint32_t) target));
+            if (last->family == family_call || last->family == family_call_far) {
+                block->callee = to;
+            } else {
+                block->successors[1] = to;
+            }
+        }
+    }
+}
+
+// Relative branches to a decoded instruction name its label instead of "$+N".
+void write_flow_instruction(text_writer *writer, const flow_graph *graph, const instruction *inst) {
+    const uint8_t prefixes = instruction_lock | instruction_rep | instruction_repne | instruction_segment_override;
+    int64_t target;
+
+    writer_reserve(writer, max_line_length);
+    if (inst->operands[0].kind == operand_relative && !(inst->flags & prefixes) &&
+        static_branch_target(inst, &target) && target >= 0 && target <= 0xFFFFFFFF &&
+        find_flow_target(graph, (uint32_t) target)) {
+        write_fragment(writer, family_mnemonics[inst->family]);
+        write_fragment(writer, inst->mode == near_label ? FRAGMENT(" near ") : FRAGMENT(" "));
+        write_label(writer, (uint32_t) target);
+    } else {
+        write_instruction_text(writer, inst);
+    }
+    write_char(writer, '\n');
+}
+
+// Bytes no path reached, as "db" lines so the listing still assembles to the
+// original image.
+void write_data_bytes(text_writer *writer, const uint8_t *data, size_t begin, size_t end) {
+    while (begin < end) {
+        size_t count = end - begin < 16 ? end - begin : 16;
+        writer_reserve(writer, max_line_length);
+        write_bytes(writer, "db ", 3);
+        for (size_t i = 0; i < count; ++i) {
+            if (i) { write_bytes(writer, ", ", 2); }
+            write_uint(writer, data[begin + i]);
+        }
+        write_char(writer, '\n');
+        begin += count;
+    }
+}
+
+void write_flow_listing(text_writer *writer, const flow_graph *graph, const uint8_t *data, size_t size) {
+    size_t covered = 0;
+    for (size_t i = 0; i < graph->count; ++i) {
+        const instruction *inst = &graph->instructions[i];
+        write_data_bytes(writer, data, covered, inst->offset);
+
+        if (find_flow_target(graph, inst->offset)) {
+            writer_reserve(writer, max_line_length);
+            if (inst->offset) { write_char(writer, '\n'); }
+            write_label(writer, inst->offset);
+            write_bytes(writer, ":\n", 2);
+        }
+
+        write_flow_instruction(writer, graph, inst);
+        covered = inst->offset + inst->length;
+    }
+    write_data_bytes(writer, data, covered, size);
+}
+
+// Graphviz files: the control flow graph has one node per basic block with its
+// fall-through (dashed) and jump edges; the call graph has one node per function
+// (entry points and call targets) and an edge for every call reachable from the
+// function's entry without passing through another call.
+bool write_control_flow_graph(const char *filename, const flow_graph *graph) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return false; }
+
+    static char storage[1 << 16];
+    text_writer writer = { storage, sizeof(storage), 0, fd };
+
+    write_text(&writer, "digraph cfg {\n    node [shape=box fontname=monospace];\n", 55);
+    for (size_t b = 0; b < graph->block_count; ++b) {
+        const flow_block *block = &graph->blocks[b];
+        const instruction *first = &graph->instructions[block->first];
+        const instruction *last = &graph->instructions[block->first + block->count - 1];
+
+        writer_reserve(&writer, max_line_length);
+        write_bytes(&writer, "    ", 4);
+        write_label(&writer, first->offset);
+        write_fragment(&writer, FRAGMENT(" [label=\""));
+        write_label(&writer, first->offset);
+        write_fragment(&writer, FRAGMENT("\\n"));
+        write_uint(&writer, block->count);
+        write_fragment(&writer, block->count == 1 ? FRAGMENT(" instruction, ") : FRAGMENT(" instructions, "));
+        uint32_t bytes = last->offset + last->length - first->offset;
+        write_uint(&writer, bytes);
+        write_fragment(&writer, bytes == 1 ? FRAGMENT(" byte\"];\n") : FRAGMENT(" bytes\"];\n"));
+
+        for (int edge = 0; edge < 2; ++edge) {
+            if (block->successors[edge] == no_flow_block) { continue; }
+            writer_reserve(&writer, max_line_length);
+            write_bytes(&writer, "    ", 4);
+            write_label(&writer, first->offset);
+            write_fragment(&writer, FRAGMENT(" -> "));
+            write_label(&writer, graph->instructions[graph->blocks[block->successors[edge]].first].offset);
+            if (edge == 0) { write_fragment(&writer, FRAGMENT(" [style=dashed]")); }
+            write_bytes(&writer, ";\n", 2);
+        }
+    }
+    write_text(&writer, "}\n", 2);
+
+    bool written = writer_flush(&writer);
+    close(fd);
+    return written;
+}
+
+bool write_call_graph(const char *filename, flow_graph *graph) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) { return false; }
+
+    static char storage[1 << 16];
+    text_writer writer = { storage, sizeof(storage), 0, fd };
+    uint32_t *stack = (uint32_t *) malloc((graph->block_count + 1) * sizeof(uint32_t));
+    uint32_t *callees = (uint32_t *) malloc((graph->block_count + 1) * sizeof(uint32_t));
+    if (!stack || !callees) {
+        fprintf(stderr, "[ERROR] Out of memory for the call graph\n");
+        exit(1);
+    }
+
+    write_text(&writer, "digraph calls {\n    node [shape=box fontname=monospace];\n", 57);
+    uint32_t generation = 0;
+    for (size_t t = 0; t < graph->target_count; ++t) {
+        const flow_target *function = &graph->targets[t];
+        if (!(function->kinds & (target_entry | target_call))) { continue; }
+
+        writer_reserve(&writer, max_line_length);
+        write_bytes(&writer, "    ", 4);
+        write_label(&writer, function->offset);
+        write_bytes(&writer, ";\n", 2);
+
+        /* blocks reached from the entry without following calls */
+        generation += 1;
+        size_t depth = 0;
+        size_t callee_count = 0;
+        uint32_t entry = find_flow_block(graph, find_flow_instruction(graph, function->offset));
+        if (entry != no_flow_block) {
+            graph->blocks[entry].visited = generation;
+            stack[depth++] = entry;
+        }
+
+        while (depth) {
+            flow_block *block = &graph->blocks[stack[--depth]];
+            if (block->callee != no_flow_block) {
+                bool seen = false;
+                for (size_t i = 0; i < callee_count && !seen; ++i) { seen = callees[i] == block->callee; }
+                if (!seen) { callees[callee_count++] = block->callee; }
+            }
+            for (int edge = 0; edge < 2; ++edge) {
+                uint32_t next = block->successors[edge];
+                if (next != no_flow_block && graph->blocks[next].visited != generation) {
+                    graph->blocks[next].visited = generation;
+                    stack[depth++] = next;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < callee_count; ++i) {
+            writer_reserve(&writer, max_line_length);
+            write_bytes(&writer, "    ", 4);
+            write_label(&writer, function->offset);
+            write_fragment(&writer, FRAGMENT(" -> "));
+            write_label(&writer, graph->instructions[graph->blocks[callees[i]].first].offset);
+            write_bytes(&writer, ";\n", 2);
+        }
+    }
+    write_text(&writer, "}\n", 2);
+
+    free(stack);
+    free(callees);
+    bool written = writer_flush(&writer);
+    close(fd);
+    return written;
+}
+
+// Benchmarks. Synthetic instruction streams are generated from a seed: every
+// instruction starts from an opcode picked from a pool, followed by random
+// bytes, cut to the length measure_instruction gives it. Random ModRM bytes
+// cover every mod/rm form with their 8- and 16-bit displacements, and the
+// immediates are random as well. The default pool is weighted towards what
+// compiled 8086 code looks like (MOV, ALU, stack and branch opcodes); the
+// per-mode runs use a pool of just the opcodes with that decode_mode.
+enum {
+    bench_mode_bytes = 1 << 20,
+    max_bench_instruction = 16
+};
+
+struct bench_random {
+    uint64_t state;
+};
+
+// splitmix64
+inline uint64_t next_random(bench_random *random) {
+    uint64_t z = (random->state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+struct opcode_pool {
+    uint8_t opcodes[256];
+    uint32_t count;
+};
+
+inline bool decodable_opcode(uint8_t byte) {
+    const opcode_entry *entry = &opcode_lookup.entries[byte];
+    return entry->mode != prefix_byte && (entry->family != family_unknown || entry->group != group_none);
+}
+
+void pool_add_range(opcode_pool *pool, uint8_t first, uint8_t last) {
+    for (uint32_t byte = first; byte <= last; ++byte) {
+        if (decodable_opcode((uint8_t) byte)) {
+            pool->opcodes[pool->count++] = (uint8_t) byte;
+        }
+    }
+}
+
+// Appends one instruction from the pool; returns its length.
+size_t generate_instruction(bench_random *random, const opcode_pool *pool, uint8_t *out) {
+    for (;;) {
+        uint8_t candidate[max_bench_instruction];
+        uint64_t bits = next_random(random);
+        candidate[0] = pool->opcodes[bits % pool->count];
+        for (int i = 1; i < max_bench_instruction; ++i) {
+            if ((i & 7) == 1) { bits = next_random(random); }
+            candidate[i] = (uint8_t)(bits >> ((i & 7) * 8));
+        }
+
+        instruction_cursor cursor = { candidate, sizeof(candidate), 0 };
+        instruction_shape shape = measure_instruction(&cursor);
+        if (!shape.entry) { continue; }     /* a group slot with no instruction */
+
+        memcpy(out, candidate, shape.length);
+        return shape.length;
+    }
+}
+
+// The realistic mix: pools and their weights out of 100.
+void generate_mixed_stream(uint64_t seed, uint8_t *out, size_t size) {
+    opcode_pool pools[6] = {};
+    pool_add_range(&pools[0], 0x88, 0x8C);  pool_add_range(&pools[0], 0x8E, 0x8E);      // MOV
+    pool_add_range(&pools[0], 0xA0, 0xA3);  pool_add_range(&pools[0], 0xB0, 0xBF);
+    pool_add_range(&pools[0], 0xC6, 0xC7);
+    pool_add_range(&pools[1], 0x00, 0x3D);  pool_add_range(&pools[1], 0x80, 0x85);      // ALU
+    pool_add_range(&pools[2], 0x50, 0x5F);                                              // PUSH/POP
+    pool_add_range(&pools[3], 0x70, 0x7F);  pool_add_range(&pools[3], 0xC2, 0xC3);      // branches
+    pool_add_range(&pools[3], 0xE8, 0xE9);  pool_add_range(&pools[3], 0xEB, 0xEB);
+    pool_add_range(&pools[4], 0x40, 0x4F);  pool_add_range(&pools[4], 0xD0, 0xD3);      // INC/DEC, shifts
+    pool_add_range(&pools[4], 0xF6, 0xF7);  pool_add_range(&pools[4], 0xFE, 0xFF);
+    pool_add_range(&pools[5], 0x00, 0xFF);                                              // anything
+    const uint32_t weights[6] = { 35, 25, 12, 12, 8, 8 };
+
+    bench_random random = { seed };
+    size_t used = 0;
+    while (used + max_bench_instruction <= size) {
+        uint32_t pick = (uint32_t)(next_random(&random) % 100);
+        int pool = 0;
+        while (pick >= weights[pool]) { pick -= weights[pool++]; }
+        used += generate_instruction(&random, &pools[pool], out + used);
+    }
+    memset(out + used, 0x90, size - used);      /* pad with NOPs */
+}
+
+// Returns the number of bytes written, which is less than `size` when the
+// mode has no instructions.
+size_t generate_mode_stream(uint64_t seed, decode_mode mode, uint8_t *out, size_t size) {
+    opcode_pool pool = {};
+    for (uint32_t byte = 0; byte < 256; ++byte) {
+        if (decodable_opcode((uint8_t) byte) && opcode_lookup.entries[byte].mode == mode) {
+            pool.opcodes[pool.count++] = (uint8_t) byte;
+        }
+    }
+    if (!pool.count) { return 0; }
+
+    bench_random random = { seed ^ ((uint64_t) mode << 32) };
+    size_t used = 0;
+    while (used + max_bench_instruction <= size) {
+        used += generate_instruction(&random, &pool, out + used);
+    }
+    return used;
+}
+
+// Decodes the whole stream without producing text; returns the instruction count.
+size_t bench_decode(const uint8_t *data, size_t size) {
+    instruction_counter counter = {};
+    decode({ data, size }, counter);
+    return counter.instructions;
+}
+
+struct bench_timing {
+    double seconds;         // best of the repetitions
+    size_t instructions;
+};
+
+bench_timing time_decode(const uint8_t *data, size_t size, int repetitions) {
+    bench_timing timing = { 1e30, 0 };
+    for (int i = 0; i < repetitions; ++i) {
+        double start = seconds_now();
+        timing.instructions = bench_decode(data, size);
+        double elapsed = seconds_now() - start;
+        if (elapsed < timing.seconds) { timing.seconds = elapsed; }
+    }
+    return timing;
+}
+
+int run_benchmarks(uint64_t seed, size_t size, int repetitions, const char *generate_path) {
+    uint8_t *stream = (uint8_t *) malloc(size > bench_mode_bytes ? size : (size_t) bench_mode_bytes);
+    if (!stream) {
+        fprintf(stderr, "[ERROR] Out of memory for a %zu byte stream\n", size);
+        return 1;
+    }
+    generate_mixed_stream(seed, stream, size);
+
+    if (generate_path) {
+        int fd = open(generate_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = fd >= 0 && write_all(fd, (const char *) stream, size);
+        if (fd >= 0) { close(fd); }
+        if (!written) {
+            fprintf(stderr, "[ERROR] Could not write the stream to %s\n", generate_path);
+            free(stream);
+            return 1;
+        }
+    }
+
+    bench_timing decode = time_decode(stream, size, repetitions);
+
+    // Text emission alone, over instructions decoded up front.
+    size_t sample_count = decode.instructions < (1u << 20) ? decode.instructions : (1u << 20);
+    instruction *sample = (instruction *) malloc(sample_count * sizeof(instruction));
+    instruction_cursor cursor = { stream, size, 0 };
+    size_t sampled = 0;
+    while (sampled < sample_count) {
+        decode_batch_result result = decode_batch(&cursor, sample + sampled, sample_count - sampled);
+        sampled += result.count;
+        if (result.truncated || !result.count) { break; }
+    }
+
+    static char text_storage[1 << 20];
+    double emit_seconds = 1e30;
+    uint64_t emit_bytes = 0;
+    for (int i = 0; i < repetitions; ++i) {
+        text_writer text = { text_storage, sizeof(text_storage), 0, -1 };
+        uint64_t produced = 0;
+        double start = seconds_now();
+        for (size_t j = 0; j < sampled; ++j) {
+            if (text.used > text.capacity - max_line_length) {
+                produced += text.used;
+                text.used = 0;
+            }
+            write_instruction(&text, &sample[j]);
+        }
+        double elapsed = seconds_now() - start;
+        emit_bytes = produced + text.used;
+        if (elapsed < emit_seconds) { emit_seconds = elapsed; }
+    }
+    free(sample);
+
+    // The whole listing path, written to /dev/null.
+    double listing_seconds = 1e30;
+    for (int i = 0; i < repetitions; ++i) {
+        int fd = open("/dev/null", O_WRONLY);
+        text_writer out = { text_storage, sizeof(text_storage), 0, fd };
+        decode_error error = {};
+        double start = seconds_now();
+        decode_span(stream, size, &out, &error);
+        writer_flush(&out);
+        double elapsed = seconds_now() - start;
+        close(fd);
+        if (elapsed < listing_seconds) { listing_seconds = elapsed; }
+    }
+
+    printf("{\n");
+    printf("  \"seed\": %llu,\n", (unsigned long long) seed);
+    printf("  \"bytes\": %zu,\n", size);
+    printf("  \"instructions\": %zu,\n", decode.instructions);
+    printf("  \"repetitions\": %d,\n", repetitions);
+    printf("  \"decode\": { \"seconds\": %.6f, \"bytes_per_second\": %.0f, \"instructions_per_second\": %.0f },\n",
+           decode.seconds, size / decode.seconds, decode.instructions / decode.seconds);
+    printf("  \"emit\": { \"seconds\": %.6f, \"instructions\": %zu, \"output_bytes\": %llu, "
+           "\"bytes_per_second\": %.0f, \"instructions_per_second\": %.0f },\n",
+           emit_seconds, sampled, (unsigned long long) emit_bytes, emit_bytes / emit_seconds, sampled / emit_seconds);
+    printf("  \"listing\": { \"seconds\": %.6f, \"bytes_per_second\": %.0f, \"instructions_per_second\": %.0f },\n",
+           listing_seconds, size / listing_seconds, decode.instructions / listing_seconds);
+    printf("  \"modes\": [");
+
+    bool first = true;
+    for (int mode = 0; mode < decode_mode_count; ++mode) {
+        if (mode == prefix_byte) { continue; }     /* prefixes are measured with what follows them */
+
+        size_t length = generate_mode_stream(seed, (decode_mode) mode, stream, bench_mode_bytes);
+        if (!length) { continue; }
+
+        bench_timing timing = time_decode(stream, length, repetitions);
+        printf("%s\n    { \"mode\": \"%s\", \"bytes\": %zu, \"instructions\": %zu, "
+               "\"ns_per_instruction\": %.3f, \"bytes_per_second\": %.0f }",
+               first ? "" : ",", decode_mode_names[mode], length, timing.instructions,
+               timing.seconds * 1e9 / timing.instructions, length / timing.seconds);
+        first = false;
+    }
+    printf("\n  ]\n}\n");
+
+    free(stream);
+    return 0;
+}
+
+// Execution farm. One program is run as many independent instances spread
+// over a pool of threads. Every instance starts from the loaded program; when
+// memory images are given, instance i also gets image i (modulo their count)
+// copied in at the image address, and with a seed its general registers are
+// drawn from the seed and i. The program is decoded once, at every byte
+// offset, into a predecode cache that all instances read and none writes; an
+// instance only takes a record from it while both pages the record spans are
+// marked code_page_shared in its own page map, and its first store to such a
+// page clears the mark, so self-modifying code falls back to decoding its own
+// memory. Each worker owns one slot of a single arena holding the memory, page
+// map and block cache it reuses for every instance it runs. The report gives
+// each instance's step count, why it stopped and a hash of its final
+// registers, flags and memory, which does not depend on the thread count.
+enum {
+    default_farm_image_address = 0x10000
+};
+
+struct farm_setup {
+    const uint8_t *program;
+    size_t program_size;
+    const char *program_name;
+    const path_list *images;        // may be empty
+    uint32_t image_address;
+    size_t instance_count;
+    bool seeded;
+    uint64_t seed;
+    uint64_t max_steps;
+    bool interpret;                 // step one instruction at a time instead of running blocks
+    bool predecode;                 // share a predecode cache of the program
+};
+
+struct farm_result {
+    uint64_t steps;
+    uint64_t hash;
+    stop_reason stop;
+    uint8_t stop_detail;
+    uint16_t cs;
+    uint16_t ip;
+    bool loaded;                    // false when the instance's image could not be read
+};
+
+struct farm_slot {
+    uint8_t *memory;
+    uint8_t *code_pages;
+    block_cache *blocks;
+};
+
+// Decodes the program at every byte offset. Only records that end inside the
+// program are kept, so they never depend on what is loaded after it.
+predecode_cache *create_shared_predecode(const uint8_t *program, size_t size) {
+    predecode_cache *cache = create_predecode_cache();
+    if (!cache) { return 0; }
+
+    for (size_t offset = 0; offset < size; ++offset) {
+        instruction_cursor cursor = { program, size, offset };
+        instruction_shape shape = measure_instruction(&cursor);
+        if (!shape.entry || shape.length > cursor_remaining(&cursor)) { continue; }
+
+        uint32_t slot = (uint32_t) offset & predecode_slot_mask;
+        decode_instruction(&shape, &cursor, &cache->records[slot]);
+        cache->tags[slot] = (uint32_t) offset;
+    }
+    return cache;
+}
+
+inline uint64_t mix_hash(uint64_t hash, uint64_t value) {
+    hash = (hash ^ value) * 0x100000001B3ull;
+    return hash ^ (hash >> 29);
+}
+
+uint64_t hash_machine_state(machine *m) {
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int i = 0; i < 8; ++i) { hash = mix_hash(hash, m->registers[i]); }
+    for (int i = 0; i < 4; ++i) { hash = mix_hash(hash, m->segments[i]); }
+    hash = mix_hash(hash, m->ip);
+    hash = mix_hash(hash, resolve_flags(m));
+
+    /* pages of zeros are skipped, so the page number goes into the hash as well */
+    for (uint32_t page = 0; page < memory_size; page += snapshot_page_size) {
+        const uint8_t *bytes = m->memory + page;
+        uint8_t any = 0;
+        for (uint32_t i = 0; i < snapshot_page_size; ++i) { any |= bytes[i]; }
+        if (!any) { continue; }
+
+        uint64_t words[snapshot_page_size / 8];
+        memcpy(words, bytes, sizeof(words));
+
+        /* four independent lanes, so the multiplies overlap */
+        uint64_t lanes[4] = { hash ^ page, hash + 1, hash + 2, hash + 3 };
+        for (uint32_t i = 0; i < snapshot_page_size / 8; i += 4) {
+            for (int lane = 0; lane < 4; ++lane) {
+                lanes[lane] = mix_hash(lanes[lane], words[i + lane]);
+            }
+        }
+        for (int lane = 0; lane < 4; ++lane) {
+            hash = mix_hash(hash, lanes[lane]);
+        }
+    }
+    return hash;
+}
+
+// Returns false when the instance's image could not be read.
+bool start_farm_instance(machine *m, const farm_setup *setup, const farm_slot *slot,
+                         const predecode_cache *shared, size_t index) {
+    *m = {};
+    m->memory = slot->memory;
+    m->code_pages = slot->code_pages;
+    m->blocks = setup->interpret ? 0 : slot->blocks;
+    m->shared_cache = shared;
+    m->program_begin = 0;
+    m->program_end = (uint32_t) setup->program_size;
+
+    memset(m->memory, 0, memory_size);
+    memcpy(m->memory, setup->program, setup->program_size);
+    memset(m->code_pages, 0, code_page_count);
+    if (m->blocks) { flush_blocks(m); }
+
+    /* pages the image lands on no longer hold what the shared cache decoded */
+    uint32_t image_first_page = 1;
+    uint32_t image_end_page = 0;
+    if (setup->images->count) {
+        input_buffer image = {};
+        if (!open_input(setup->images->items[index % setup->images->count], &image)) { return false; }
+
+        size_t room = memory_size - setup->image_address;
+        size_t size = image.size < room ? image.size : room;
+        memcpy(m->memory + setup->image_address, image.data, size);
+        close_input(&image);
+
+        image_first_page = setup->image_address >> code_page_shift;
+        image_end_page = (uint32_t)((setup->image_address + size + code_page_size - 1) >> code_page_shift);
+    }
+    if (shared) {
+        uint32_t end_page = (uint32_t)((setup->program_size + code_page_size - 1) >> code_page_shift);
+        for (uint32_t page = 0; page < end_page; ++page) {
+            if (page < image_first_page || page >= image_end_page) {
+                m->code_pages[page] = code_page_shared;
+            }
+        }
+    }
+
+    if (setup->seeded) {
+        bench_random random = { setup->seed ^ (index * 0xD1B54A32D192ED03ull) };
+        for (int reg = reg_ax; reg <= reg_di; ++reg) {
+            if (reg != reg_sp) { m->registers[reg] = (uint16_t) next_random(&random); }
+        }
+    }
+    return true;
+}
+
+void run_farm_worker(const farm_setup *setup, const farm_slot *slot, const predecode_cache *shared,
+                     std::atomic<size_t> *next, farm_result *results) {
+    machine m;
+    for (;;) {
+        size_t index = next->fetch_add(1, std::memory_order_relaxed);
+        if (index >= setup->instance_count) { break; }
+
+        farm_result *result = &results[index];
+        result->loaded = start_farm_instance(&m, setup, slot, shared, index);
+        if (!result->loaded) { continue; }
+
+        if (m.blocks) {
+            run_blocks(&m, setup->max_steps);
+        } else {
+            run_machine<false>(&m, setup->max_steps, 0);
+        }
+
+        result->steps = m.steps;
+        result->stop = m.stop;
+        result->stop_detail = m.stop_detail;
+        result->cs = m.segments[seg_cs];
+        result->ip = m.ip;
+        result->hash = hash_machine_state(&m);
+    }
+}
+
+void write_farm_result(text_writer *out, const farm_setup *setup, size_t index, const farm_result *result) {
+    char line[1024];
+    int length = snprintf(line, sizeof(line), "; instance %zu", index);
+    if (setup->images->count) {
+        length += snprintf(line + length, sizeof(line) - length, " (%s)",
+                           setup->images->items[index % setup->images->count]);
+    }
+    if (length >= (int) sizeof(line)) { length = (int) sizeof(line) - 1; }
+
+    if (!result->loaded) {
+        length += snprintf(line + length, sizeof(line) - length, ": could not read the image\n");
+    } else {
+        const char *stop = "end of program";
+        switch (result->stop) {
+            case stop_halt: { stop = "halt"; break; }
+            case stop_unknown_opcode: { stop = "unknown opcode"; break; }
+            case stop_unhandled_interrupt: { stop = "unhandled interrupt"; break; }
+            case stop_step_limit: { stop = "step limit"; break; }
+            default: { break; }
+        }
+        length += snprintf(line + length, sizeof(line) - length, ": %llu steps, %s",
+                           (unsigned long long) result->steps, stop);
+        if (result->stop == stop_unknown_opcode || result->stop == stop_unhandled_interrupt) {
+            length += snprintf(line + length, sizeof(line) - length, " 0x%02x at %04x:%04x",
+                               result->stop_detail, result->cs, result->ip);
+        }
+        length += snprintf(line + length, sizeof(line) - length, ", state %016llx\n",
+                           (unsigned long long) result->hash);
+    }
+    if (length >= (int) sizeof(line)) { length = (int) sizeof(line) - 1; }
+    write_text(out, line, (size_t) length);
+}
+
+int run_farm(const farm_setup *setup, unsigned thread_count, text_writer *out) {
+    if (setup->program_size > memory_size) {
+        fprintf(stderr, "[ERROR] Program does not fit in 1 MiB of memory: %s\n", setup->program_name);
+        return 1;
+    }
+    if (setup->images->count && setup->image_address >= memory_size) {
+        fprintf(stderr, "[ERROR] Image address 0x%x is outside the 1 MiB memory\n", setup->image_address);
+        return 1;
+    }
+    if (thread_count > setup->instance_count) { thread_count = (unsigned) setup->instance_count; }
+    if (!thread_count) { thread_count = 1; }
+
+    predecode_cache *shared = 0;
+    if (setup->predecode) {
+        shared = create_shared_predecode(setup->program, setup->program_size);
+        if (!shared) {
+            fprintf(stderr, "[ERROR] Out of memory for the shared predecode cache\n");
+            return 1;
+        }
+    }
+
+    /* one mapping for every worker; pages are only touched by the thread that uses them */
+    size_t memory_bytes = align_snapshot(memory_size);
+    size_t pages_bytes = align_snapshot(code_page_count);
+    size_t blocks_bytes = setup->interpret ? 0 : align_snapshot(sizeof(block_cache));
+    size_t slot_bytes = memory_bytes + pages_bytes + blocks_bytes;
+    size_t arena_size = slot_bytes * thread_count;
+    uint8_t *arena = (uint8_t *) mmap(0, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    farm_result *results = (farm_result *) calloc(setup->instance_count, sizeof(farm_result));
+    farm_slot *slots = (farm_slot *) calloc(thread_count, sizeof(farm_slot));
+    if (arena == MAP_FAILED || !results || !slots) {
+        fprintf(stderr, "[ERROR] Out of memory for %u farm workers\n", thread_count);
+        exit(1);
+    }
+
+    for (unsigned t = 0; t < thread_count; ++t) {
+        uint8_t *base = arena + slot_bytes * t;
+        slots[t].memory = base;
+        slots[t].code_pages = base + memory_bytes;
+        slots[t].blocks = blocks_bytes ? (block_cache *)(base + memory_bytes + pages_bytes) : 0;
+    }
+
+    std::atomic<size_t> next(0);
+    double start = seconds_now();
+    if (thread_count == 1) {
+        run_farm_worker(setup, &slots[0], shared, &next, results);
+    } else {
+        std::thread *workers = new std::thread[thread_count];
+        for (unsigned t = 0; t < thread_count; ++t) {
+            workers[t] = std::thread(run_farm_worker, setup, &slots[t], shared, &next, results);
+        }
+        for (unsigned t = 0; t < thread_count; ++t) {
+            workers[t].join();
+        }
+        delete[] workers;
+    }
+    double elapsed = seconds_now() - start;
+
+    char line[1024];
+    int length = snprintf(line, sizeof(line), "; Farm: %zu instances of %s on %u threads\n",
+                          setup->instance_count, setup->program_name, thread_count);
+    if (length >= (int) sizeof(line)) { length = (int) sizeof(line) - 1; }
+    write_text(out, line, (size_t) length);
+
+    uint64_t total_steps = 0;
+    bool loaded = true;
+    for (size_t i = 0; i < setup->instance_count; ++i) {
+        write_farm_result(out, setup, i, &results[i]);
+        total_steps += results[i].steps;
+        loaded = loaded && results[i].loaded;
+    }
+
+    length = snprintf(line, sizeof(line), "; Total: %llu steps in %.3f seconds, %.0f steps per second\n",
+                      (unsigned long long) total_steps, elapsed, elapsed > 0 ? total_steps / elapsed : 0.0);
+    write_text(out, line, (size_t) length);
+
+    munmap(arena, arena_size);
+    free(slots);
+    free(results);
+    free(shared);
+    return loaded ? 0 : 1;
+}
+
+void print_usage() {
+    fprintf(stderr,
+            "usage: sim86 [-j N] [--cycles] [--stream] [--stats | --stats-json] <file>\n"
+            "       sim86 --count <file>\n"
+            "       sim86 --columns FILE <file>\n"
+            "       sim86 --read-columns FILE\n"
+            "       sim86 --follow [--entry N]... [--cfg FILE] [--call-graph FILE] <file>\n"
+            "       sim86 --exec [--trace] [--cycles] [--interpret | --check-flags] [--max-steps N] [--no-predecode]\n"
+            "             [--profile] [--folded FILE] [--record FILE [--checkpoint-interval N]] [--snapshot FILE]\n"
+            "             <file> | --restore FILE\n"
+            "       sim86 --replay FILE [--step N]\n"
+            "       sim86 --farm N [-j N] [--farm-images PATH]... [--farm-image-address N] [--farm-seed N]\n"
+            "             [--max-steps N] [--interpret] [--no-predecode] <file>\n"
+            "       sim86 --bench [--seed N] [--bench-bytes N] [--bench-repetitions N] [--generate FILE]\n"
+            "       sim86 [-j N] [--output-dir DIR] [--manifest FILE] [--stats | --stats-json] <file or directory>...\n");
+}
+
+int main(int argc, char *argv[]) {
+    path_list inputs = {};
+    const char *manifest = 0;
+    const char *output_dir = 0;
+    unsigned thread_count = 0;
+    bool batch = false;
+    bool exec = false;
+    bool trace = false;
+    bool predecode = true;
+    bool interpret = false;
+    bool check_flags = false;
+    bool cycles = false;
+    bool count_only = false;
+    const char *columns_path = 0;
+    const char *read_columns_path = 0;
+    bool follow = false;
+    bool stream = false;
+    bool show_stats = false;
+    bool stats_json = false;
+    const char *record_path = 0;
+    uint64_t checkpoint_interval = default_checkpoint_interval;
+    const char *replay_path = 0;
+    uint64_t replay_step = UINT64_MAX;
+    const char *snapshot_path = 0;
+    const char *restore_path = 0;
+    uint32_t *entries = 0;
+    size_t entry_count = 0;
+    size_t entry_capacity = 0;
+    const char *cfg_path = 0;
+    const char *call_graph_path = 0;
+    bool profiling = false;
+    const char *folded_path = 0;
+    uint64_t max_steps = 0;
+    bool bench = false;
+    uint64_t seed = 1;
+    size_t bench_bytes = 16 << 20;
+    int bench_repetitions = 5;
+    const char *generate_path = 0;
+    bool farm = false;
+    size_t farm_count = 0;
+    path_list farm_images = {};
+    uint32_t farm_image_address = default_farm_image_address;
+    bool farm_seeded = false;
+    uint64_t farm_seed = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if ((strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            thread_count = (unsigned) atoi(argv[++i]);
+            if (thread_count == 0) { thread_count = std::thread::hardware_concurrency(); }
+            if (thread_count == 0) { thread_count = 1; }
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--bench-bytes") == 0 && i + 1 < argc) {
+            bench_bytes = (size_t) strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--bench-repetitions") == 0 && i + 1 < argc) {
+            bench_repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--generate") == 0 && i + 1 < argc) {
+            bench = true;
+            generate_path = argv[++i];
+        } else if (strcmp(argv[i], "--farm") == 0 && i + 1 < argc) {
+            farm = true;
+            farm_count = (size_t) strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--farm-images") == 0 && i + 1 < argc) {
+            farm = true;
+            if (!add_batch_path(&farm_images, argv[++i])) { return 1; }
+        } else if (strcmp(argv[i], "--farm-image-address") == 0 && i + 1 < argc) {
+            farm_image_address = (uint32_t) strtoul(argv[++i], 0, 0);
+        } else if (strcmp(argv[i], "--farm-seed") == 0 && i + 1 < argc) {
+            farm_seeded = true;
+            farm_seed = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--exec") == 0) {
+            exec = true;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            exec = true;
+            trace = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            exec = true;
+            profiling = true;
+        } else if (strcmp(argv[i], "--folded") == 0 && i + 1 < argc) {
+            exec = true;
+            profiling = true;
+            folded_path = argv[++i];
+        } else if (strcmp(argv[i], "--cycles") == 0) {
+            cycles = true;
+        } else if (strcmp(argv[i], "--count") == 0) {
+            count_only = true;
+        } else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc) {
+            columns_path = argv[++i];
+        } else if (strcmp(argv[i], "--read-columns") == 0 && i + 1 < argc) {
+            read_columns_path = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            exec = true;
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) {
+            checkpoint_interval = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            exec = true;
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            exec = true;
+            restore_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+            replay_step = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = true;
+        } else if (strcmp(argv[i], "--stats-json") == 0) {
+            show_stats = true;
+            stats_json = true;
+        } else if (strcmp(argv[i], "--follow") == 0) {
+            follow = true;
+        } else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc) {
+            follow = true;
+            grow_array(&entries, &entry_capacity, entry_count + 1, "entry points");
+            entries[entry_count++] = (uint32_t) strtoul(argv[++i], 0, 0);
+        } else if (strcmp(argv[i], "--cfg") == 0 && i + 1 < argc) {
+            follow = true;
+            cfg_path = argv[++i];
+        } else if (strcmp(argv[i], "--call-graph") == 0 && i + 1 < argc) {
+            follow = true;
+            call_graph_path = argv[++i];
+        } else if (strcmp(argv[i], "--check-flags") == 0) {
+            exec = true;
+            check_flags = true;
+        } else if (strcmp(argv[i], "--interpret") == 0) {
+            exec = true;
+            interpret = true;
+        } else if (strcmp(argv[i], "--no-predecode") == 0) {
+            predecode = false;
+        } else if (strcmp(argv[i], "--max-steps") == 0 && i + 1 < argc) {
+            max_steps = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+            batch = true;
+        } else if (strcmp(argv[i], "--output-dir") == 0 && i + 1 < argc) {
+            output_dir = argv[++i];
+            batch = true;
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            /* a misspelled option would otherwise be taken as an input path */
+            fprintf(stderr, "[ERROR] Unknown option or missing value: %s\n", argv[i]);
+            print_usage();
+            return 1;
+        } else {
+            path_list_push(&inputs, argv[i]);
+        }
+    }
+
+    if (bench) {
+        if (bench_bytes < max_bench_instruction) { bench_bytes = max_bench_instruction; }
+        if (bench_repetitions < 1) { bench_repetitions = 1; }
+        path_list_free(&inputs);
+        return run_benchmarks(seed, bench_bytes, bench_repetitions, generate_path);
+    }
+
+    if (replay_path) {
+        path_list_free(&inputs);
+
+        trace_replay replay;
+        if (!open_trace(replay_path, &replay)) { return 1; }
+        if (replay_step == UINT64_MAX) { replay_step = replay.step_count; }
+        if (!seek_trace(&replay, replay_step)) {
+            if (replay_step > replay.step_count) {
+                fprintf(stderr, "[ERROR] %s has %llu steps\n", replay_path, (unsigned long long) replay.step_count);
+            } else {
+                fprintf(stderr, "[ERROR] %s has a damaged record before step %llu\n",
+                        replay_path, (unsigned long long) replay_step);
+            }
+            close_trace(&replay);
+            return 1;
+        }
+
+        static char output_storage[1 << 16];
+        text_writer out = { output_storage, sizeof(output_storage), 0, STDOUT_FILENO };
+        writer_reserve(&out, max_line_length);
+        write_fragment(&out, FRAGMENT("; Registers after step "));
+        write_uint(&out, replay_step);
+        write_fragment(&out, FRAGMENT(" of "));
+        write_uint(&out, replay.step_count);
+        write_fragment(&out, FRAGMENT(":\n"));
+        write_register_lines(&out, &replay.m);
+
+        instruction next;
+        if (replay_step < replay.step_count &&
+            fetch_instruction_at(&replay.m, linear_address(replay.m.segments[seg_cs], replay.m.ip), &next)) {
+            writer_reserve(&out, max_line_length);
+            write_fragment(&out, FRAGMENT("; next: "));
+            write_instruction_text(&out, &next);
+            write_char(&out, '\n');
+        }
+        close_trace(&replay);
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (farm) {
+        if (!inputs.count) {
+            fprintf(stderr, "[ERROR] Missing filename argument.\n");
+            print_usage();
+            return 1;
+        }
+        /* one instance per image unless a count is given */
+        if (!farm_count) { farm_count = farm_images.count; }
+        if (!farm_count) {
+            fprintf(stderr, "[ERROR] The farm needs an instance count or at least one image\n");
+            return 1;
+        }
+
+        input_buffer program = {};
+        if (!open_input(inputs.items[0], &program)) {
+            fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", inputs.items[0]);
+            return 1;
+        }
+        if (!thread_count) { thread_count = std::thread::hardware_concurrency(); }
+        if (!thread_count) { thread_count = 1; }
+
+        farm_setup setup = {};
+        setup.program = program.data;
+        setup.program_size = program.size;
+        setup.program_name = inputs.items[0];
+        setup.images = &farm_images;
+        setup.image_address = farm_image_address;
+        setup.instance_count = farm_count;
+        setup.seeded = farm_seeded;
+        setup.seed = farm_seed;
+        setup.max_steps = max_steps;
+        setup.interpret = interpret;
+        setup.predecode = predecode;
+
+        static char output_storage[1 << 20];
+        text_writer out = { output_storage, sizeof(output_storage), 0, STDOUT_FILENO };
+        int result = run_farm(&setup, thread_count, &out);
+        close_input(&program);
+        path_list_free(&farm_images);
+        path_list_free(&inputs);
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+        return result;
+    }
+
+    if (read_columns_path) {
+        path_list_free(&inputs);
+
+        column_file file;
+        if (!open_column_file(read_columns_path, &file)) { return 1; }
+
+        static char output_storage[1 << 20];
+        text_writer out = { output_storage, sizeof(output_storage), 0, STDOUT_FILENO };
+        int result = render_column_file(&file, &out);
+        close_column_file(&file);
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+        return result;
+    }
+
+    decode_stats stats = {};
+    decode_stats *counters = show_stats ? &stats : 0;
+
+    if (inputs.count > 1) { batch = true; }
+    for (size_t i = 0; i < inputs.count && !batch; ++i) {
+        struct stat info;
+        batch = (stat(inputs.items[i], &info) == 0 && S_ISDIR(info.st_mode));
+    }
+
+    if (batch) {
+        path_list paths = {};
+        bool listed = true;
+        for (size_t i = 0; i < inputs.count; ++i) {
+            listed = add_batch_path(&paths, inputs.items[i]) && listed;
+        }
+        if (manifest) {
+            listed = read_manifest(&paths, manifest) && listed;
+        }
+        path_list_free(&inputs);
+
+        if (!thread_count) { thread_count = std::thread::hardware_concurrency(); }
+        if (!thread_count) { thread_count = 1; }
+
+        static char output_storage[1 << 20];
+        text_writer out = { output_storage, sizeof(output_storage), 0, STDOUT_FILENO, counters };
+
+        int result = decode_batch_files(&paths, output_dir, thread_count, &out, counters);
+        path_list_free(&paths);
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+        if (counters) {
+            print_decode_stats(counters, stats_json);
+        }
+
+        return (result || !listed) ? 1 : 0;
+    }
+
+    if (!inputs.count && !restore_path) {
+        fprintf(stderr, "[ERROR] Missing filename argument.\n");
+        print_usage();
+        return 1;
+    }
+
+    /* a restored run has no program file; its listing header names the snapshot */
+    const char *filename = restore_path ? restore_path : inputs.items[0];
+    static char output_storage[1 << 20];
+    text_writer out = { output_storage, sizeof(output_storage), 0, STDOUT_FILENO, counters };
+
+    /* pipes and FIFOs are listed as they arrive instead of being read whole first */
+    bool is_stdin = (strcmp(filename, "-") == 0);
+    struct stat info;
+    bool regular = (is_stdin ? fstat(STDIN_FILENO, &info) : stat(filename, &info)) == 0 && S_ISREG(info.st_mode);
+    if (!exec && !follow && !columns_path && !count_only && (stream || !regular)) {
+        int fd = is_stdin ? STDIN_FILENO : open(filename, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", filename);
+            return 1;
+        }
+
+        write_text(&out, "; ", 2);
+        write_text(&out, filename, strlen(filename));
+        write_text(&out, ":\nbits 16\n\n", 11);
+
+        decode_error error = {};
+        clock_totals clocks = {};
+        int result = decode_stream(fd, &out, &error, cycles ? &clocks : 0, counters);
+        if (!is_stdin) { close(fd); }
+
+        if (cycles && !result) {
+            write_text(&out, "\n", 1);
+            write_clock_totals(&out, &clocks);
+        }
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+        if (counters) {
+            print_decode_stats(counters, stats_json);
+        }
+
+        if (result > 0) {
+            print_decode_error(0, &error);
+        } else if (result < 0) {
+            fprintf(stderr, "[ERROR] Error reading %s\n", filename);
+        }
+
+        path_list_free(&inputs);
+        return result ? 1 : 0;
+    }
+
+    phase_timer read_timer = counters ? start_phase(counters) : phase_timer{};
+    input_buffer input = {};
+    if (!restore_path && !open_input(filename, &input)) {
+        fprintf(stderr, "[ERROR] Error opening file with filename = %s\n", filename);
+        return 1;
+    }
+    if (counters) {
+        end_phase(counters, read_timer, phase_read);
+        counters->bytes_read = input.size;
+    }
+
+    if (columns_path && !exec) {
+        decode_error error = {};
+        int result = write_column_file(input.data, input.size, filename, columns_path, &error);
+        close_input(&input);
+        path_list_free(&inputs);
+
+        if (result > 0) {
+            print_decode_error(0, &error);
+        }
+        return result ? 1 : 0;
+    }
+
+    if (count_only && !exec) {
+        prescan_result scan = prescan_starts(input.data, input.size, 0);
+        decode_error error = {};
+        if (scan.truncated) {
+            fill_decode_error(input.data, input.size, scan.end, &error);
+        }
+        close_input(&input);
+
+        write_text(&out, "; ", 2);
+        write_text(&out, filename, strlen(filename));
+        writer_reserve(&out, max_line_length);
+        write_fragment(&out, FRAGMENT(": "));
+        write_uint(&out, scan.count);
+        write_fragment(&out, FRAGMENT(" instructions\n"));
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+
+        if (scan.truncated) {
+            print_decode_error(0, &error);
+        }
+
+        path_list_free(&inputs);
+        return scan.truncated ? 1 : 0;
+    }
+
+    write_text(&out, "; ", 2);
+    write_text(&out, filename, strlen(filename));
+    write_text(&out, ":\nbits 16\n\n", 11);
+
+    if (follow && !exec) {
+        uint32_t start = 0;
+        const uint32_t *points = entry_count ? entries : &start;
+        size_t point_count = entry_count ? entry_count : 1;
+
+        int result = 0;
+        for (size_t i = 0; i < point_count; ++i) {
+            if (points[i] >= input.size) {
+                fprintf(stderr, "[ERROR] Entry point %u is outside the %zu byte input\n", points[i], input.size);
+                result = 1;
+            }
+        }
+
+        flow_graph graph = {};
+        if (!result) {
+            build_flow_graph(&graph, input.data, input.size, points, point_count);
+            write_flow_listing(&out, &graph, input.data, input.size);
+
+            if (cfg_path && !write_control_flow_graph(cfg_path, &graph)) {
+                fprintf(stderr, "[ERROR] Could not write the control flow graph to %s\n", cfg_path);
+                result = 1;
+            }
+            if (call_graph_path && !write_call_graph(call_graph_path, &graph)) {
+                fprintf(stderr, "[ERROR] Could not write the call graph to %s\n", call_graph_path);
+                result = 1;
+            }
+        }
+        free_flow_graph(&graph);
+        free(entries);
+        close_input(&input);
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+
+        path_list_free(&inputs);
+        return result;
+    }
+
+    if (exec) {
+        machine m;
+        machine reference = {};
+        if (restore_path) {
+            if (!restore_snapshot(restore_path, &m) ||
+                (check_flags && !restore_snapshot(restore_path, &reference))) {
+                free_machine(&m);
+                return 1;
+            }
+            /* --max-steps counts from where the snapshot was taken */
+            if (max_steps) { max_steps += m.steps; }
+        } else if (!load_program(&m, input.data, input.size) ||
+                   (check_flags && !load_program(&reference, input.data, input.size))) {
+            fprintf(stderr, "[ERROR] Program does not fit in 1 MiB of memory: %s\n", filename);
+            close_input(&input);
+            return 1;
+        }
+        close_input(&input);
+        reference.eager_flags = true;
+        reference.cache = 0;
+
+        if (!predecode) {
+            m.cache = 0;
+        } else if (!m.cache) {
+            m.cache = create_predecode_cache();
+        }
+        if (!trace && !interpret && !check_flags && !cycles && !profiling && !record_path) {
+            m.blocks = create_block_cache();
+        }
+        if (record_path && !check_flags) {
+            m.recorder = create_trace_recorder(record_path, &m, checkpoint_interval);
+            if (!m.recorder) {
+                fprintf(stderr, "[ERROR] Could not create trace file %s\n", record_path);
+                return 1;
+            }
+        }
+
+        profile prof = {};
+        if (profiling && !check_flags && !create_profile(&prof)) {
+            fprintf(stderr, "[ERROR] Out of memory for the profile\n");
+            return 1;
+        }
+
+        bool flags_agree = true;
+        clock_totals clocks = {};
+        clock_totals *totals = cycles ? &clocks : 0;
+        if (check_flags) {
+            flags_agree = check_lazy_flags(&m, &reference, max_steps);
+            free_machine(&reference);
+        } else if (trace && profiling) {
+            run_machine<true, true>(&m, max_steps, &out, totals, &prof);
+        } else if (trace) {
+            run_machine<true>(&m, max_steps, &out, totals);
+        } else if (profiling) {
+            run_machine<false, true>(&m, max_steps, &out, totals, &prof);
+        } else if (cycles) {
+            run_machine<false>(&m, max_steps, &out, &clocks);
+        } else if (m.blocks) {
+            run_blocks(&m, max_steps);
+        } else {
+            run_machine<false>(&m, max_steps, &out);
+        }
+
+        write_final_registers(&out, &m);
+        if (cycles && !check_flags) {
+            write_clock_totals(&out, &clocks);
+        }
+        if (m.cache) {
+            write_predecode_counters(&out, m.cache);
+        }
+        if (m.blocks) {
+            write_block_counters(&out, m.blocks);
+        }
+        if (check_flags && flags_agree) {
+            writer_reserve(&out, max_line_length);
+            write_fragment(&out, FRAGMENT("; Flags check: lazy and eager flags agree over "));
+            write_uint(&out, m.steps);
+            write_fragment(&out, FRAGMENT(" instructions\n"));
+        }
+        if (prof.counts) {
+            write_hot_report(&out, &prof, &m);
+            if (folded_path && !write_folded_stacks(folded_path, &prof)) {
+                fprintf(stderr, "[ERROR] Could not write folded stacks to %s\n", folded_path);
+                flags_agree = false;
+            }
+            free_profile(&prof);
+        }
+        if (m.recorder) {
+            if (!finish_trace_recorder(m.recorder, &m)) {
+                fprintf(stderr, "[ERROR] Error writing trace file %s\n", record_path);
+                flags_agree = false;
+            }
+            m.recorder = 0;
+        }
+        if (snapshot_path && !save_snapshot(snapshot_path, &m)) {
+            fprintf(stderr, "[ERROR] Could not write the snapshot to %s\n", snapshot_path);
+            flags_agree = false;
+        }
+        free_machine(&m);
+
+        if (!writer_flush(&out)) {
+            fprintf(stderr, "[ERROR] Error writing output\n");
+            return 1;
+        }
+
+        /* stopping at --max-steps is the point of a run that saves a snapshot */
+        bool finished = m.stop == stop_end_of_program || m.stop == stop_halt ||
+                        (snapshot_path && m.stop == stop_step_limit);
+        if (!finished) {
+            print_stop_reason(&m);
+        }
+        path_list_free(&inputs);
+        return (flags_agree && finished) ? 0 : 1;
+    }
+
+    int result = 0;
+    decode_error error = {};
+    clock_totals clocks = {};
+    if (cycles) {
+        /* the running totals need the listing in order, so this stays serial */
+        result = decode_span(input.data, input.size, &out, &error, &clocks, counters);
+        if (!result) {
+            write_text(&out, "\n", 1);
+            write_clock_totals(&out, &clocks);
+        }
+    } else if (thread_count > 1 && input.size > parallel_chunk_size) {
+        result = decode_span_parallel(input.data, input.size, &out, thread_count, &error, counters);
+    } else {
+        result = decode_span(input.data, input.size, &out, &error, 0, counters);
+    }
+
+    close_input(&input);
+
+    if (!writer_flush(&out)) {
+        fprintf(stderr, "[ERROR] Error writing output\n");
+        return 1;
+    }
+    if (counters) {
+        print_decode_stats(counters, stats_json);
+    }
+
+    if (result) {
+        print_decode_error(0, &error);
+    }
+
+    path_list_free(&inputs);
+    return result;
 }
@@ -0,0 +1,20 @@
+; ========================================================================
+; REGRESSION: AAA AND AAS
+; ========================================================================
+; The 8086 adjusts AL by 6 and AH by 1 separately, so a carry or borrow
+; out of AL never reaches AH. The 80286 and later adjust AX as a whole
+; and give different results here.
+
+bits 16
+
+; AAA with AL = 0xFA: AL + 6 wraps to 0, AH + 1 = 1
+mov ax, 0x00FA
+aaa
+mov bx, ax
+
+; AAS with AL = 1 after a borrow out of the low nibble: AL - 6 = 0xFB, AH - 1 = 4
+mov ax, 0x0510
+sub al, 0x0F
+aas
+
+hlt
@@ -0,0 +1,30 @@
+; ========================================================================
+; REGRESSION: IDIV OVERFLOW
+; ========================================================================
+; Quotients that do not fit the destination raise interrupt 0, like a
+; zero divisor does. 0x80000000 / -1 and 0x8000 / -1 overflow in the
+; host's own division too, so they must be caught before dividing.
+
+bits 16
+
+; Divide error handler at interrupt 0
+mov word [0], divide_error
+mov word [2], 0
+mov sp, 0x8000
+
+; Word: DX:AX = 0x80000000, divided by -1
+mov dx, 0x8000
+xor ax, ax
+mov bx, 0xFFFF
+idiv bx
+
+; Byte: AX = 0x8000, divided by -1
+mov ax, 0x8000
+mov bl, 0xFF
+idiv bl
+
+hlt
+
+divide_error:
+inc cx
+iret
@@ -0,0 +1,879 @@
+// 8086 instruction decoding: the opcode tables, the decoded instruction record
+// and the decoder, with no I/O and no allocation. Everything is constexpr,
+// inline or a template, so any number of translation units can include this
+// header and nothing needs to be linked; main.cc, the command line tool, is
+// built on top of it. The embedding API is decode() at the end; every name
+// is in namespace sim86.
+#ifndef SIM86_H
+#define SIM86_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace sim86 {
+
+// A piece of listing text with its length worked out at compile time.
+struct text_fragment {
+    const char *text;
+    uint32_t length;
+};
+
+/* internal; restored to whatever the includer had at the end of the header */
+#pragma push_macro("FRAGMENT")
+#undef FRAGMENT
+#define FRAGMENT(literal) text_fragment{ literal, sizeof(literal) - 1 }
+
+// Opening part of each effective address. MOD = 00 entries are complete except
+// for the direct address, which is followed by the address and "]"; MOD = 01
+// and MOD = 10 are followed by the signed displacement and "]".
+const text_fragment effective_addr_calculation[3][8] = {
+    // MOD = 00
+    { FRAGMENT("[bx + si]"), FRAGMENT("[bx + di]"), FRAGMENT("[bp + si]"), FRAGMENT("[bp + di]"),
+      FRAGMENT("[si]"),      FRAGMENT("[di]"),      FRAGMENT("["),         FRAGMENT("[bx]") },
+    // MOD = 01
+    { FRAGMENT("[bx + si"),  FRAGMENT("[bx + di"),  FRAGMENT("[bp + si"),  FRAGMENT("[bp + di"),
+      FRAGMENT("[si"),       FRAGMENT("[di"),       FRAGMENT("[bp"),       FRAGMENT("[bx") },
+    // MOD = 10
+    { FRAGMENT("[bx + si"),  FRAGMENT("[bx + di"),  FRAGMENT("[bp + si"),  FRAGMENT("[bp + di"),
+      FRAGMENT("[si"),       FRAGMENT("[di"),       FRAGMENT("[bp"),       FRAGMENT("[bx") }
+};
+
+// 8086 clocks for each effective address form above: displacement only 6, base
+// or index 5, base + index 7 or 8, with a displacement 9, 11 or 12.
+const uint8_t effective_addr_clocks[3][8] = {
+    // MOD = 00
+    { 7,  8,  8,  7,  5, 5, 6, 5 },
+    // MOD = 01
+    { 11, 12, 12, 11, 9, 9, 9, 9 },
+    // MOD = 10
+    { 11, 12, 12, 11, 9, 9, 9, 9 }
+};
+
+const char * const reg_rm_11[2][8] = {
+    // W = 0
+    { "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh" },
+    // W = 1
+    { "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" }
+};
+
+// How the operands of an instruction are laid out in its bytes. The first
+// seven are the MOV forms the decoder started with; the rest cover the other
+// encodings of the 8086.
+enum decode_mode : uint8_t {
+    rm_to_rm,       // ModRM reg and r/m, ordered by the D bit
+    imm_to_rm,
+    imm_to_r,       // register in the low three opcode bits
+    mem_to_acc,
+    acc_to_mem,
+    rm_to_seg,
+    seg_to_rm,
+    no_operands,
+    imm_to_acc,
+    rm_only,
+    rm_by_one,      // shifts and rotates by 1
+    rm_by_cl,       // shifts and rotates by CL
+    reg_only,       // register in the low three opcode bits
+    seg_only,       // segment register in opcode bits 3-4
+    reg_to_acc,     // xchg ax, reg
+    short_label,    // 8-bit relative jump
+    near_label,     // 16-bit relative jump or call
+    far_label,      // offset:segment pointer
+    imm_only,
+    port_to_acc,
+    acc_to_port,
+    dx_to_acc,
+    acc_to_dx,
+    esc_rm,
+    prefix_byte,
+    decode_mode_count
+};
+
+const char * const decode_mode_names[decode_mode_count] = {
+    "rm_to_rm", "imm_to_rm", "imm_to_r", "mem_to_acc", "acc_to_mem", "rm_to_seg", "seg_to_rm",
+    "no_operands", "imm_to_acc", "rm_only", "rm_by_one", "rm_by_cl", "reg_only", "seg_only", "reg_to_acc",
+    "short_label", "near_label", "far_label", "imm_only",
+    "port_to_acc", "acc_to_port", "dx_to_acc", "acc_to_dx",
+    "esc_rm", "prefix_byte"
+};
+
+enum instruction_family : uint8_t {
+    family_unknown,
+    family_mov, family_push, family_pop, family_xchg, family_in, family_out, family_xlat,
+    family_lea, family_lds, family_les, family_lahf, family_sahf, family_pushf, family_popf,
+    family_add, family_adc, family_inc, family_aaa, family_daa,
+    family_sub, family_sbb, family_dec, family_neg, family_cmp, family_aas, family_das,
+    family_mul, family_imul, family_aam, family_div, family_idiv, family_aad, family_cbw, family_cwd,
+    family_not, family_shl, family_shr, family_sar, family_rol, family_ror, family_rcl, family_rcr,
+    family_and, family_test, family_or, family_xor,
+    family_movsb, family_movsw, family_cmpsb, family_cmpsw, family_scasb, family_scasw,
+    family_lodsb, family_lodsw, family_stosb, family_stosw,
+    family_call, family_call_far, family_jmp, family_jmp_far, family_ret, family_retf,
+    family_jo, family_jno, family_jb, family_jnb, family_je, family_jne, family_jbe, family_ja,
+    family_js, family_jns, family_jp, family_jnp, family_jl, family_jnl, family_jle, family_jg,
+    family_loopnz, family_loopz, family_loop, family_jcxz,
+    family_int, family_int3, family_into, family_iret,
+    family_clc, family_cmc, family_stc, family_cld, family_std, family_cli, family_sti,
+    family_nop, family_hlt, family_wait, family_esc,
+    family_lock, family_rep, family_repne, family_es, family_cs, family_ss, family_ds,
+    family_count
+};
+
+const text_fragment family_mnemonics[family_count] = {
+    FRAGMENT("???"),
+    FRAGMENT("mov"), FRAGMENT("push"), FRAGMENT("pop"), FRAGMENT("xchg"), FRAGMENT("in"), FRAGMENT("out"), FRAGMENT("xlat"),
+    FRAGMENT("lea"), FRAGMENT("lds"), FRAGMENT("les"), FRAGMENT("lahf"), FRAGMENT("sahf"), FRAGMENT("pushf"), FRAGMENT("popf"),
+    FRAGMENT("add"), FRAGMENT("adc"), FRAGMENT("inc"), FRAGMENT("aaa"), FRAGMENT("daa"),
+    FRAGMENT("sub"), FRAGMENT("sbb"), FRAGMENT("dec"), FRAGMENT("neg"), FRAGMENT("cmp"), FRAGMENT("aas"), FRAGMENT("das"),
+    FRAGMENT("mul"), FRAGMENT("imul"), FRAGMENT("aam"), FRAGMENT("div"), FRAGMENT("idiv"), FRAGMENT("aad"), FRAGMENT("cbw"), FRAGMENT("cwd"),
+    FRAGMENT("not"), FRAGMENT("shl"), FRAGMENT("shr"), FRAGMENT("sar"), FRAGMENT("rol"), FRAGMENT("ror"), FRAGMENT("rcl"), FRAGMENT("rcr"),
+    FRAGMENT("and"), FRAGMENT("test"), FRAGMENT("or"), FRAGMENT("xor"),
+    FRAGMENT("movsb"), FRAGMENT("movsw"), FRAGMENT("cmpsb"), FRAGMENT("cmpsw"), FRAGMENT("scasb"), FRAGMENT("scasw"),
+    FRAGMENT("lodsb"), FRAGMENT("lodsw"), FRAGMENT("stosb"), FRAGMENT("stosw"),
+    FRAGMENT("call"), FRAGMENT("call far"), FRAGMENT("jmp"), FRAGMENT("jmp far"), FRAGMENT("ret"), FRAGMENT("retf"),
+    FRAGMENT("jo"), FRAGMENT("jno"), FRAGMENT("jb"), FRAGMENT("jnb"), FRAGMENT("je"), FRAGMENT("jne"), FRAGMENT("jbe"), FRAGMENT("ja"),
+    FRAGMENT("js"), FRAGMENT("jns"), FRAGMENT("jp"), FRAGMENT("jnp"), FRAGMENT("jl"), FRAGMENT("jnl"), FRAGMENT("jle"), FRAGMENT("jg"),
+    FRAGMENT("loopnz"), FRAGMENT("loopz"), FRAGMENT("loop"), FRAGMENT("jcxz"),
+    FRAGMENT("int"), FRAGMENT("int3"), FRAGMENT("into"), FRAGMENT("iret"),
+    FRAGMENT("clc"), FRAGMENT("cmc"), FRAGMENT("stc"), FRAGMENT("cld"), FRAGMENT("std"), FRAGMENT("cli"), FRAGMENT("sti"),
+    FRAGMENT("nop"), FRAGMENT("hlt"), FRAGMENT("wait"), FRAGMENT("esc"),
+    FRAGMENT("lock"), FRAGMENT("rep"), FRAGMENT("repne"), FRAGMENT("es"), FRAGMENT("cs"), FRAGMENT("ss"), FRAGMENT("ds")
+};
+
+// Opcodes whose operation is picked by the reg field of the ModRM byte.
+enum opcode_group : uint8_t {
+    group_none,
+    group_immediate,    // 80-83
+    group_shift,        // D0-D3
+    group_unary,        // F6-F7
+    group_inc_dec,      // FE
+    group_indirect      // FF
+};
+
+const instruction_family group_families[6][8] = {
+    { },
+    { family_add, family_or, family_adc, family_sbb, family_and, family_sub, family_xor, family_cmp },
+    { family_rol, family_ror, family_rcl, family_rcr, family_shl, family_shr, family_shl, family_sar },
+    { family_test, family_test, family_not, family_neg, family_mul, family_imul, family_div, family_idiv },
+    { family_inc, family_dec, family_unknown, family_unknown, family_unknown, family_unknown, family_unknown, family_unknown },
+    { family_inc, family_dec, family_call, family_call_far, family_jmp, family_jmp_far, family_push, family_unknown }
+};
+
+// Everything that can be known about an instruction from its first byte alone.
+// `disp_length` only counts fixed address bytes (the MOV accumulator forms and
+// far pointers); the ModRM displacement is added at decode time once the ModRM
+// byte is known. For group_unary only TEST (reg 0 and 1) has the immediate.
+struct opcode_entry {
+    instruction_family family;
+    decode_mode mode;
+    opcode_group group;
+    uint8_t d;
+    uint8_t w;
+    uint8_t reg;
+    uint8_t has_modrm;
+    uint8_t disp_length;
+    uint8_t imm_length;
+    uint8_t sign_extend;
+};
+
+constexpr bool mode_has_modrm(decode_mode mode) {
+    return mode == rm_to_rm || mode == imm_to_rm || mode == rm_to_seg || mode == seg_to_rm ||
+           mode == rm_only  || mode == rm_by_one || mode == rm_by_cl  || mode == esc_rm;
+}
+
+constexpr opcode_entry make_entry(instruction_family family, decode_mode mode, uint8_t w = 0) {
+    opcode_entry entry = {};
+    entry.family = family;
+    entry.mode = mode;
+    entry.w = w;
+    entry.has_modrm = mode_has_modrm(mode);
+    if (mode == imm_to_rm || mode == imm_to_r || mode == imm_to_acc) {
+        entry.imm_length = w ? 2 : 1;
+    } else if (mode == port_to_acc || mode == acc_to_port) {
+        entry.imm_length = 1;
+    } else if (mode == mem_to_acc || mode == acc_to_mem) {
+        entry.disp_length = 2;
+    } else if (mode == short_label) {
+        entry.disp_length = 1;
+    } else if (mode == near_label) {
+        entry.disp_length = 2;
+    } else if (mode == far_label) {
+        entry.disp_length = 2;
+        entry.imm_length = 2;
+    }
+    return entry;
+}
+
+constexpr opcode_entry make_opcode_entry(uint8_t byte) {
+    const instruction_family alu_families[8] = {
+        family_add, family_or, family_adc, family_sbb, family_and, family_sub, family_xor, family_cmp
+    };
+    const instruction_family jump_families[16] = {
+        family_jo, family_jno, family_jb, family_jnb, family_je, family_jne, family_jbe, family_ja,
+        family_js, family_jns, family_jp, family_jnp, family_jl, family_jnl, family_jle, family_jg
+    };
+    const instruction_family string_families[12] = {
+        family_movsb, family_movsw, family_cmpsb, family_cmpsw, family_unknown, family_unknown,
+        family_stosb, family_stosw, family_lodsb, family_lodsw, family_scasb, family_scasw
+    };
+    const instruction_family segment_families[4] = { family_es, family_cs, family_ss, family_ds };
+
+    uint8_t w = (byte >> 0) & 0b00000001;
+    opcode_entry entry = {};
+
+    if (byte < 0x40 && (byte & 0b00000111) < 6) {
+        /* add/or/adc/sbb/and/sub/xor/cmp */
+        instruction_family family = alu_families[(byte >> 3) & 0b00000111];
+        if ((byte & 0b00000100) == 0) {
+            entry = make_entry(family, rm_to_rm, w);
+            entry.d = (byte >> 1) & 0b00000001;
+        } else {
+            entry = make_entry(family, imm_to_acc, w);
+        }
+    } else if (byte < 0x40 && (byte & 0b00100110) == 0b00000110) {
+        entry = make_entry((byte & 1) ? family_pop : family_push, seg_only, 1);
+        entry.reg = (byte >> 3) & 0b00000011;
+    } else if (byte < 0x40 && (byte & 0b00100111) == 0b00100110) {
+        entry = make_entry(segment_families[(byte >> 3) & 0b00000011], prefix_byte);
+        entry.reg = (byte >> 3) & 0b00000011;
+    } else if (byte < 0x40) {
+        const instruction_family adjust_families[4] = { family_daa, family_das, family_aaa, family_aas };
+        entry = make_entry(adjust_families[(byte >> 3) & 0b00000011], no_operands);
+    } else if (byte < 0x60) {
+        const instruction_family register_families[4] = { family_inc, family_dec, family_push, family_pop };
+        entry = make_entry(register_families[(byte >> 3) & 0b00000011], reg_only, 1);
+        entry.reg = (byte >> 0) & 0b00000111;
+    } else if (byte >= 0x70 && byte < 0x80) {
+        entry = make_entry(jump_families[byte & 0b00001111], short_label);
+    } else if (byte >= 0x80 && byte < 0x84) {
+        entry = make_entry(family_unknown, imm_to_rm, w);
+        entry.group = group_immediate;
+        if (byte == 0x83) {
+            entry.imm_length = 1;
+            entry.sign_extend = 1;
+        }
+    } else if (byte == 0x84 || byte == 0x85) {
+        entry = make_entry(family_test, rm_to_rm, w);
+    } else if (byte == 0x86 || byte == 0x87) {
+        entry = make_entry(family_xchg, rm_to_rm, w);
+    } else if (((byte >> 2) & 0b111111) == 0b100010) {
+        entry = make_entry(family_mov, rm_to_rm, w);
+        entry.d = (byte >> 1) & 0b00000001;
+    } else if (byte == 0b10001100) {
+        entry = make_entry(family_mov, seg_to_rm, 1);
+    } else if (byte == 0x8D) {
+        entry = make_entry(family_lea, rm_to_rm, 1);
+        entry.d = 1;
+    } else if (byte == 0b10001110) {
+        entry = make_entry(family_mov, rm_to_seg, 1);
+        entry.d = 1;
+    } else if (byte == 0x8F) {
+        entry = make_entry(family_pop, rm_only, 1);
+    } else if (byte == 0x90) {
+        entry = make_entry(family_nop, no_operands);
+    } else if (byte > 0x90 && byte < 0x98) {
+        entry = make_entry(family_xchg, reg_to_acc, 1);
+        entry.reg = (byte >> 0) & 0b00000111;
+    } else if (byte >= 0x98 && byte < 0xA0) {
+        const instruction_family misc_families[8] = {
+            family_cbw, family_cwd, family_call, family_wait, family_pushf, family_popf, family_sahf, family_lahf
+        };
+        entry = make_entry(misc_families[byte & 0b00000111], byte == 0x9A ? far_label : no_operands);
+    } else if (byte == 0xA0 || byte == 0xA1) {
+        entry = make_entry(family_mov, mem_to_acc, w);
+    } else if (byte == 0xA2 || byte == 0xA3) {
+        entry = make_entry(family_mov, acc_to_mem, w);
+    } else if (byte == 0xA8 || byte == 0xA9) {
+        entry = make_entry(family_test, imm_to_acc, w);
+    } else if (byte >= 0xA4 && byte < 0xB0) {
+        entry = make_entry(string_families[byte - 0xA4], no_operands, w);
+    } else if (((byte >> 4) & 0b1111) == 0b1011) {
+        entry = make_entry(family_mov, imm_to_r, (byte >> 3) & 0b00000001);
+        entry.reg = (byte >> 0) & 0b00000111;
+    } else if (byte == 0xC2 || byte == 0xCA) {
+        entry = make_entry(byte == 0xC2 ? family_ret : family_retf, imm_only);
+        entry.imm_length = 2;
+    } else if (byte == 0xC3 || byte == 0xCB) {
+        entry = make_entry(byte == 0xC3 ? family_ret : family_retf, no_operands);
+    } else if (byte == 0xC4 || byte == 0xC5) {
+        entry = make_entry(byte == 0xC4 ? family_les : family_lds, rm_to_rm, 1);
+        entry.d = 1;
+    } else if (((byte >> 1) & 0b1111111) == 0b1100011) {
+        entry = make_entry(family_mov, imm_to_rm, w);
+    } else if (byte == 0xCC) {
+        entry = make_entry(family_int3, no_operands);
+    } else if (byte == 0xCD) {
+        entry = make_entry(family_int, imm_only);
+        entry.imm_length = 1;
+    } else if (byte == 0xCE) {
+        entry = make_entry(family_into, no_operands);
+    } else if (byte == 0xCF) {
+        entry = make_entry(family_iret, no_operands);
+    } else if (byte >= 0xD0 && byte < 0xD4) {
+        entry = make_entry(family_unknown, (byte & 0b00000010) ? rm_by_cl : rm_by_one, w);
+        entry.group = group_shift;
+    } else if (byte == 0xD4 || byte == 0xD5) {
+        /* the second byte is the base, always 10 on a real 8086 */
+        entry = make_entry(byte == 0xD4 ? family_aam : family_aad, no_operands);
+        entry.imm_length = 1;
+    } else if (byte == 0xD7) {
+        entry = make_entry(family_xlat, no_operands);
+    } else if (byte >= 0xD8 && byte < 0xE0) {
+        entry = make_entry(family_esc, esc_rm, 1);
+        entry.reg = (byte >> 0) & 0b00000111;
+    } else if (byte >= 0xE0 && byte < 0xE4) {
+        const instruction_family loop_families[4] = { family_loopnz, family_loopz, family_loop, family_jcxz };
+        entry = make_entry(loop_families[byte & 0b00000011], short_label);
+    } else if (byte >= 0xE4 && byte < 0xE8) {
+        entry = make_entry((byte & 0b00000010) ? family_out : family_in, (byte & 0b00000010) ? acc_to_port : port_to_acc, w);
+    } else if (byte == 0xE8 || byte == 0xE9) {
+        entry = make_entry(byte == 0xE8 ? family_call : family_jmp, near_label);
+    } else if (byte == 0xEA) {
+        entry = make_entry(family_jmp, far_label);
+    } else if (byte == 0xEB) {
+        entry = make_entry(family_jmp, short_label);
+    } else if (byte >= 0xEC && byte < 0xF0) {
+        entry = make_entry((byte & 0b00000010) ? family_out : family_in, (byte & 0b00000010) ? acc_to_dx : dx_to_acc, w);
+    } else if (byte == 0xF0 || byte == 0xF2 || byte == 0xF3) {
+        entry = make_entry(byte == 0xF0 ? family_lock : (byte == 0xF2 ? family_repne : family_rep), prefix_byte);
+    } else if (byte == 0xF4 || byte == 0xF5) {
+        entry = make_entry(byte == 0xF4 ? family_hlt : family_cmc, no_operands);
+    } else if (byte == 0xF6 || byte == 0xF7) {
+        entry = make_entry(family_unknown, rm_only, w);
+        entry.group = group_unary;
+        entry.imm_length = w ? 2 : 1;
+    } else if (byte >= 0xF8 && byte < 0xFE) {
+        const instruction_family flag_families[6] = { family_clc, family_stc, family_cli, family_sti, family_cld, family_std };
+        entry = make_entry(flag_families[byte - 0xF8], no_operands);
+    } else if (byte == 0xFE || byte == 0xFF) {
+        entry = make_entry(family_unknown, rm_only, w);
+        entry.group = (byte == 0xFE) ? group_inc_dec : group_indirect;
+    }
+
+    return entry;
+}
+
+struct opcode_table {
+    opcode_entry entries[256];
+};
+
+constexpr opcode_table make_opcode_table() {
+    opcode_table table = {};
+    for (int byte = 0; byte < 256; ++byte) {
+        table.entries[byte] = make_opcode_entry((uint8_t) byte);
+    }
+    return table;
+}
+
+constexpr opcode_table opcode_lookup = make_opcode_table();
+
+const char * const segment_registers[4] = { "es", "cs", "ss", "ds" };
+
+enum operand_kind : uint8_t {
+    operand_none,
+    operand_register,   // index is (w << 3) | reg into reg_rm_11
+    operand_segment,    // index into segment_registers
+    operand_memory,     // index is (mod << 3) | rm into effective_addr_calculation
+    operand_immediate,  // index is 1 for a byte sign-extended to a word (opcode 83)
+    operand_relative,   // jump target, displacement from the end of the instruction
+    operand_far         // immediate is the segment, displacement the offset
+};
+
+struct operand {
+    operand_kind kind;
+    uint8_t index;
+};
+
+enum instruction_flags : uint8_t {
+    instruction_wide             = 1 << 0,  // W bit: word sized operands
+    instruction_explicit_size    = 1 << 1,  // print "byte"/"word" on the immediate, or on memory when there is none
+    instruction_lock             = 1 << 2,
+    instruction_rep              = 1 << 3,
+    instruction_repne            = 1 << 4,
+    instruction_segment_override = 1 << 5,  // segment register in the top two bits
+};
+
+inline uint8_t segment_override(uint8_t flags) {
+    return (flags >> 6) & 0b00000011;
+}
+
+// A fully decoded instruction. Operand 0 is the destination and operand 1 the
+// source, so the D bit has already been applied. At most one operand is memory,
+// which is why a single displacement is enough.
+struct instruction {
+    uint32_t offset;
+    uint8_t length;
+    instruction_family family;
+    decode_mode mode;
+    uint8_t flags;
+    operand operands[2];
+    int16_t displacement;
+    uint16_t immediate;
+};
+
+static_assert(sizeof(instruction) == 16, "instruction records are meant to stay 16 bytes");
+
+// Walks a byte span one instruction at a time. The length of the whole
+// instruction is worked out from its first bytes and checked against the end of
+// the span once; after that its bytes are pulled without further checks.
+struct instruction_cursor {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+};
+
+inline size_t cursor_remaining(instruction_cursor *cursor) {
+    return cursor->size - cursor->offset;
+}
+
+inline uint8_t cursor_next(instruction_cursor *cursor) {
+    return cursor->data[cursor->offset++];
+}
+
+inline uint8_t cursor_peek(instruction_cursor *cursor, size_t ahead) {
+    return cursor->data[cursor->offset + ahead];
+}
+
+// Number of displacement bytes that follow a ModRM byte.
+inline uint8_t displacement_length(uint8_t modrm) {
+    uint8_t mod = (modrm >> 6) & 0b00000011;
+    uint8_t rm  = (modrm >> 0) & 0b00000111;
+    if (mod == 0b00000001) { return 1; }
+    if (mod == 0b00000010) { return 2; }
+    if (mod == 0b00000000 && rm == 0b00000110) { return 2; }
+    return 0;
+}
+
+enum {
+    max_prefixes = 4
+};
+
+// The operation of an instruction once its ModRM byte is known.
+inline instruction_family resolve_family(const opcode_entry *entry, uint8_t modrm) {
+    if (entry->group == group_none) { return entry->family; }
+    return group_families[entry->group][(modrm >> 3) & 0b00000111];
+}
+
+// Prefixes and total length of the instruction starting at the cursor. `entry`
+// is null when the bytes do not start a known instruction, in which case the
+// first byte is skipped (or, for a prefix, emitted on its own). When the input
+// ends before the length can be known the result is still larger than what is
+// left, so the caller reports the instruction as truncated.
+struct instruction_shape {
+    const opcode_entry *entry;
+    uint32_t prefixes;
+    uint32_t length;
+};
+
+inline instruction_shape measure_instruction(instruction_cursor *cursor) {
+    instruction_shape shape = {};
+    size_t available = cursor_remaining(cursor);
+
+    while (shape.prefixes < available && shape.prefixes < max_prefixes &&
+           opcode_lookup.entries[cursor_peek(cursor, shape.prefixes)].mode == prefix_byte) {
+        shape.prefixes += 1;
+    }
+
+    if (shape.prefixes == available) {
+        shape.length = shape.prefixes + 1;
+        return shape;
+    }
+
+    const opcode_entry *entry = &opcode_lookup.entries[cursor_peek(cursor, shape.prefixes)];
+    if (entry->mode == prefix_byte || (entry->family == family_unknown && entry->group == group_none)) {
+        shape.length = 1;
+        return shape;
+    }
+
+    shape.length = shape.prefixes + 1 + entry->disp_length + entry->imm_length;
+    if (entry->has_modrm) {
+        shape.length += 1;
+        if (available <= shape.prefixes + 1) { return shape; }
+
+        uint8_t modrm = cursor_peek(cursor, shape.prefixes + 1);
+        if (resolve_family(entry, modrm) == family_unknown) {
+            shape.length = 1;
+            return shape;
+        }
+
+        shape.length += displacement_length(modrm);
+        if (entry->group == group_unary && ((modrm >> 3) & 0b00000111) >= 2) {
+            shape.length -= entry->imm_length;
+        }
+    }
+
+    shape.entry = entry;
+    return shape;
+}
+
+inline uint16_t cursor_next_word(instruction_cursor *cursor) {
+    uint16_t low  = cursor_next(cursor);
+    uint16_t high = cursor_next(cursor);
+    return (uint16_t)((high << 8) | low);
+}
+
+// Reads the ModRM byte and any displacement after it. Returns the operand named
+// by mod/rm and stores the register named by the reg field in `reg`.
+inline operand decode_modrm(instruction_cursor *cursor, instruction *out, uint8_t *reg) {
+    uint8_t byte = cursor_next(cursor);
+    uint8_t mod = (byte >> 6) & 0b00000011;
+    uint8_t rm  = (byte >> 0) & 0b00000111;
+    *reg = (byte >> 3) & 0b00000111;
+
+    switch (mod) {
+        case 0b00000000: {
+            if (rm == 0b00000110) {
+                out->displacement = (int16_t) cursor_next_word(cursor);
+            }
+            break;
+        }
+        case 0b00000001: {  /* 8 bit displacement */
+            out->displacement = (int8_t) cursor_next(cursor);
+            break;
+        }
+        case 0b00000010: {  /* 16 bit displacement */
+            out->displacement = (int16_t) cursor_next_word(cursor);
+            break;
+        }
+        case 0b00000011: {
+            return { operand_register, (uint8_t)(((out->flags & instruction_wide) << 3) | rm) };
+        }
+    }
+
+    return { operand_memory, (uint8_t)((mod << 3) | rm) };
+}
+
+// Decodes one instruction whose bytes are known to be in range.
+inline void decode_instruction(const instruction_shape *shape, instruction_cursor *cursor, instruction *out) {
+    const opcode_entry *entry = shape->entry;
+
+    *out = {};
+    out->offset = (uint32_t) cursor->offset;
+
+    for (uint32_t i = 0; i < shape->prefixes; ++i) {
+        const opcode_entry *prefix = &opcode_lookup.entries[cursor_next(cursor)];
+        switch (prefix->family) {
+            case family_lock:  { out->flags |= instruction_lock;  break; }
+            case family_rep:   { out->flags |= instruction_rep;   break; }
+            case family_repne: { out->flags |= instruction_repne; break; }
+            default: {
+                out->flags &= ~(0b11 << 6);
+                out->flags |= instruction_segment_override | (prefix->reg << 6);
+                break;
+            }
+        }
+    }
+
+    cursor_next(cursor);
+
+    out->family = entry->family;
+    out->mode   = entry->mode;
+    out->flags |= entry->w ? instruction_wide : 0;
+
+    uint8_t w = entry->w;
+    uint8_t imm_length = entry->imm_length;
+    operand acc = { operand_register, (uint8_t)(w << 3) };
+
+    switch (entry->mode) {
+        case rm_to_rm: {
+            uint8_t reg;
+            operand rm = decode_modrm(cursor, out, &reg);
+            operand r  = { operand_register, (uint8_t)((w << 3) | reg) };
+            out->operands[0] = entry->d ? r : rm;
+            out->operands[1] = entry->d ? rm : r;
+            break;
+        }
+        case imm_to_rm: {
+            uint8_t reg;
+            out->operands[0] = decode_modrm(cursor, out, &reg);
+            out->operands[1] = { operand_immediate, entry->sign_extend };
+            out->flags |= instruction_explicit_size;
+            out->family = resolve_family(entry, (uint8_t)(reg << 3));
+            break;
+        }
+        case imm_to_r: {
+            out->operands[0] = { operand_register, (uint8_t)((w << 3) | entry->reg) };
+            out->operands[1] = { operand_immediate, 0 };
+            break;
+        }
+        case imm_to_acc:
+        case port_to_acc: {
+            out->operands[0] = acc;
+            out->operands[1] = { operand_immediate, 0 };
+            break;
+        }
+        case acc_to_port: {
+            out->operands[0] = { operand_immediate, 0 };
+            out->operands[1] = acc;
+            break;
+        }
+        case dx_to_acc:
+        case acc_to_dx: {
+            operand dx = { operand_register, (1 << 3) | 0b010 };
+            out->operands[0] = (entry->mode == dx_to_acc) ? acc : dx;
+            out->operands[1] = (entry->mode == dx_to_acc) ? dx : acc;
+            break;
+        }
+        case mem_to_acc:
+        case acc_to_mem: {
+            out->displacement = (int16_t) cursor_next_word(cursor);
+            operand memory = { operand_memory, 0b00000110 };
+            out->operands[0] = (entry->mode == mem_to_acc) ? acc : memory;
+            out->operands[1] = (entry->mode == mem_to_acc) ? memory : acc;
+            break;
+        }
+        case rm_to_seg:
+        case seg_to_rm: {
+            uint8_t reg;
+            operand rm      = decode_modrm(cursor, out, &reg);
+            operand segment = { operand_segment, (uint8_t)(reg & 0b00000011) };
+            out->operands[0] = (entry->mode == rm_to_seg) ? segment : rm;
+            out->operands[1] = (entry->mode == rm_to_seg) ? rm : segment;
+            break;
+        }
+        case rm_only: {
+            uint8_t reg;
+            out->operands[0] = decode_modrm(cursor, out, &reg);
+            out->family = resolve_family(entry, (uint8_t)(reg << 3));
+
+            if (entry->group == group_unary && reg < 2) {
+                out->mode = imm_to_rm;
+                out->operands[1] = { operand_immediate, 0 };
+            } else if (entry->group == group_unary) {
+                imm_length = 0;
+            }
+
+            if (out->family != family_call_far && out->family != family_jmp_far) {
+                out->flags |= instruction_explicit_size;
+            }
+            break;
+        }
+        case rm_by_one:
+        case rm_by_cl: {
+            uint8_t reg;
+            out->operands[0] = decode_modrm(cursor, out, &reg);
+            out->family = resolve_family(entry, (uint8_t)(reg << 3));
+            out->flags |= instruction_explicit_size;
+
+            if (entry->mode == rm_by_one) {
+                out->operands[1] = { operand_immediate, 0 };
+                out->immediate = 1;
+            } else {
+                out->operands[1] = { operand_register, 0b001 };
+            }
+            break;
+        }
+        case reg_only: {
+            out->operands[0] = { operand_register, (uint8_t)((w << 3) | entry->reg) };
+            break;
+        }
+        case seg_only: {
+            out->operands[0] = { operand_segment, entry->reg };
+            break;
+        }
+        case reg_to_acc: {
+            out->operands[0] = acc;
+            out->operands[1] = { operand_register, (uint8_t)((w << 3) | entry->reg) };
+            break;
+        }
+        case short_label: {
+            out->displacement = (int8_t) cursor_next(cursor);
+            out->operands[0] = { operand_relative, 0 };
+            break;
+        }
+        case near_label: {
+            out->displacement = (int16_t) cursor_next_word(cursor);
+            out->operands[0] = { operand_relative, 0 };
+            break;
+        }
+        case far_label: {
+            out->displacement = (int16_t) cursor_next_word(cursor);
+            out->operands[0] = { operand_far, 0 };
+            break;
+        }
+        case imm_only: {
+            out->operands[0] = { operand_immediate, 0 };
+            break;
+        }
+        case esc_rm: {
+            uint8_t reg;
+            out->operands[1] = decode_modrm(cursor, out, &reg);
+            out->operands[0] = { operand_immediate, 0 };
+            out->immediate = (uint16_t)((entry->reg << 3) | reg);
+            break;
+        }
+        case no_operands:
+        case prefix_byte:
+        case decode_mode_count: {
+            break;
+        }
+    }
+
+    if (imm_length == 2) {
+        out->immediate = cursor_next_word(cursor);
+    } else if (imm_length == 1 && entry->sign_extend) {
+        out->immediate = (uint16_t)(int16_t)(int8_t) cursor_next(cursor);
+    } else if (imm_length == 1) {
+        out->immediate = cursor_next(cursor);
+    }
+
+    out->length = (uint8_t)(cursor->offset - out->offset);
+}
+
+// A prefix byte that is not followed by an instruction it can apply to is kept
+// as a one-byte instruction of its own so the listing stays in sync.
+inline void decode_lone_prefix(instruction_cursor *cursor, instruction *out) {
+    const opcode_entry *entry = &opcode_lookup.entries[cursor_peek(cursor, 0)];
+
+    *out = {};
+    out->offset = (uint32_t) cursor->offset;
+    out->family = entry->family;
+    out->mode   = prefix_byte;
+    out->length = 1;
+
+    cursor_next(cursor);
+}
+
+struct decode_batch_result {
+    size_t count;
+    bool truncated;   // the instruction at the cursor runs past the end of input
+};
+
+// Decodes instructions from the cursor into `out` until `max` records are
+// written or the input ends. Bytes that do not start a known instruction are
+// skipped. Never allocates; the cursor is left after the last decoded record.
+inline decode_batch_result decode_batch(instruction_cursor *input, instruction *out, size_t max) {
+    decode_batch_result result = {};
+
+    while (result.count < max && cursor_remaining(input)) {
+        instruction_shape shape = measure_instruction(input);
+
+        if (shape.length > cursor_remaining(input)) {
+            result.truncated = true;
+            break;
+        }
+
+        if (shape.entry) {
+            decode_instruction(&shape, input, &out[result.count++]);
+        } else if (opcode_lookup.entries[cursor_peek(input, 0)].mode == prefix_byte) {
+            decode_lone_prefix(input, &out[result.count++]);
+        } else {
+            cursor_next(input);
+        }
+    }
+
+    return result;
+}
+
+// Embedding API. decode() walks a span and hands every instruction to a
+// visitor. The visitor is a template parameter, so its callbacks are inlined
+// into the loop and every visitor type gets a decode loop of its own, with no
+// virtual calls. A visitor provides
+//
+//   void on_instruction(const instruction &inst);
+//   void on_unknown(uint32_t offset, uint8_t byte);   // a byte that starts no instruction
+//
+// and can derive from decode_visitor for an on_unknown that does nothing.
+// Unknown bytes are skipped one at a time, as in the listing. Whether the span
+// decoded cleanly comes back in the result rather than through output or a
+// process exit code.
+struct byte_span {
+    const uint8_t *data;
+    size_t size;
+};
+
+enum decode_status : uint8_t {
+    decode_ok,
+    decode_truncated    // the instruction at `offset` needs `needed` bytes, more than are left
+};
+
+struct decode_result {
+    decode_status status;
+    uint32_t needed;
+    size_t offset;      // the end of the span, or where the truncated instruction starts
+    size_t count;       // instructions handed to the visitor
+};
+
+struct decode_visitor {
+    void on_unknown(uint32_t, uint8_t) {}
+};
+
+template <typename Visitor>
+inline decode_result decode(byte_span span, Visitor &visitor) {
+    instruction_cursor cursor = { span.data, span.size, 0 };
+    decode_result result = {};
+
+    while (cursor_remaining(&cursor)) {
+        instruction_shape shape = measure_instruction(&cursor);
+
+        if (shape.length > cursor_remaining(&cursor)) {
+            result.status = decode_truncated;
+            result.needed = shape.length;
+            break;
+        }
+
+        instruction inst;
+        if (shape.entry) {
+            decode_instruction(&shape, &cursor, &inst);
+        } else if (opcode_lookup.entries[cursor_peek(&cursor, 0)].mode == prefix_byte) {
+            decode_lone_prefix(&cursor, &inst);
+        } else {
+            uint32_t offset = (uint32_t) cursor.offset;
+            visitor.on_unknown(offset, cursor_next(&cursor));
+            continue;
+        }
+
+        visitor.on_instruction(inst);
+        result.count += 1;
+    }
+
+    result.offset = cursor.offset;
+    return result;
+}
+
+// Counts instructions and skipped bytes.
+struct instruction_counter {
+    uint64_t instructions;
+    uint64_t unknown_bytes;
+
+    void on_instruction(const instruction &) { instructions += 1; }
+    void on_unknown(uint32_t, uint8_t) { unknown_bytes += 1; }
+};
+
+// What a span is made of: instructions per family and decode mode, the mod
+// field of every ModRM byte, and the skipped bytes by value.
+struct instruction_histogram {
+    uint64_t instructions;
+    uint64_t families[family_count];
+    uint64_t modes[decode_mode_count];
+    uint64_t modrm_mods[4];
+    uint64_t unknown_opcodes[256];
+
+    void on_instruction(const instruction &inst) {
+        instructions += 1;
+        families[inst.family] += 1;
+        modes[inst.mode] += 1;
+        if (mode_has_modrm(inst.mode)) {
+            uint8_t mod = 0b00000011;
+            for (uint32_t i = 0; i < 2; ++i) {
+                if (inst.operands[i].kind == operand_memory) { mod = inst.operands[i].index >> 3; }
+            }
+            modrm_mods[mod] += 1;
+        }
+    }
+
+    void on_unknown(uint32_t, uint8_t byte) { unknown_opcodes[byte] += 1; }
+};
+
+inline void merge_histograms(instruction_histogram *into, const instruction_histogram *from) {
+    into->instructions += from->instructions;
+    for (uint32_t i = 0; i < family_count; ++i) { into->families[i] += from->families[i]; }
+    for (uint32_t i = 0; i < decode_mode_count; ++i) { into->modes[i] += from->modes[i]; }
+    for (uint32_t i = 0; i < 4; ++i) { into->modrm_mods[i] += from->modrm_mods[i]; }
+    for (uint32_t i = 0; i < 256; ++i) { into->unknown_opcodes[i] += from->unknown_opcodes[i]; }
+}
+
+} // namespace sim86
+
+#pragma pop_macro("FRAGMENT")
+
+#endif